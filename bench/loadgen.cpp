@@ -0,0 +1,738 @@
+// HTTP/1.1 load generator for benchmarking the server.
+//
+// Closed loop: every connection sends a request (or a pipelined batch) and
+// waits for the responses before sending again, so throughput is what the
+// server sustains. Open loop: requests are scheduled at a constant rate and
+// latency is measured from each request's scheduled start, not from when a
+// free connection finally sent it, so a stalled server shows up as the
+// queueing delay its clients would see (coordinated-omission correction, as
+// in wrk2).
+//
+// Results are printed, and written as JSON with --json, per scenario: RPS,
+// throughput, status counts and latency percentiles from a log-linear
+// histogram. --baseline compares against an earlier JSON file and exits 2 if
+// RPS dropped or p99 grew by more than --tolerance.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+namespace {
+
+int64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear latency histogram in nanoseconds: exact below 128, then 64
+// buckets per power of two (under 1.6% relative error), like HdrHistogram
+// with two significant digits. Merging is adding the counts.
+class LatencyHistogram {
+public:
+    LatencyHistogram() : counts(kLinear + 58 * kPerOctave) {}
+
+    void record(int64_t nanos) {
+        uint64_t value = nanos > 0 ? static_cast<uint64_t>(nanos) : 0;
+        counts[bucketOf(value)]++;
+        total++;
+        sum += value;
+        max = std::max(max, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t count() const { return total; }
+    double mean() const { return total ? static_cast<double>(sum) / total : 0; }
+    uint64_t maximum() const { return max; }
+
+    // Value at quantile q (0..1): the midpoint of the bucket holding it
+    double percentile(double q) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * total));
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min<double>(midpointOf(i), max);
+            }
+        }
+        return max;
+    }
+
+private:
+    static constexpr size_t kLinear = 128;
+    static constexpr size_t kPerOctave = 64;
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < kLinear) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - 6;
+        uint64_t top = value >> shift;
+        return kLinear + (shift - 1) * kPerOctave + (top - kPerOctave);
+    }
+
+    static double midpointOf(size_t bucket) {
+        if (bucket < kLinear) {
+            return bucket;
+        }
+        size_t offset = bucket - kLinear;
+        int shift = offset / kPerOctave + 1;
+        uint64_t top = offset % kPerOctave + kPerOctave;
+        uint64_t low = top << shift;
+        return low + ((uint64_t(1) << shift) - 1) / 2.0;
+    }
+};
+
+struct Scenario {
+    std::string name = "custom";
+    std::string path = "/";
+    int connections = 64;
+    int threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+    double duration = 5;
+    double warmup = 1;
+    // Requests written back to back per connection before reading
+    int pipeline = 1;
+    bool keepalive = true;
+    // Requests per second across all threads; 0 runs closed loop
+    double rate = 0;
+};
+
+struct Result {
+    LatencyHistogram latency;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    uint64_t connects = 0;
+    std::map<int, uint64_t> statuses;
+
+    void merge(const Result& other) {
+        latency.merge(other.latency);
+        requests += other.requests;
+        errors += other.errors;
+        bytes += other.bytes;
+        connects += other.connects;
+        for (const auto& status : other.statuses) {
+            statuses[status.first] += status.second;
+        }
+    }
+};
+
+// One client connection and the incremental response parser for it
+struct Client {
+    int fd = -1;
+    bool connected = false;
+    std::string output;
+    size_t output_offset = 0;
+    // Start times (scheduled or actual) of requests awaiting a response
+    std::deque<int64_t> starts;
+    std::string head;
+    bool in_body = false;
+    uint64_t body_remaining = 0;
+    int status = 0;
+    bool close_after = false;
+};
+
+class Worker {
+public:
+    Worker(const Scenario& scenario, const sockaddr_storage& address, socklen_t address_length, int connections,
+           double rate)
+        : scenario(scenario), address(address), address_length(address_length), clients(connections), rate(rate) {
+        request = "GET " + scenario.path + " HTTP/1.1\r\nHost: localhost\r\nUser-Agent: loadgen\r\n";
+        request += scenario.keepalive ? "\r\n" : "Connection: close\r\n\r\n";
+    }
+
+    // Runs until deadline; responses completing before record_from only warm up
+    void run(int64_t record_from, int64_t deadline) {
+        this->record_from = record_from;
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        for (Client& client : clients) {
+            openConnection(client);
+        }
+
+        int64_t interval = rate > 0 ? static_cast<int64_t>(1e9 / rate) : 0;
+        int64_t next_send = nowNanos();
+        epoll_event events[256];
+        std::vector<char> buffer(256 * 1024);
+
+        while (true) {
+            int64_t now = nowNanos();
+            if (now >= deadline) {
+                break;
+            }
+            int64_t timeout = std::min<int64_t>(deadline - now, 100000000);
+            if (interval > 0) {
+                // Everything scheduled up to now waits for a free connection
+                while (next_send <= now) {
+                    pending.push_back(next_send);
+                    next_send += interval;
+                }
+                dispatchPending();
+                timeout = std::min(timeout, next_send - now);
+            }
+
+            int n = waitForEvents(events, 256, timeout);
+            for (int i = 0; i < n; i++) {
+                Client& client = *static_cast<Client*>(events[i].data.ptr);
+                handleEvent(client, events[i].events, buffer);
+            }
+        }
+
+        for (Client& client : clients) {
+            if (client.fd >= 0) {
+                close(client.fd);
+            }
+        }
+        close(epoll_fd);
+    }
+
+    Result result;
+
+private:
+    const Scenario& scenario;
+    sockaddr_storage address;
+    socklen_t address_length;
+    std::vector<Client> clients;
+    double rate;
+    std::string request;
+    int epoll_fd = -1;
+    int64_t record_from = 0;
+    // Open loop: scheduled start times not yet sent, and connections free
+    // to send them
+    std::deque<int64_t> pending;
+    std::vector<Client*> idle;
+
+    // Sub-millisecond timeouts keep open-loop sends on schedule; kernels
+    // before 5.11 lack epoll_pwait2() and get epoll_wait()'s milliseconds
+    int waitForEvents(epoll_event* events, int max_events, int64_t timeout_nanos) {
+        static std::atomic<bool> have_pwait2{true};
+        if (have_pwait2.load(std::memory_order_relaxed)) {
+            struct timespec timeout{timeout_nanos / 1000000000, timeout_nanos % 1000000000};
+            int n = epoll_pwait2(epoll_fd, events, max_events, &timeout, nullptr);
+            if (n >= 0 || errno != ENOSYS) {
+                return n;
+            }
+            have_pwait2.store(false, std::memory_order_relaxed);
+        }
+        return epoll_wait(epoll_fd, events, max_events, static_cast<int>((timeout_nanos + 999999) / 1000000));
+    }
+
+    void openConnection(Client& client) {
+        client = Client();
+        client.fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (client.fd < 0) {
+            result.errors++;
+            return;
+        }
+        int one = 1;
+        setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(client.fd, reinterpret_cast<const sockaddr*>(&address), address_length) < 0 &&
+            errno != EINPROGRESS) {
+            close(client.fd);
+            client.fd = -1;
+            result.errors++;
+            return;
+        }
+        result.connects++;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = &client;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client.fd, &ev);
+        if (rate == 0) {
+            // Closed loop: the first batch waits in the socket until connected
+            queueRequests(client, scenario.pipeline, nowNanos());
+        }
+    }
+
+    void queueRequests(Client& client, int count, int64_t start) {
+        for (int i = 0; i < count; i++) {
+            client.output += request;
+            client.starts.push_back(start);
+        }
+    }
+
+    void dispatchPending() {
+        while (!pending.empty() && !idle.empty()) {
+            Client* client = idle.back();
+            idle.pop_back();
+            queueRequests(*client, 1, pending.front());
+            pending.pop_front();
+            flush(*client);
+        }
+    }
+
+    void handleEvent(Client& client, uint32_t events, std::vector<char>& buffer) {
+        if (!client.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                fail(client);
+                return;
+            }
+            client.connected = true;
+            if (rate > 0 && client.starts.empty()) {
+                idle.push_back(&client);
+                dispatchPending();
+            }
+        }
+        if (client.connected && (events & EPOLLOUT)) {
+            if (!flush(client)) {
+                return;
+            }
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            readResponses(client, buffer);
+        }
+    }
+
+    // Returns false if the connection failed
+    bool flush(Client& client) {
+        while (client.connected && client.output_offset < client.output.size()) {
+            ssize_t sent = send(client.fd, client.output.data() + client.output_offset,
+                                client.output.size() - client.output_offset, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                fail(client);
+                return false;
+            }
+            client.output_offset += sent;
+        }
+        if (client.output_offset == client.output.size()) {
+            client.output.clear();
+            client.output_offset = 0;
+        }
+        return true;
+    }
+
+    void readResponses(Client& client, std::vector<char>& buffer) {
+        while (true) {
+            ssize_t received = read(client.fd, buffer.data(), buffer.size());
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (received <= 0) {
+                // EOF: fine between responses on a closing connection
+                if (client.starts.empty() && !client.in_body && client.head.empty()) {
+                    reconnect(client);
+                } else {
+                    fail(client);
+                }
+                return;
+            }
+            result.bytes += received;
+            if (!consume(client, buffer.data(), received)) {
+                return;
+            }
+        }
+    }
+
+    // Feeds received bytes to the parser; returns false once the client has
+    // been reconnected or failed
+    bool consume(Client& client, const char* data, size_t length) {
+        while (length > 0) {
+            if (client.in_body) {
+                size_t take = std::min<uint64_t>(length, client.body_remaining);
+                client.body_remaining -= take;
+                data += take;
+                length -= take;
+                if (client.body_remaining == 0 && !finishResponse(client)) {
+                    return false;
+                }
+                continue;
+            }
+
+            size_t previous = client.head.size();
+            client.head.append(data, length);
+            size_t end = client.head.find("\r\n\r\n", previous >= 3 ? previous - 3 : 0);
+            if (end == std::string::npos) {
+                if (client.head.size() > 64 * 1024) {
+                    fail(client);
+                    return false;
+                }
+                return true;
+            }
+            size_t head_length = end + 4;
+            size_t used = head_length - previous;
+            if (!parseHead(client, std::string_view(client.head).substr(0, head_length))) {
+                fail(client);
+                return false;
+            }
+            client.head.clear();
+            data += used;
+            length -= used;
+            client.in_body = true;
+            if (client.body_remaining == 0 && !finishResponse(client)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool parseHead(Client& client, std::string_view head) {
+        if (head.size() < 12 || head.substr(0, 5) != "HTTP/") {
+            return false;
+        }
+        client.status = std::atoi(std::string(head.substr(9, 3)).c_str());
+        client.body_remaining = 0;
+        client.close_after = false;
+        size_t position = head.find("\r\n");
+        while (position != std::string_view::npos && position + 2 < head.size()) {
+            size_t line_end = head.find("\r\n", position + 2);
+            std::string_view line = head.substr(position + 2, line_end - position - 2);
+            size_t colon = line.find(':');
+            if (colon != std::string_view::npos) {
+                std::string name(line.substr(0, colon));
+                std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+                std::string_view value = line.substr(colon + 1);
+                while (!value.empty() && value.front() == ' ') {
+                    value.remove_prefix(1);
+                }
+                if (name == "content-length") {
+                    client.body_remaining = std::strtoull(std::string(value).c_str(), nullptr, 10);
+                } else if (name == "connection" && value.substr(0, 5) == "close") {
+                    client.close_after = true;
+                }
+            }
+            position = line_end;
+        }
+        return true;
+    }
+
+    // Records the response at the front; returns false if the connection
+    // was replaced
+    bool finishResponse(Client& client) {
+        client.in_body = false;
+        if (client.starts.empty()) {
+            fail(client);
+            return false;
+        }
+        int64_t now = nowNanos();
+        int64_t start = client.starts.front();
+        client.starts.pop_front();
+        if (now >= record_from) {
+            result.latency.record(now - start);
+            result.requests++;
+            result.statuses[client.status]++;
+        }
+
+        if (client.close_after || !scenario.keepalive) {
+            if (!client.starts.empty()) {
+                // Requests sent behind the closing one are lost
+                result.errors += client.starts.size();
+            }
+            reconnect(client);
+            return false;
+        }
+        if (client.starts.empty()) {
+            if (rate > 0) {
+                idle.push_back(&client);
+                dispatchPending();
+            } else {
+                queueRequests(client, scenario.pipeline, now);
+                flush(client);
+            }
+        }
+        return true;
+    }
+
+    void reconnect(Client& client) {
+        forgetIdle(client);
+        std::deque<int64_t> unsent;
+        if (rate > 0) {
+            // Scheduled requests still count from their scheduled time
+            unsent.swap(client.starts);
+        }
+        close(client.fd);
+        openConnection(client);
+        for (int64_t start : unsent) {
+            pending.push_front(start);
+        }
+    }
+
+    void fail(Client& client) {
+        result.errors++;
+        client.starts.clear();
+        reconnect(client);
+    }
+
+    void forgetIdle(Client& client) {
+        idle.erase(std::remove(idle.begin(), idle.end(), &client), idle.end());
+    }
+};
+
+Result runScenario(const Scenario& scenario, const sockaddr_storage& address, socklen_t address_length) {
+    int threads = std::max(1, std::min(scenario.threads, scenario.connections));
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < threads; i++) {
+        int connections = scenario.connections / threads + (i < scenario.connections % threads ? 1 : 0);
+        workers.push_back(std::make_unique<Worker>(scenario, address, address_length, connections,
+                                                   scenario.rate / threads));
+    }
+
+    int64_t start = nowNanos();
+    int64_t record_from = start + static_cast<int64_t>(scenario.warmup * 1e9);
+    int64_t deadline = record_from + static_cast<int64_t>(scenario.duration * 1e9);
+    std::vector<std::thread> running;
+    for (auto& worker : workers) {
+        running.emplace_back(&Worker::run, worker.get(), record_from, deadline);
+    }
+    for (auto& thread : running) {
+        thread.join();
+    }
+
+    Result total;
+    for (auto& worker : workers) {
+        total.merge(worker->result);
+    }
+    return total;
+}
+
+std::string formatMicros(double nanos) {
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << nanos / 1000.0;
+    return out.str();
+}
+
+std::string toJson(const Scenario& scenario, const Result& result) {
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << "  {\"scenario\": \"" << scenario.name << "\", \"path\": \"" << scenario.path << "\", \"mode\": \""
+        << (scenario.rate > 0 ? "open" : "closed") << "\", \"connections\": " << scenario.connections
+        << ", \"threads\": " << scenario.threads << ", \"pipeline\": " << scenario.pipeline
+        << ", \"keepalive\": " << (scenario.keepalive ? "true" : "false") << ", \"rate\": " << scenario.rate
+        << ", \"duration_s\": " << scenario.duration << ", \"requests\": " << result.requests
+        << ", \"errors\": " << result.errors << ", \"connects\": " << result.connects
+        << ", \"rps\": " << result.requests / scenario.duration
+        << ", \"bytes_per_sec\": " << result.bytes / scenario.duration << ", \"status\": {";
+    bool first = true;
+    for (const auto& status : result.statuses) {
+        out << (first ? "" : ", ") << "\"" << status.first << "\": " << status.second;
+        first = false;
+    }
+    out << "}, \"latency_us\": {\"mean\": " << formatMicros(result.latency.mean())
+        << ", \"p50\": " << formatMicros(result.latency.percentile(0.50))
+        << ", \"p90\": " << formatMicros(result.latency.percentile(0.90))
+        << ", \"p99\": " << formatMicros(result.latency.percentile(0.99))
+        << ", \"p999\": " << formatMicros(result.latency.percentile(0.999))
+        << ", \"max\": " << formatMicros(result.latency.maximum()) << "}}";
+    return out.str();
+}
+
+void printSummary(const Scenario& scenario, const Result& result) {
+    std::cout << scenario.name << ": " << static_cast<uint64_t>(result.requests / scenario.duration) << " req/s, "
+              << result.errors << " errors, p50 " << formatMicros(result.latency.percentile(0.50)) << " us, p99 "
+              << formatMicros(result.latency.percentile(0.99)) << " us, p999 "
+              << formatMicros(result.latency.percentile(0.999)) << " us" << std::endl;
+}
+
+// Pulls "key": number out of the object for one scenario in our own JSON
+double jsonNumber(const std::string& object, const std::string& key) {
+    size_t at = object.find("\"" + key + "\": ");
+    return at == std::string::npos ? NAN : std::strtod(object.c_str() + at + key.size() + 4, nullptr);
+}
+
+// Returns the number of scenarios that regressed against the baseline
+int compareBaseline(const std::string& path, const std::vector<std::pair<Scenario, std::string>>& results,
+                    double tolerance) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Cannot read baseline " << path << std::endl;
+        return 1;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string baseline = contents.str();
+
+    int regressions = 0;
+    for (const auto& entry : results) {
+        size_t at = baseline.find("\"scenario\": \"" + entry.first.name + "\"");
+        if (at == std::string::npos) {
+            std::cout << entry.first.name << ": not in baseline" << std::endl;
+            continue;
+        }
+        std::string before = baseline.substr(at, baseline.find('\n', at) - at);
+        double old_rps = jsonNumber(before, "rps");
+        double new_rps = jsonNumber(entry.second, "rps");
+        double old_p99 = jsonNumber(before, "p99");
+        double new_p99 = jsonNumber(entry.second, "p99");
+        bool slower = new_rps < old_rps * (1 - tolerance);
+        bool laggier = new_p99 > old_p99 * (1 + tolerance);
+        std::cout << entry.first.name << ": rps " << old_rps << " -> " << new_rps << ", p99 " << old_p99 << " -> "
+                  << new_p99 << " us" << (slower || laggier ? "  REGRESSION" : "") << std::endl;
+        regressions += slower || laggier;
+    }
+    return regressions;
+}
+
+// The scenarios `bench` runs; the server must serve /bench/small.txt and
+// /bench/large.bin
+std::vector<Scenario> suite(const Scenario& defaults) {
+    std::vector<Scenario> scenarios;
+    auto add = [&](const std::string& name, const std::string& path) -> Scenario& {
+        Scenario scenario = defaults;
+        scenario.name = name;
+        scenario.path = path;
+        scenarios.push_back(scenario);
+        return scenarios.back();
+    };
+    add("small-hit", "/bench/small.txt");
+    add("large-file", "/bench/large.bin").connections = std::min(defaults.connections, 16);
+    add("not-found", "/bench/missing.txt");
+    add("connection-close", "/bench/small.txt").keepalive = false;
+    add("pipelined", "/bench/small.txt").pipeline = 16;
+    // Open loop below the closed-loop peak: latency under a steady load
+    add("open-loop", "/bench/small.txt").rate = defaults.rate > 0 ? defaults.rate : 20000;
+    return scenarios;
+}
+
+void usage() {
+    std::cerr << "Usage: loadgen [--host=H] [--port=P] [--path=/x] [--connections=N] [--threads=N]\n"
+                 "               [--duration=S] [--warmup=S] [--pipeline=N] [--close] [--rate=R]\n"
+                 "               [--name=LABEL] [--suite] [--json=FILE] [--baseline=FILE] [--tolerance=F]\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    Scenario defaults;
+    std::string host = "127.0.0.1";
+    std::string port = "8080";
+    std::string json_path;
+    std::string baseline_path;
+    double tolerance = 0.10;
+    bool run_suite = false;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            auto value = [&arg](size_t prefix) { return arg.substr(prefix); };
+            if (arg.rfind("--host=", 0) == 0) {
+                host = value(7);
+            } else if (arg.rfind("--port=", 0) == 0) {
+                port = value(7);
+            } else if (arg.rfind("--path=", 0) == 0) {
+                defaults.path = value(7);
+            } else if (arg.rfind("--connections=", 0) == 0) {
+                defaults.connections = std::max(1, std::stoi(value(14)));
+            } else if (arg.rfind("--threads=", 0) == 0) {
+                defaults.threads = std::max(1, std::stoi(value(10)));
+            } else if (arg.rfind("--duration=", 0) == 0) {
+                defaults.duration = std::stod(value(11));
+            } else if (arg.rfind("--warmup=", 0) == 0) {
+                defaults.warmup = std::stod(value(9));
+            } else if (arg.rfind("--pipeline=", 0) == 0) {
+                defaults.pipeline = std::max(1, std::stoi(value(11)));
+            } else if (arg == "--close") {
+                defaults.keepalive = false;
+            } else if (arg.rfind("--rate=", 0) == 0) {
+                defaults.rate = std::stod(value(7));
+            } else if (arg.rfind("--name=", 0) == 0) {
+                defaults.name = value(7);
+            } else if (arg == "--suite") {
+                run_suite = true;
+            } else if (arg.rfind("--json=", 0) == 0) {
+                json_path = value(7);
+            } else if (arg.rfind("--baseline=", 0) == 0) {
+                baseline_path = value(11);
+            } else if (arg.rfind("--tolerance=", 0) == 0) {
+                tolerance = std::stod(value(12));
+            } else {
+                usage();
+                return 1;
+            }
+        }
+    } catch (const std::exception&) {
+        usage();
+        return 1;
+    }
+    if (defaults.duration <= 0) {
+        usage();
+        return 1;
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* resolved = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &resolved) != 0 || resolved == nullptr) {
+        std::cerr << "Cannot resolve " << host << ":" << port << std::endl;
+        return 1;
+    }
+    sockaddr_storage address{};
+    std::memcpy(&address, resolved->ai_addr, resolved->ai_addrlen);
+    socklen_t address_length = resolved->ai_addrlen;
+    freeaddrinfo(resolved);
+
+    std::vector<Scenario> scenarios = run_suite ? suite(defaults) : std::vector<Scenario>{defaults};
+    std::vector<std::pair<Scenario, std::string>> results;
+    for (const Scenario& scenario : scenarios) {
+        Result result = runScenario(scenario, address, address_length);
+        printSummary(scenario, result);
+        results.emplace_back(scenario, toJson(scenario, result));
+    }
+
+    if (!json_path.empty()) {
+        std::ofstream out(json_path);
+        out << "[\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            out << results[i].second << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        out << "]\n";
+        if (!out) {
+            std::cerr << "Failed to write " << json_path << std::endl;
+            return 1;
+        }
+    }
+
+    if (!baseline_path.empty() && compareBaseline(baseline_path, results, tolerance) > 0) {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Runs the benchmark suite: serves a generated tree with the given server
+# binary and drives it with loadgen. Used by the CMake `bench` target.
+#
+#   run.sh SERVER LOADGEN OUTPUT_DIR
+#
+# Environment: BENCH_PORT (18181), BENCH_DURATION (seconds per scenario, 5),
+# BENCH_BASELINE (earlier bench.json to compare with), BENCH_TOLERANCE (0.10),
+# BENCH_SERVER_ARGS (extra server flags, e.g. --io=uring).
+set -eu
+
+server=$1
+loadgen=$2
+output=$3
+port=${BENCH_PORT:-18181}
+duration=${BENCH_DURATION:-5}
+
+root=$output/bench-root
+mkdir -p "$root/bench"
+head -c 1024 /dev/zero | tr '\0' 'a' > "$root/bench/small.txt"
+if [ ! -f "$root/bench/large.bin" ]; then
+    head -c 10485760 /dev/urandom > "$root/bench/large.bin"
+fi
+
+# shellcheck disable=SC2086
+"$server" "$port" "$root" --max-requests=0 ${BENCH_SERVER_ARGS:-} > "$output/bench-server.log" 2>&1 &
+server_pid=$!
+trap 'kill -INT $server_pid 2>/dev/null; wait $server_pid 2>/dev/null || true' EXIT
+
+# Wait for the listener
+tries=0
+until "$loadgen" --port="$port" --path=/bench/small.txt --connections=1 --threads=1 \
+        --duration=0.05 --warmup=0 > /dev/null 2>&1; do
+    tries=$((tries + 1))
+    if [ $tries -ge 50 ] || ! kill -0 $server_pid 2>/dev/null; then
+        echo "Server did not start; see $output/bench-server.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+set -- --port="$port" --suite --duration="$duration" --json="$output/bench.json"
+if [ -n "${BENCH_BASELINE:-}" ]; then
+    set -- "$@" --baseline="$BENCH_BASELINE" --tolerance="${BENCH_TOLERANCE:-0.10}"
+fi
+"$loadgen" "$@"
+echo "Results written to $output/bench.json"
@@ -0,0 +1,69 @@
+// On-disk layout of an asset bundle: a web root packed by tools/pack.cpp into
+// one file that http.cpp maps read-only (--bundle=FILE).
+//
+//   BundleHeader
+//   BundleEntry[entry_count]    sorted by path_hash, then by path
+//   path bytes                  "/a/b.html", not NUL-terminated
+//   padding to a page
+//   bodies                      8-byte aligned; those of a page or more start on a page
+//
+// Integers are in host byte order: a bundle is built for the servers that
+// run it, not exchanged between architectures.
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+constexpr char kBundleMagic[8] = {'H', 'T', 'T', 'P', 'B', 'N', 'D', 'L'};
+constexpr uint32_t kBundleVersion = 1;
+constexpr uint64_t kBundlePageBytes = 4096;
+
+// Representations a bundle can hold for a path; the codings follow the
+// server's order of preference
+enum BundleVariant : unsigned {
+    BundleIdentity,
+    BundleBrotli,
+    BundleZstd,
+    BundleGzip,
+    kBundleVariants
+};
+
+struct BundleHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint64_t index_offset;
+    uint64_t paths_offset;
+    uint64_t paths_bytes;
+    // Size of the whole bundle, so a truncated copy is refused
+    uint64_t file_bytes;
+};
+
+// A variant is absent when its offset is 0; the identity one is always there
+struct BundleExtent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct BundleEntry {
+    uint64_t path_hash;
+    // Hash of the identity body; the ETag, so it survives repacking
+    uint64_t content_hash;
+    int64_t mtime;
+    uint32_t path_offset;
+    uint32_t path_length;
+    BundleExtent variants[kBundleVariants];
+};
+
+static_assert(sizeof(BundleHeader) == 48, "BundleHeader layout");
+static_assert(sizeof(BundleEntry) == 96, "BundleEntry layout");
+
+// 64-bit FNV-1a, for paths and bodies alike
+constexpr uint64_t kBundleHashSeed = 0xcbf29ce484222325ull;
+
+inline uint64_t bundleHash(std::string_view bytes, uint64_t hash = kBundleHashSeed) {
+    for (unsigned char c : bytes) {
+        hash = (hash ^ c) * 0x100000001b3ull;
+    }
+    return hash;
+}
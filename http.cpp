@@ -1,240 +1,10455 @@
 #include <iostream>
 #include <string>
-#include <sstream>
 #include <fstream>
-#include <map>
 #include <ctime>
+#include <chrono>
+#include <strings.h>
+#include <cstring>
+#include <string_view>
+#include <charconv>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#else
+#undef SYS_openat2
+#endif
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <climits>
 #include <filesystem>
 #include <thread>
 #include <vector>
+#include <memory>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <optional>
+#include <tuple>
+#include <stdexcept>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/filter.h>
+#if __has_include(<linux/mempolicy.h>)
+#include <linux/mempolicy.h>
+#endif
+#include "bundle.h"
+// On-the-fly compression uses whichever encoder libraries are installed
+// (link with -lz, -lbrotlienc, -lzstd). Precompressed siblings are served
+// either way. Define HTTP_NO_<LIB> to leave one out.
+#if !defined(HTTP_NO_ZLIB) && __has_include(<zlib.h>)
+#include <zlib.h>
+#define HTTP_HAVE_ZLIB 1
+#endif
+#if !defined(HTTP_NO_BROTLI) && __has_include(<brotli/encode.h>)
+#include <brotli/encode.h>
+#define HTTP_HAVE_BROTLI 1
+#endif
+#if !defined(HTTP_NO_ZSTD) && __has_include(<zstd.h>)
+#include <zstd.h>
+#define HTTP_HAVE_ZSTD 1
+#endif
+// TLS termination needs OpenSSL 1.1.1 or later (-lssl -lcrypto), and 3.0
+// built with kTLS to hand record encryption to the kernel. Define
+// HTTP_NO_TLS to leave it out.
+#if !defined(HTTP_NO_TLS) && __has_include(<openssl/ssl.h>)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#define HTTP_HAVE_TLS 1
+#endif
+// With --trace, every recorded stage also fires the USDT probe http:stage
+// (stage, connection, start and end in ns) where <sys/sdt.h> is installed.
+// Define HTTP_NO_USDT to leave the probes out.
+#if !defined(HTTP_NO_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HTTP_TRACE_PROBE(what, connection, start, end) DTRACE_PROBE4(http, stage, what, connection, start, end)
+#else
+#define HTTP_TRACE_PROBE(what, connection, start, end) ((void)0)
+#endif
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+enum class IoBackend {
+    Epoll,
+    Uring
+};
+
+enum class AccessLogFormat {
+    Combined,
+    Json
+};
+
+class Router;
+
+struct ServerConfig {
+    int port = 8080;
+    std::string web_root = "./www";
+    int loop_threads = std::max(1u, std::thread::hardware_concurrency());
+    // Give every loop its own SO_REUSEPORT listener instead of sharing one
+    bool reuse_port = false;
+    // Pin loop i to the i-th CPU this process may run on (modulo their count)
+    bool pin_threads = false;
+    // CPUs the loops are pinned to, in loop order; implies pin_threads
+    std::vector<int> loop_cpus;
+    // Steer each connection to the loop pinned to the CPU that received it;
+    // needs reuse_port and pinned loops, one per CPU
+    bool incoming_cpu = false;
+    // Seconds an idle keep-alive connection is kept open; 0 disables keep-alive
+    int keepalive_timeout = 15;
+    // Requests served on one connection before it is closed; 0 means no limit
+    int max_keepalive_requests = 1000;
+    // Largest request head accepted; also caps the receive buffer. Larger
+    // heads are answered with 431.
+    size_t max_header_bytes = 16 * 1024;
+    // Byte budget of the in-memory hot-file cache, split evenly between the
+    // loops' shards; 0 disables it
+    size_t cache_max_bytes = 64 * 1024 * 1024;
+    // Files larger than this are always sent with sendfile()
+    size_t cache_max_file_bytes = 1024 * 1024;
+    // Descriptors of those larger files kept open between requests and
+    // dropped on inotify events; 0 disables it
+    size_t open_file_cache_entries = 1024;
+    // Bundle written by tools/pack whose paths are served from memory ahead
+    // of web_root; SIGHUP maps it again. Optionally faulted in at startup
+    // (MAP_POPULATE) and locked in memory.
+    std::string bundle_path;
+    bool bundle_populate = false;
+    bool bundle_lock = false;
+    // Keep a snapshot of web_root's metadata, updated from inotify, so
+    // lookups, 404s and cache revalidation need no system calls
+    bool metadata_snapshot = false;
+    // List directories that have no index.html (uses the snapshot)
+    bool autoindex = false;
+    // Threads for blocking work (cold file loads); 0 does it on the loops
+    int worker_threads = 4;
+    // Waiting worker tasks before new ones are refused with 503
+    size_t worker_queue_limit = 1024;
+    // Connections open at once across all loops; each loop takes an equal
+    // share and stops accepting while at it. 0 derives the limit from
+    // RLIMIT_NOFILE, leaving room for file descriptors.
+    size_t max_connections = 0;
+    // Pending-connection queue of each listener (capped by somaxconn)
+    int listen_backlog = 4096;
+    // Wake accept() only once a connection has sent data (TCP_DEFER_ACCEPT)
+    bool defer_accept = true;
+    // Seconds to receive a whole request head (from its first byte, or from
+    // accept() for a connection's first request), to make progress reading
+    // a request body and to make progress writing a response
+    int header_timeout = 10;
+    int body_timeout = 30;
+    int write_timeout = 30;
+    // Readiness-based epoll loops, or completion-based io_uring loops
+    IoBackend io_backend = IoBackend::Epoll;
+    // Send large cached bodies with MSG_ZEROCOPY (epoll backend). Pays off
+    // for bodies of tens of KB and up on real NICs; loopback always copies.
+    bool zerocopy = false;
+    // Negotiate Content-Encoding: precompressed siblings and cached
+    // compressed variants of compressible types
+    bool compression = true;
+    // mime.types file whose mappings override the built-in table
+    std::string mime_types_file;
+    // Request path answered with Prometheus metrics instead of a file;
+    // empty disables the endpoint
+    std::string metrics_path;
+    // Access log file ("-" for standard output); empty disables logging.
+    // Successful responses are sampled at the rate; errors are all logged.
+    std::string access_log_path;
+    AccessLogFormat access_log_format = AccessLogFormat::Combined;
+    double access_log_sample = 1.0;
+    // File SIGUSR1 writes the latest request stages to, as Chrome trace
+    // JSON; empty disables tracing. Each loop keeps the last trace_events.
+    std::string trace_path;
+    size_t trace_events = 65536;
+    // Seconds a graceful shutdown lets in-flight requests finish before
+    // the remaining connections are closed
+    int drain_timeout = 30;
+    // Unix socket for zero-downtime upgrades. A process started with the
+    // same path takes over the listeners of the one serving on it, which
+    // then drains and exits.
+    std::string reload_socket;
+    // PEM certificate chain and private key (the key may live in the
+    // certificate file); when set, the listener speaks HTTPS only
+    std::string tls_certificate;
+    std::string tls_key;
+    // 80 bytes of session ticket keys shared by every process serving the
+    // site, so tickets survive restarts; random per process when empty
+    std::string tls_ticket_key_file;
+    // Speak HTTP/2: negotiated with ALPN over TLS, and on cleartext
+    // connections that open with the HTTP/2 preface (prior knowledge)
+    bool http2 = true;
+    // Cache-Control values keyed by request path prefix ("/static/") or MIME
+    // type ("text/html", "image/*"); the longest path prefix wins, then MIME
+    std::vector<std::pair<std::string, std::string>> cache_control;
+    // Application routes, matched ahead of the metrics path and the files
+    // beneath web_root; set by programs that embed the server
+    std::shared_ptr<const Router> router;
+};
+
+// Shared "Date: ...\r\n" header line. Whichever thread first sees the
+// second roll over re-renders it into the next slot of a small ring and
+// publishes it with one atomic store; readers only load the pointer and
+// copy. As in nginx's cached time, a slot is reused only after the ring has
+// wrapped, long after any reader finished copying it.
+class DateCache {
+public:
+    DateCache() {
+        refresh(time(nullptr));
+    }
+
+    std::string_view line() {
+        time_t now = time(nullptr);
+        const Slot* slot = current.load(std::memory_order_acquire);
+        if (slot->second != now && !refreshing.exchange(true, std::memory_order_acquire)) {
+            refresh(now);
+            refreshing.store(false, std::memory_order_release);
+            slot = current.load(std::memory_order_acquire);
+        }
+        return std::string_view(slot->text, slot->length);
+    }
+
+private:
+    struct Slot {
+        time_t second = 0;
+        size_t length = 0;
+        char text[64];
+    };
+
+    static constexpr size_t slot_count = 16;
+
+    Slot slots[slot_count];
+    size_t next_slot = 0;
+    std::atomic<const Slot*> current{nullptr};
+    std::atomic<bool> refreshing{false};
+
+    void refresh(time_t now) {
+        Slot& slot = slots[next_slot];
+        next_slot = (next_slot + 1) % slot_count;
+
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        slot.second = now;
+        slot.length = strftime(slot.text, sizeof(slot.text), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        current.store(&slot, std::memory_order_release);
+    }
+};
+
+// Pre-rendered header blocks of one representation of a file. Date and
+// Connection are per response and appended when the response is queued.
+struct RepresentationHeaders {
+    // Complete 200 and 304 status lines and headers
+    std::string ok;
+    std::string not_modified;
+    // "Content-Type: ...\r\n", plus Content-Encoding for compressed variants
+    std::string representation;
+    // ETag through Server lines, shared by every status
+    std::string validators;
+    std::string mime_type;
+    std::string content_encoding;
+    std::string etag;
+    time_t last_modified = 0;
+
+    size_t bytes() const {
+        return ok.size() + not_modified.size() + representation.size() + validators.size() + mime_type.size() +
+               content_encoding.size() + etag.size();
+    }
+};
+
+// The file a cached body was read from, as of that read, and the coding
+// the server compressed it to (0 for the bytes as read). Equal sources
+// make equal bodies, so a body is found again before any read.
+struct BodySource {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    unsigned coding;
+
+    static BodySource of(const struct stat& st, unsigned coding) {
+        return {st.st_dev, st.st_ino, st.st_size, st.st_mtim, coding};
+    }
+
+    bool operator==(const BodySource& other) const {
+        return device == other.device && inode == other.inode && size == other.size &&
+               mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec && coding == other.coding;
+    }
+};
+
+struct BodySourceHash {
+    size_t operator()(const BodySource& source) const {
+        uint64_t hash = static_cast<uint64_t>(source.inode) * 0x9e3779b97f4a7c15ull;
+        for (uint64_t part : {static_cast<uint64_t>(source.device), static_cast<uint64_t>(source.size),
+                              static_cast<uint64_t>(source.mtime.tv_sec), static_cast<uint64_t>(source.mtime.tv_nsec),
+                              static_cast<uint64_t>(source.coding)}) {
+            hash = (hash ^ part) * 0x100000001b3ull;
+        }
+        return static_cast<size_t>(hash ^ (hash >> 32));
+    }
+};
+
+// Bodies of cached files, one copy per source however many shards and
+// keys hold it: a file cached by every loop, or under several
+// accepted-coding keys that compress to the same coding, is read and
+// compressed once. Only misses take the lock; a hit never gets this far,
+// as its shard's entry already holds the body. A body is freed with the
+// last entry holding it.
+class BodyStore {
+public:
+    BodyStore() : state(std::make_shared<State>()) {}
+
+    // The stored body of source and the coding it came out in (which may be
+    // 0 where compressing did not pay), or nullptr
+    std::shared_ptr<const std::string> find(const BodySource& source, unsigned& coding) {
+        // Declared before the lock: should every other holder let go
+        // meanwhile, the body's deleter runs here and takes the lock itself
+        std::shared_ptr<const std::string> body;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            auto it = state->bodies.find(source);
+            if (it == state->bodies.end()) {
+                return nullptr;
+            }
+            // A body whose last holder is letting go cannot be revived
+            body = it->second.body.lock();
+            coding = it->second.coding;
+        }
+        if (body) {
+            state->deduplicated.fetch_add(1, std::memory_order_relaxed);
+        }
+        return body;
+    }
+
+    // Stores the body read from source, or returns the one another loader
+    // stored first, with its coding
+    std::shared_ptr<const std::string> intern(const BodySource& source, std::string bytes, unsigned& coding) {
+        std::shared_ptr<const std::string> existing;
+        std::lock_guard<std::mutex> lock(state->mutex);
+        Stored& stored = state->bodies[source];
+        existing = stored.body.lock();
+        if (existing) {
+            coding = stored.coding;
+            return existing;
+        }
+
+        size_t length = bytes.size();
+        std::shared_ptr<const std::string> body(new std::string(std::move(bytes)),
+                                                [state = state, source, length](const std::string* gone) {
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                // A body stored since under the same source stays
+                auto it = state->bodies.find(source);
+                if (it != state->bodies.end() && it->second.body.expired()) {
+                    state->bodies.erase(it);
+                }
+                state->bytes.fetch_sub(length, std::memory_order_relaxed);
+            }
+            delete gone;
+        });
+        stored.body = body;
+        stored.coding = coding;
+        state->bytes.fetch_add(length, std::memory_order_relaxed);
+        return body;
+    }
+
+    size_t bodyCount() const {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->bodies.size();
+    }
+    uint64_t byteCount() const { return state->bytes.load(std::memory_order_relaxed); }
+    // Loads that found their body already stored
+    uint64_t deduplicatedCount() const { return state->deduplicated.load(std::memory_order_relaxed); }
+
+private:
+    struct Stored {
+        std::weak_ptr<const std::string> body;
+        unsigned coding = 0;
+    };
+    // Shared with the bodies' deleters, which may outlive the store
+    struct State {
+        std::mutex mutex;
+        std::unordered_map<BodySource, Stored, BodySourceHash> bodies;
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> deduplicated{0};
+    };
+    std::shared_ptr<State> state;
+};
+
+// Bounded in-memory cache of small static files keyed by request path.
+// Each entry keeps the body and the pre-rendered status line and headers so
+// a hit needs no filesystem work. Eviction is CLOCK: hits set a reference
+// bit and the hand clears bits until it finds an unreferenced victim.
+// Each event loop has its own shard, with bodies held from the BodyStore;
+// only the owning loop's thread touches a shard, so a hit takes no lock
+// and writes no line another core reads, save the stats the metrics scrape.
+class FileCache {
+public:
+    struct Entry {
+        RepresentationHeaders headers;
+        std::shared_ptr<const std::string> body;
+        // File the entry was built from and is revalidated against; for a
+        // precompressed variant this is the sibling, not the requested file
+        std::string source_path;
+        dev_t device;
+        ino_t inode;
+        off_t size;
+        struct timespec mtime;
+        // Steady-clock milliseconds of the last stat() that confirmed the entry
+        mutable int64_t validated_at = 0;
+    };
+
+    // Written by the owning loop only; read by /metrics
+    struct Stats {
+        std::atomic<uint64_t> entries{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> evictions{0};
+    };
+
+    explicit FileCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+    static std::shared_ptr<Entry> makeEntry(const std::string& source_path, const struct stat& st) {
+        auto entry = std::make_shared<Entry>();
+        entry->source_path = source_path;
+        entry->device = st.st_dev;
+        entry->inode = st.st_ino;
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtim;
+        entry->validated_at = nowMillis();
+        return entry;
+    }
+
+    enum class Freshness {
+        Current,
+        Stale,
+        Unknown
+    };
+
+    // Returns the entry for key if it still matches its source file, or
+    // nullptr; the pointer is good until the next insert or erase. The file
+    // is re-stat()ed at most once per revalidate interval.
+    const std::shared_ptr<const Entry>* lookup(const std::string& key) {
+        return lookup(key, [](const Entry&) { return Freshness::Unknown; });
+    }
+
+    // As lookup(), but check(entry) can vouch for the entry (or condemn it)
+    // without a stat(); Unknown falls back to one
+    template <typename Check>
+    const std::shared_ptr<const Entry>* lookup(const std::string& key, Check&& check) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        Slot& slot = slots[it->second];
+        slot.referenced = true;
+        const Entry& entry = *slot.entry;
+
+        Freshness freshness = check(entry);
+        if (freshness == Freshness::Current) {
+            return &slot.entry;
+        }
+        if (freshness == Freshness::Unknown) {
+            int64_t now = nowMillis();
+            if (now - entry.validated_at < revalidate_interval_ms) {
+                return &slot.entry;
+            }
+            struct stat st;
+            if (stat(entry.source_path.c_str(), &st) == 0 && matches(entry, st)) {
+                entry.validated_at = now;
+                return &slot.entry;
+            }
+        }
+        removeSlot(it->second);
+        return nullptr;
+    }
+
+    void insert(const std::string& key, std::shared_ptr<const Entry> entry) {
+        size_t bytes = key.size() + entry->headers.bytes() + entry->body->size() + entry->source_path.size();
+        if (bytes > max_bytes) {
+            return;
+        }
+
+        auto it = index.find(key);
+        if (it != index.end()) {
+            removeSlot(it->second);
+        }
+        while (used_bytes + bytes > max_bytes && used_bytes > 0) {
+            evictOne();
+        }
+
+        size_t slot_index;
+        if (!free_slots.empty()) {
+            slot_index = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            slot_index = slots.size();
+            slots.emplace_back();
+        }
+        Slot& slot = slots[slot_index];
+        slot.key = key;
+        slot.entry = std::move(entry);
+        slot.bytes = bytes;
+        slot.referenced = false;
+        index.emplace(key, slot_index);
+        used_bytes += bytes;
+        publishStats();
+    }
+
+    void erase(const std::string& key) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            removeSlot(it->second);
+        }
+    }
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    struct Slot {
+        std::string key;
+        std::shared_ptr<const Entry> entry;
+        size_t bytes = 0;
+        bool referenced = false;
+    };
+
+    static constexpr int64_t revalidate_interval_ms = 1000;
+
+    size_t max_bytes;
+    size_t used_bytes = 0;
+    size_t hand = 0;
+    std::unordered_map<std::string, size_t> index;
+    std::vector<Slot> slots;
+    std::vector<size_t> free_slots;
+    uint64_t evictions = 0;
+    Stats stats_;
+
+    static int64_t nowMillis() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool matches(const Entry& entry, const struct stat& st) {
+        return entry.device == st.st_dev && entry.inode == st.st_ino && entry.size == st.st_size &&
+               entry.mtime.tv_sec == st.st_mtim.tv_sec && entry.mtime.tv_nsec == st.st_mtim.tv_nsec;
+    }
+
+    void publishStats() {
+        stats_.entries.store(index.size(), std::memory_order_relaxed);
+        stats_.bytes.store(used_bytes, std::memory_order_relaxed);
+        stats_.evictions.store(evictions, std::memory_order_relaxed);
+    }
+
+    void removeSlot(size_t slot_index) {
+        Slot& slot = slots[slot_index];
+        index.erase(slot.key);
+        used_bytes -= slot.bytes;
+        slot.key.clear();
+        slot.entry.reset();
+        slot.bytes = 0;
+        free_slots.push_back(slot_index);
+        publishStats();
+    }
+
+    void evictOne() {
+        while (true) {
+            if (hand >= slots.size()) {
+                hand = 0;
+            }
+            Slot& slot = slots[hand];
+            if (slot.entry) {
+                if (!slot.referenced) {
+                    evictions++;
+                    removeSlot(hand++);
+                    return;
+                }
+                slot.referenced = false;
+            }
+            hand++;
+        }
+    }
+};
+
+// A shared_ptr that one thread replaces and the loops read. Each loop keeps
+// its own copy in a Reader and only takes the mutex when the generation
+// shows that a newer value was published, so a read is one load of a line
+// that only changes on publish. Values are freed once the last reader and
+// anything still holding them let go.
+template <typename T>
+class Published {
+public:
+    struct Reader {
+        std::shared_ptr<const T> current;
+        uint64_t generation = 0;
+    };
+
+    void publish(std::shared_ptr<const T> next) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            value.swap(next);
+            generation.fetch_add(1, std::memory_order_release);
+        }
+        // next, now the previous value, is released outside the lock
+    }
+
+    // Returns the reader's current value, after picking up a newer one
+    const T* refresh(Reader& reader) {
+        if (reader.generation != generation.load(std::memory_order_acquire)) {
+            std::shared_ptr<const T> previous;
+            std::lock_guard<std::mutex> lock(mutex);
+            previous = std::move(reader.current);
+            reader.current = value;
+            reader.generation = generation.load(std::memory_order_relaxed);
+        }
+        return reader.current.get();
+    }
+
+private:
+    std::mutex mutex;
+    std::shared_ptr<const T> value;
+    std::atomic<uint64_t> generation{0};
+};
+
+// A bundle written by tools/pack, mapped read-only. Lookups hash the path
+// and binary-search the index in the mapping, and bodies are sent from the
+// mapped pages, so a hit touches neither the filesystem nor the page cache
+// misses of a cold start. The headers of each variant are rendered when the
+// bundle is mounted, because they depend on the server's MIME types and
+// Cache-Control rules. Loops and queued responses share a bundle by
+// reference count, so a new one can replace it while it is still being sent.
+class AssetBundle {
+public:
+    struct Asset {
+        const BundleEntry* entry;
+        std::string_view path;
+        // Rendered for the variants the entry has
+        RepresentationHeaders variants[kBundleVariants];
+    };
+
+    // Throws std::runtime_error when path is not a readable, intact bundle.
+    // populate faults every page in before returning; lock also keeps them
+    // resident (within RLIMIT_MEMLOCK).
+    AssetBundle(const std::string& path, bool populate, bool lock) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open bundle " + path + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < static_cast<off_t>(sizeof(BundleHeader))) {
+            close(fd);
+            throw std::runtime_error("Not a bundle: " + path);
+        }
+        mapped_bytes = st.st_size;
+        void* mapping = mmap(nullptr, mapped_bytes, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Failed to map bundle " + path + ": " + strerror(errno));
+        }
+        base = static_cast<const char*>(mapping);
+        if (!populate) {
+            // Starts reading the bundle in without waiting for it
+            madvise(mapping, mapped_bytes, MADV_WILLNEED);
+        }
+        if (lock) {
+            locked = mlock(base, mapped_bytes) == 0;
+            if (!locked) {
+                std::cerr << "Failed to lock bundle " << path << " in memory: " << strerror(errno) << std::endl;
+            }
+        }
+        std::string problem = index();
+        if (!problem.empty()) {
+            unmap();
+            throw std::runtime_error("Bundle " + path + " " + problem);
+        }
+    }
+
+    ~AssetBundle() { unmap(); }
+
+    AssetBundle(const AssetBundle&) = delete;
+    AssetBundle& operator=(const AssetBundle&) = delete;
+
+    const Asset* find(std::string_view request_path) const {
+        uint64_t hash = bundleHash(request_path);
+        const BundleEntry* end = entries + assets.size();
+        const BundleEntry* it = std::lower_bound(
+            entries, end, hash, [](const BundleEntry& entry, uint64_t value) { return entry.path_hash < value; });
+        for (; it != end && it->path_hash == hash; ++it) {
+            const Asset& asset = assets[it - entries];
+            if (asset.path == request_path) {
+                return &asset;
+            }
+        }
+        return nullptr;
+    }
+
+    const char* bytes(const BundleExtent& extent) const { return base + extent.offset; }
+    size_t size() const { return mapped_bytes; }
+    bool isLocked() const { return locked; }
+
+    // In index order; the server fills in the headers before publishing
+    std::vector<Asset> assets;
+
+private:
+    const char* base = nullptr;
+    size_t mapped_bytes = 0;
+    bool locked = false;
+    const BundleEntry* entries = nullptr;
+
+    // Checks every offset against the mapping, so a damaged file is refused
+    // here rather than faulting a loop later. Returns what is wrong, if
+    // anything.
+    std::string index() {
+        BundleHeader header;
+        std::memcpy(&header, base, sizeof(header));
+        uint64_t size = mapped_bytes;
+        if (std::memcmp(header.magic, kBundleMagic, sizeof(header.magic)) != 0) {
+            return "is not a bundle";
+        }
+        if (header.version != kBundleVersion) {
+            return "has version " + std::to_string(header.version) + ", expected " + std::to_string(kBundleVersion);
+        }
+        if (header.file_bytes != size || header.index_offset % alignof(BundleEntry) != 0 ||
+            header.index_offset > size ||
+            header.entry_count > (size - header.index_offset) / sizeof(BundleEntry) ||
+            header.paths_offset > size || header.paths_bytes > size - header.paths_offset) {
+            return "is truncated or corrupt";
+        }
+        entries = reinterpret_cast<const BundleEntry*>(base + header.index_offset);
+        const char* paths = base + header.paths_offset;
+        assets.resize(header.entry_count);
+        for (uint32_t i = 0; i < header.entry_count; i++) {
+            const BundleEntry& entry = entries[i];
+            if (entry.path_offset > header.paths_bytes || entry.path_length > header.paths_bytes - entry.path_offset ||
+                entry.variants[BundleIdentity].offset == 0 || (i > 0 && entries[i - 1].path_hash > entry.path_hash)) {
+                return "has a corrupt index";
+            }
+            for (const BundleExtent& extent : entry.variants) {
+                if (extent.offset > size || extent.length > size - extent.offset) {
+                    return "is truncated or corrupt";
+                }
+            }
+            assets[i].entry = &entry;
+            assets[i].path = std::string_view(paths + entry.path_offset, entry.path_length);
+        }
+        return {};
+    }
+
+    void unmap() {
+        if (base != nullptr) {
+            if (locked) {
+                munlock(base, mapped_bytes);
+            }
+            munmap(const_cast<char*>(base), mapped_bytes);
+            base = nullptr;
+        }
+    }
+};
+
+// Content codings the server negotiates, in order of preference. Each is a
+// bit in the masks built from Accept-Encoding.
+enum ContentEncoding : unsigned {
+    EncodingBrotli = 1,
+    EncodingZstd = 2,
+    EncodingGzip = 4
+};
+
+struct EncodingInfo {
+    ContentEncoding bit;
+    std::string_view token;
+    // Extension of a precompressed sibling, e.g. app.js.br
+    std::string_view suffix;
+};
+
+constexpr EncodingInfo kEncodings[] = {
+    {EncodingBrotli, "br", ".br"},
+    {EncodingZstd, "zstd", ".zst"},
+    {EncodingGzip, "gzip", ".gz"},
+};
+
+// Codings this build can produce itself
+constexpr unsigned kCompressibleEncodings = 0
+#ifdef HTTP_HAVE_BROTLI
+    | EncodingBrotli
+#endif
+#ifdef HTTP_HAVE_ZSTD
+    | EncodingZstd
+#endif
+#ifdef HTTP_HAVE_ZLIB
+    | EncodingGzip
+#endif
+    ;
+
+// Parses Accept-Encoding into a mask of acceptable codings. "q=0" rejects a
+// coding; "*" stands for every coding not named explicitly.
+inline unsigned acceptedEncodings(std::string_view header) {
+    unsigned accepted = 0;
+    unsigned named = 0;
+    bool wildcard = false;
+    while (!header.empty()) {
+        size_t comma = header.find(',');
+        std::string_view item = header.substr(0, comma);
+        header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+
+        std::string_view token = item.substr(0, item.find(';'));
+        while (!token.empty() && (token.front() == ' ' || token.front() == '\t')) {
+            token.remove_prefix(1);
+        }
+        while (!token.empty() && (token.back() == ' ' || token.back() == '\t')) {
+            token.remove_suffix(1);
+        }
+
+        // Only q=0 (any number of zero decimals) matters; other weights are
+        // ignored in favour of the server's own preference order
+        bool rejected = false;
+        size_t q = item.find("q=");
+        if (q != std::string_view::npos) {
+            std::string_view weight = item.substr(q + 2);
+            rejected = !weight.empty() && weight[0] == '0' && weight.find_first_of("123456789") == std::string_view::npos;
+        }
+
+        if (token == "*") {
+            wildcard = !rejected;
+            continue;
+        }
+        for (const EncodingInfo& encoding : kEncodings) {
+            if (token.size() == encoding.token.size() &&
+                strncasecmp(token.data(), encoding.token.data(), token.size()) == 0) {
+                named |= encoding.bit;
+                if (!rejected) {
+                    accepted |= encoding.bit;
+                }
+            }
+        }
+    }
+    if (wildcard) {
+        accepted |= (EncodingBrotli | EncodingZstd | EncodingGzip) & ~named;
+    }
+    return accepted;
+}
+
+// Built-in extension to MIME type table (extensions lowercase, without
+// the dot). Looked up through a perfect hash computed at compile time.
+struct MimeMapping {
+    std::string_view extension;
+    std::string_view type;
+};
+
+constexpr MimeMapping kMimeMappings[] = {
+    // Text and documents
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"jsonld", "application/ld+json"},
+    {"webmanifest", "application/manifest+json"},
+    {"xml", "application/xml"},
+    {"xhtml", "application/xhtml+xml"},
+    {"rss", "application/rss+xml"},
+    {"atom", "application/atom+xml"},
+    {"txt", "text/plain"},
+    {"csv", "text/csv"},
+    {"md", "text/markdown"},
+    {"ics", "text/calendar"},
+    {"vtt", "text/vtt"},
+    {"yaml", "application/yaml"},
+    {"yml", "application/yaml"},
+    {"toml", "application/toml"},
+    {"pdf", "application/pdf"},
+    {"rtf", "application/rtf"},
+    {"epub", "application/epub+zip"},
+    {"doc", "application/msword"},
+    {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {"xls", "application/vnd.ms-excel"},
+    {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    {"ppt", "application/vnd.ms-powerpoint"},
+    {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    {"odt", "application/vnd.oasis.opendocument.text"},
+    {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
+    {"odp", "application/vnd.oasis.opendocument.presentation"},
+    // Images
+    {"png", "image/png"},
+    {"apng", "image/apng"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"jxl", "image/jxl"},
+    {"heic", "image/heic"},
+    {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"bmp", "image/bmp"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    // Fonts
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"eot", "application/vnd.ms-fontobject"},
+    // Audio and video
+    {"mp4", "video/mp4"},
+    {"m4v", "video/mp4"},
+    {"webm", "video/webm"},
+    {"ogv", "video/ogg"},
+    {"mov", "video/quicktime"},
+    {"mkv", "video/x-matroska"},
+    {"avi", "video/x-msvideo"},
+    {"ts", "video/mp2t"},
+    {"m3u8", "application/vnd.apple.mpegurl"},
+    {"mpd", "application/dash+xml"},
+    {"mp3", "audio/mpeg"},
+    {"m4a", "audio/mp4"},
+    {"aac", "audio/aac"},
+    {"ogg", "audio/ogg"},
+    {"oga", "audio/ogg"},
+    {"opus", "audio/opus"},
+    {"weba", "audio/webm"},
+    {"wav", "audio/wav"},
+    {"flac", "audio/flac"},
+    {"mid", "audio/midi"},
+    {"midi", "audio/midi"},
+    // Applications and archives
+    {"wasm", "application/wasm"},
+    {"glb", "model/gltf-binary"},
+    {"gltf", "model/gltf+json"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tgz", "application/gzip"},
+    {"tar", "application/x-tar"},
+    {"bz2", "application/x-bzip2"},
+    {"xz", "application/x-xz"},
+    {"zst", "application/zstd"},
+    {"7z", "application/x-7z-compressed"},
+    {"rar", "application/vnd.rar"},
+    {"jar", "application/java-archive"},
+    {"apk", "application/vnd.android.package-archive"},
+    {"iso", "application/x-iso9660-image"},
+    {"sh", "application/x-sh"},
+    {"bin", "application/octet-stream"},
+};
+
+// Longest extension looked up; longer ones fall back to the default type
+constexpr size_t kMaxMimeExtension = 16;
+
+constexpr uint32_t mimeHash(std::string_view extension, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : extension) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    return hash;
+}
+
+// Index into kMimeMappings per bucket (0xff when empty) and the seed for
+// which no two built-in extensions share a bucket
+struct MimePerfectHash {
+    static constexpr size_t kBuckets = 2048;
+    uint32_t seed = 0;
+    uint8_t buckets[kBuckets] = {};
+};
+
+static_assert(std::size(kMimeMappings) < 0xff, "MIME bucket indexes are one byte");
+
+constexpr MimePerfectHash buildMimePerfectHash() {
+    MimePerfectHash table;
+    for (uint32_t seed = 1;; seed++) {
+        for (uint8_t& bucket : table.buckets) {
+            bucket = 0xff;
+        }
+        bool collision = false;
+        for (size_t i = 0; i < std::size(kMimeMappings) && !collision; i++) {
+            uint8_t& bucket = table.buckets[mimeHash(kMimeMappings[i].extension, seed) % MimePerfectHash::kBuckets];
+            collision = bucket != 0xff;
+            bucket = static_cast<uint8_t>(i);
+        }
+        if (!collision) {
+            table.seed = seed;
+            return table;
+        }
+    }
+}
+
+constexpr MimePerfectHash kMimePerfectHash = buildMimePerfectHash();
+
+// Extension to MIME type lookups: overrides from mime.types files in a flat
+// open-addressing table, then the built-in perfect hash. The overrides are
+// loaded at startup and never change afterwards, so lookups need no lock
+// and never allocate.
+class MimeTypes {
+public:
+    static constexpr std::string_view kDefaultType = "application/octet-stream";
+
+    // Reads "type ext1 ext2 ..." lines (the Apache/nginx mime.types format,
+    // '#' comments); an extension named again later wins
+    void loadFile(const std::string& path) {
+        std::ifstream file(path);
+        if (!file) {
+            throw std::runtime_error("Failed to open MIME types file " + path);
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            std::string_view rest(line);
+            rest = rest.substr(0, rest.find('#'));
+            std::string_view type = nextToken(rest);
+            if (type.empty() || type.find('/') == std::string_view::npos) {
+                continue;
+            }
+            for (std::string_view extension = nextToken(rest); !extension.empty(); extension = nextToken(rest)) {
+                addOverride(extension, type);
+            }
+        }
+    }
+
+    void addOverride(std::string_view extension, std::string_view type) {
+        char lowered[kMaxMimeExtension];
+        if (!lowerExtension(extension, lowered)) {
+            return;
+        }
+        std::string_view key(lowered, extension.size());
+        if ((override_count + 1) * 2 > overrides.size()) {
+            growOverrides();
+        }
+        Override& slot = overrides[findSlot(key)];
+        if (slot.extension.empty()) {
+            slot.extension.assign(key);
+            override_count++;
+        }
+        slot.type.assign(type);
+    }
+
+    // Type for the extension of path's last component, ignoring case
+    std::string_view lookup(std::string_view path) const {
+        size_t dot = path.find_last_of("./");
+        if (dot == std::string_view::npos || path[dot] != '.') {
+            return kDefaultType;
+        }
+        std::string_view extension = path.substr(dot + 1);
+        char lowered[kMaxMimeExtension];
+        if (!lowerExtension(extension, lowered)) {
+            return kDefaultType;
+        }
+        std::string_view key(lowered, extension.size());
+
+        if (override_count > 0) {
+            const Override& slot = overrides[findSlot(key)];
+            if (!slot.extension.empty()) {
+                return slot.type;
+            }
+        }
+
+        uint8_t index = kMimePerfectHash.buckets[mimeHash(key, kMimePerfectHash.seed) % MimePerfectHash::kBuckets];
+        if (index != 0xff && kMimeMappings[index].extension == key) {
+            return kMimeMappings[index].type;
+        }
+        return kDefaultType;
+    }
+
+private:
+    struct Override {
+        std::string extension;
+        std::string type;
+    };
+
+    // Power-of-two sized, linear probing, at most half full
+    std::vector<Override> overrides;
+    size_t override_count = 0;
+
+    static bool lowerExtension(std::string_view extension, char* lowered) {
+        if (extension.empty() || extension.size() > kMaxMimeExtension) {
+            return false;
+        }
+        for (size_t i = 0; i < extension.size(); i++) {
+            char c = extension[i];
+            lowered[i] = c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+        }
+        return true;
+    }
+
+    static std::string_view nextToken(std::string_view& rest) {
+        size_t start = rest.find_first_not_of(" \t\r;");
+        if (start == std::string_view::npos) {
+            rest = {};
+            return {};
+        }
+        size_t end = rest.find_first_of(" \t\r;", start);
+        std::string_view token = rest.substr(start, end == std::string_view::npos ? end : end - start);
+        rest = end == std::string_view::npos ? std::string_view() : rest.substr(end);
+        return token;
+    }
+
+    // The slot holding key, or the empty slot where it belongs
+    size_t findSlot(std::string_view key) const {
+        size_t mask = overrides.size() - 1;
+        for (size_t i = mimeHash(key, 0) & mask;; i = (i + 1) & mask) {
+            if (overrides[i].extension.empty() || overrides[i].extension == key) {
+                return i;
+            }
+        }
+    }
+
+    void growOverrides() {
+        std::vector<Override> old = std::move(overrides);
+        overrides = std::vector<Override>(std::max<size_t>(16, old.size() * 2));
+        for (Override& entry : old) {
+            if (!entry.extension.empty()) {
+                overrides[findSlot(entry.extension)] = std::move(entry);
+            }
+        }
+    }
+};
+
+// Types worth compressing; images, video and archives already are
+inline bool isCompressibleType(std::string_view mime_type) {
+    auto endsWith = [mime_type](std::string_view suffix) {
+        return mime_type.size() > suffix.size() && mime_type.substr(mime_type.size() - suffix.size()) == suffix;
+    };
+    return mime_type.substr(0, 5) == "text/" || mime_type == "application/javascript" ||
+           mime_type == "application/json" || mime_type == "application/xml" || mime_type == "application/wasm" ||
+           mime_type == "application/yaml" || mime_type == "application/toml" || endsWith("+xml") ||
+           endsWith("+json") || mime_type == "font/ttf" || mime_type == "font/otf" || mime_type == "image/x-icon";
+}
+
+// Strong validator of one representation: inode, size and mtime of the file
+// it is read from, plus the coding for compressed variants
+inline std::string makeETag(const struct stat& st, std::string_view content_encoding) {
+    char buffer[96];
+    uint64_t mtime_ns = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+    int length = snprintf(buffer, sizeof(buffer), "\"%llx-%llx-%llx", static_cast<unsigned long long>(st.st_ino),
+                          static_cast<unsigned long long>(st.st_size), static_cast<unsigned long long>(mtime_ns));
+    std::string etag(buffer, length);
+    if (!content_encoding.empty()) {
+        etag += '-';
+        etag += content_encoding;
+    }
+    etag += '"';
+    return etag;
+}
+
+// Strong validator of a bundled representation: the hash of the identity
+// body, so it stays the same when unchanged files are packed again
+inline std::string makeBundleETag(uint64_t content_hash, std::string_view content_encoding) {
+    char buffer[48];
+    int length = snprintf(buffer, sizeof(buffer), "\"b%016llx", static_cast<unsigned long long>(content_hash));
+    std::string etag(buffer, length);
+    if (!content_encoding.empty()) {
+        etag += '-';
+        etag += content_encoding;
+    }
+    etag += '"';
+    return etag;
+}
+
+inline std::string formatHttpDate(time_t when) {
+    struct tm tm;
+    gmtime_r(&when, &tm);
+    char buffer[64];
+    size_t length = strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buffer, length);
+}
+
+// Parses an IMF-fixdate; returns -1 for anything else
+inline time_t parseHttpDate(std::string_view text) {
+    char buffer[64];
+    if (text.empty() || text.size() >= sizeof(buffer)) {
+        return -1;
+    }
+    std::memcpy(buffer, text.data(), text.size());
+    buffer[text.size()] = '\0';
+    struct tm tm{};
+    const char* end = strptime(buffer, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == nullptr || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+// RFC 9110 section 13.2.2: If-None-Match (weak comparison, "*" matches any
+// current representation) takes precedence over If-Modified-Since
+inline bool notModified(std::string_view if_none_match, std::string_view if_modified_since,
+                        std::string_view etag, time_t last_modified) {
+    if (!if_none_match.empty()) {
+        while (!if_none_match.empty()) {
+            size_t comma = if_none_match.find(',');
+            std::string_view candidate = if_none_match.substr(0, comma);
+            if_none_match = comma == std::string_view::npos ? std::string_view() : if_none_match.substr(comma + 1);
+            while (!candidate.empty() && (candidate.front() == ' ' || candidate.front() == '\t')) {
+                candidate.remove_prefix(1);
+            }
+            while (!candidate.empty() && (candidate.back() == ' ' || candidate.back() == '\t')) {
+                candidate.remove_suffix(1);
+            }
+            if (candidate.substr(0, 2) == "W/") {
+                candidate.remove_prefix(2);
+            }
+            if (candidate == "*" || candidate == etag) {
+                return true;
+            }
+        }
+        return false;
+    }
+    if (!if_modified_since.empty()) {
+        time_t since = parseHttpDate(if_modified_since);
+        return since >= 0 && last_modified <= since;
+    }
+    return false;
+}
+
+struct ByteRange {
+    uint64_t first;
+    uint64_t last;
+
+    uint64_t length() const { return last - first + 1; }
+};
+
+// More ranges than this (a classic amplification trick) get the full body
+constexpr int kMaxRanges = 16;
+
+// Parses a "bytes=" Range header against a representation of size bytes.
+// Returns the number of satisfiable ranges, 0 when the header is to be
+// ignored (malformed, other units, too many ranges) and -1 when none of
+// the ranges can be satisfied.
+inline int parseRange(std::string_view header, uint64_t size, ByteRange* ranges, int max_ranges) {
+    if (header.substr(0, 6) != "bytes=") {
+        return 0;
+    }
+    header.remove_prefix(6);
+
+    auto parseNumber = [](std::string_view text, uint64_t& value) {
+        if (text.empty() || text.size() > 19) {
+            return false;
+        }
+        value = 0;
+        for (char c : text) {
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            value = value * 10 + (c - '0');
+        }
+        return true;
+    };
+
+    int count = 0;
+    bool any = false;
+    while (!header.empty()) {
+        size_t comma = header.find(',');
+        std::string_view spec = header.substr(0, comma);
+        header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+        while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) {
+            spec.remove_prefix(1);
+        }
+        while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) {
+            spec.remove_suffix(1);
+        }
+        if (spec.empty()) {
+            continue;
+        }
+        size_t dash = spec.find('-');
+        if (dash == std::string_view::npos) {
+            return 0;
+        }
+        any = true;
+
+        uint64_t first;
+        uint64_t last;
+        if (dash == 0) {
+            // Suffix range: the last N bytes
+            uint64_t suffix;
+            if (!parseNumber(spec.substr(1), suffix)) {
+                return 0;
+            }
+            if (suffix == 0 || size == 0) {
+                continue;
+            }
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+        } else {
+            if (!parseNumber(spec.substr(0, dash), first)) {
+                return 0;
+            }
+            std::string_view end = spec.substr(dash + 1);
+            if (end.empty()) {
+                last = size - 1;
+            } else if (!parseNumber(end, last) || last < first) {
+                return 0;
+            }
+            if (first >= size) {
+                continue;
+            }
+            last = std::min(last, size - 1);
+        }
+
+        if (count == max_ranges) {
+            return 0;
+        }
+        ranges[count++] = ByteRange{first, last};
+    }
+    if (!any) {
+        return 0;
+    }
+    return count > 0 ? count : -1;
+}
+
+// If-Range holds an entity tag (strong comparison) or a date that must
+// equal Last-Modified; an absent header always matches
+inline bool ifRangeMatches(std::string_view if_range, std::string_view etag, time_t last_modified) {
+    if (if_range.empty()) {
+        return true;
+    }
+    if (if_range.front() == '"') {
+        return if_range == etag;
+    }
+    if (if_range.substr(0, 2) == "W/") {
+        return false;
+    }
+    return parseHttpDate(if_range) == last_modified;
+}
+
+// Compresses data with one coding; returns false if the coding is not
+// built in or the encoder fails
+inline bool compressBody(ContentEncoding encoding, const std::string& data, std::string& out) {
+    switch (encoding) {
+#ifdef HTTP_HAVE_BROTLI
+    case EncodingBrotli: {
+        size_t size = BrotliEncoderMaxCompressedSize(data.size());
+        out.resize(size);
+        // Quality 9 keeps a megabyte-sized bundle well under a second on a
+        // worker; 11 gains a few percent for several times the CPU
+        if (!BrotliEncoderCompress(9, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(),
+                                   reinterpret_cast<const uint8_t*>(data.data()), &size,
+                                   reinterpret_cast<uint8_t*>(&out[0]))) {
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+#endif
+#ifdef HTTP_HAVE_ZSTD
+    case EncodingZstd: {
+        out.resize(ZSTD_compressBound(data.size()));
+        size_t size = ZSTD_compress(&out[0], out.size(), data.data(), data.size(), 19);
+        if (ZSTD_isError(size)) {
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+#endif
+#ifdef HTTP_HAVE_ZLIB
+    case EncodingGzip: {
+        z_stream stream{};
+        // 16 + MAX_WBITS selects the gzip wrapper
+        if (deflateInit2(&stream, 9, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        out.resize(deflateBound(&stream, data.size()));
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        stream.avail_in = data.size();
+        stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        stream.avail_out = out.size();
+        int result = deflate(&stream, Z_FINISH);
+        size_t size = stream.total_out;
+        deflateEnd(&stream);
+        if (result != Z_STREAM_END) {
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+#endif
+    default:
+        (void)data;
+        (void)out;
+        return false;
+    }
+}
+
+// Maps a request target onto "/a/b" without touching the filesystem: drops
+// the query and fragment, percent-decodes, folds "." and ".." and repeated
+// slashes. Returns 0, or 400 for malformed targets, encoded NUL or '/', and
+// ".." above the root. A trailing slash is kept so directories stay apparent.
+inline int normalizeRequestPath(std::string_view target, std::string& path) {
+    target = target.substr(0, target.find_first_of("?#"));
+    if (target.empty() || target[0] != '/') {
+        return 400;
+    }
+
+    auto hexValue = [](char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+
+    path.assign(1, '/');
+    size_t i = 1;
+    while (i <= target.size()) {
+        size_t segment_start = path.size();
+        for (; i < target.size() && target[i] != '/'; i++) {
+            char c = target[i];
+            if (c == '%') {
+                int high = i + 2 < target.size() ? hexValue(target[i + 1]) : -1;
+                int low = high >= 0 ? hexValue(target[i + 2]) : -1;
+                if (low < 0) {
+                    return 400;
+                }
+                c = static_cast<char>(high * 16 + low);
+                if (c == '\0' || c == '/') {
+                    return 400;
+                }
+                i += 2;
+            }
+            path += c;
+        }
+
+        std::string_view segment = std::string_view(path).substr(segment_start);
+        if (segment == "." || segment == "..") {
+            path.resize(segment_start);
+            if (segment.size() == 2) {
+                if (path.size() == 1) {
+                    return 400;
+                }
+                path.pop_back();
+                path.resize(path.rfind('/') + 1);
+            }
+        } else if (!segment.empty() && i < target.size()) {
+            path += '/';
+        }
+        i++;
+    }
+    return 0;
+}
+
+// Percent-encodes text for a URL path, keeping the unreserved characters,
+// the sub-delimiters other than '(' and ')', '@' and whatever `keep` adds.
+// ':' is always encoded, so a relative reference never reads as a scheme.
+inline void appendPercentEncoded(std::string& out, std::string_view text, std::string_view keep = {}) {
+    static constexpr char hex[] = "0123456789ABCDEF";
+    for (unsigned char c : text) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            std::string_view("-._~!$*,;=@").find(c) != std::string_view::npos ||
+            keep.find(c) != std::string_view::npos) {
+            out += static_cast<char>(c);
+        } else {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+}
+
+// Opens a root-relative path for reading without ever leaving dir_fd:
+// openat2(RESOLVE_BENEATH) makes the kernel refuse "..", absolute symlinks
+// and links that escape. Kernels before 5.6 get openat() plus a check of
+// where the descriptor ended up. Fails with EXDEV for escapes.
+inline int openBeneath(int dir_fd, const std::string& root_path, const char* relative_path) {
+    static std::atomic<bool> have_openat2{true};
+    // O_NONBLOCK so a FIFO in the tree cannot stall the caller; regular
+    // files ignore it
+    int flags = O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK;
+#ifdef SYS_openat2
+    if (have_openat2.load(std::memory_order_relaxed)) {
+        struct open_how how{};
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = static_cast<int>(syscall(SYS_openat2, dir_fd, relative_path, &how, sizeof(how)));
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        have_openat2.store(false, std::memory_order_relaxed);
+    }
+#endif
+    int fd = openat(dir_fd, relative_path, flags);
+    if (fd < 0) {
+        return -1;
+    }
+    char link_path[32];
+    char target[PATH_MAX];
+    snprintf(link_path, sizeof(link_path), "/proc/self/fd/%d", fd);
+    ssize_t length = readlink(link_path, target, sizeof(target));
+    std::string_view resolved(target, length > 0 ? length : 0);
+    // Compare whole components: /srv/www must not admit /srv/www-private
+    if (resolved.size() <= root_path.size() || resolved.compare(0, root_path.size(), root_path) != 0 ||
+        (resolved[root_path.size()] != '/' && root_path != "/")) {
+        close(fd);
+        errno = EXDEV;
+        return -1;
+    }
+    return fd;
+}
+
+// Open descriptors of files too large for FileCache, keyed like FileCache,
+// so repeat requests skip the open and fstat() and go straight to
+// sendfile() on a dup(). Instead of re-stat()ing, every directory on an
+// entry's path is watched with inotify; a thread reading the events drops
+// entries whose file, sibling or parent directory changes. Eviction is
+// CLOCK, as in FileCache.
+class OpenFileCache {
+public:
+    struct Entry {
+        int fd = -1;
+        size_t size = 0;
+        RepresentationHeaders headers;
+        // Root-relative request path ("a/b.bin") the entry is invalidated by
+        std::string path;
+
+        Entry() = default;
+        Entry(const Entry&) = delete;
+        Entry& operator=(const Entry&) = delete;
+        ~Entry() {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    };
+
+    OpenFileCache(int root_fd, std::string root_path, size_t max_entries)
+        : root_fd(root_fd), root_path(std::move(root_path)), max_entries(max_entries) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (inotify_fd < 0 || stop_fd < 0) {
+            throw std::runtime_error("Failed to create inotify watcher");
+        }
+        watcher = std::thread(&OpenFileCache::watchLoop, this);
+    }
+
+    ~OpenFileCache() {
+        uint64_t one = 1;
+        ssize_t ignored = write(stop_fd, &one, sizeof(one));
+        (void)ignored;
+        watcher.join();
+        close(inotify_fd);
+        close(stop_fd);
+    }
+
+    std::shared_ptr<const Entry> lookup(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        Slot& slot = slots[it->second];
+        slot.referenced = true;
+        return slot.entry;
+    }
+
+    // source is the root-relative file the entry's descriptor was opened
+    // from (the sibling for precompressed variants) and st its fstat().
+    // Watches go in first; if the file changed before they did, the entry
+    // is not kept.
+    void insert(const std::string& key, std::string_view source, const struct stat& st,
+                std::shared_ptr<const Entry> entry) {
+        std::lock_guard<std::mutex> lock(mutex);
+        // "", "a", "a/b" for "a/b/c.bin"
+        for (size_t end = 0;;) {
+            std::string directory = entry->path.substr(0, end);
+            if (!watched_directories.count(directory)) {
+                std::string watch_path = directory.empty() ? root_path : root_path + '/' + directory;
+                int wd = inotify_add_watch(inotify_fd, watch_path.c_str(), kWatchMask);
+                if (wd < 0) {
+                    return;
+                }
+                // Symlinked directories can share one watch
+                watches[wd].push_back(directory);
+                watched_directories.emplace(directory, wd);
+            }
+            end = entry->path.find('/', end == 0 ? 0 : end + 1);
+            if (end == std::string::npos) {
+                break;
+            }
+        }
+
+        std::string source_path(source);
+        struct stat now;
+        if (fstatat(root_fd, source_path.c_str(), &now, 0) < 0 || now.st_dev != st.st_dev ||
+            now.st_ino != st.st_ino || now.st_size != st.st_size || now.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+            now.st_mtim.tv_nsec != st.st_mtim.tv_nsec) {
+            return;
+        }
+        auto it = index.find(key);
+        if (it != index.end()) {
+            slots[it->second].entry = std::move(entry);
+            return;
+        }
+        if (max_entries == 0) {
+            return;
+        }
+        if (index.size() >= max_entries) {
+            evictOne();
+        }
+
+        size_t slot_index;
+        if (!free_slots.empty()) {
+            slot_index = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            slot_index = slots.size();
+            slots.emplace_back();
+        }
+        Slot& slot = slots[slot_index];
+        slot.key = key;
+        slot.entry = std::move(entry);
+        slot.referenced = false;
+        index.emplace(key, slot_index);
+    }
+
+    uint64_t invalidationCount() const { return invalidations.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr uint32_t kWatchMask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                           IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+    int root_fd;
+    std::string root_path;
+    size_t max_entries;
+    int inotify_fd = -1;
+    int stop_fd = -1;
+    std::thread watcher;
+    struct Slot {
+        std::string key;
+        std::shared_ptr<const Entry> entry;
+        bool referenced = false;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, size_t> index;
+    std::vector<Slot> slots;
+    std::vector<size_t> free_slots;
+    size_t hand = 0;
+    // Watch descriptor to the root-relative directories it covers ("" is
+    // the root)
+    std::unordered_map<int, std::vector<std::string>> watches;
+    std::unordered_map<std::string, int> watched_directories;
+    std::atomic<uint64_t> invalidations{0};
+
+    void watchLoop() {
+        alignas(struct inotify_event) char buffer[16 * 1024];
+        while (true) {
+            pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+                return;
+            }
+            if (fds[1].revents) {
+                return;
+            }
+            ssize_t length;
+            while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (ssize_t offset = 0; offset < length;) {
+                    auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                    handleEvent(*event);
+                    offset += sizeof(inotify_event) + event->len;
+                }
+            }
+        }
+    }
+
+    // Called with the mutex held
+    void handleEvent(const inotify_event& event) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            invalidations.fetch_add(index.size(), std::memory_order_relaxed);
+            index.clear();
+            slots.clear();
+            free_slots.clear();
+            hand = 0;
+            return;
+        }
+        auto watch = watches.find(event.wd);
+        if (watch == watches.end()) {
+            return;
+        }
+        for (const std::string& directory : watch->second) {
+            if (event.mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // The directory itself went away or moved: everything below it
+                invalidateBelow(directory, directory, false);
+            } else if (event.len > 0) {
+                std::string changed = directory.empty() ? std::string(event.name) : directory + '/' + event.name;
+                // A new or changed app.js.br affects what app.js resolves to
+                std::string base = changed;
+                for (const EncodingInfo& encoding : kEncodings) {
+                    if (base.size() > encoding.suffix.size() &&
+                        base.compare(base.size() - encoding.suffix.size(), encoding.suffix.size(), encoding.suffix) == 0) {
+                        base.resize(base.size() - encoding.suffix.size());
+                        break;
+                    }
+                }
+                invalidateBelow(changed, base, true);
+            }
+        }
+        if (event.mask & IN_IGNORED) {
+            for (const std::string& directory : watch->second) {
+                watched_directories.erase(directory);
+            }
+            watches.erase(watch);
+        }
+    }
+
+    // Drops entries for path, for base (exactly) and for anything below path
+    void invalidateBelow(const std::string& path, const std::string& base, bool exact) {
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (!slots[i].entry) {
+                continue;
+            }
+            const std::string& entry_path = slots[i].entry->path;
+            bool below = path.empty() || (entry_path.size() > path.size() && entry_path[path.size()] == '/' &&
+                                          entry_path.compare(0, path.size(), path) == 0);
+            if (below || (exact && (entry_path == path || entry_path == base))) {
+                removeSlot(i);
+                invalidations.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Called with the mutex held
+    void removeSlot(size_t slot_index) {
+        Slot& slot = slots[slot_index];
+        index.erase(slot.key);
+        slot.key.clear();
+        slot.entry.reset();
+        free_slots.push_back(slot_index);
+    }
+
+    // Hits set a reference bit; the hand clears bits until it finds an
+    // unreferenced entry. Called with the mutex held
+    void evictOne() {
+        while (!index.empty()) {
+            if (hand >= slots.size()) {
+                hand = 0;
+            }
+            Slot& slot = slots[hand];
+            if (slot.entry) {
+                if (!slot.referenced) {
+                    removeSlot(hand++);
+                    return;
+                }
+                slot.referenced = false;
+            }
+            hand++;
+        }
+    }
+};
+
+// Immutable image of the web root's metadata, rebuilt by TreeWatcher after
+// each burst of changes. Nodes sit in one array in depth-first order with
+// an open-addressed index by path hash, so a lookup, including one that
+// ends in 404, costs a few cache lines and no system call. Symbolic links
+// and unreadable directories are opaque: the snapshot does not follow
+// them, and paths at or beneath them are left to the disk.
+class TreeSnapshot {
+public:
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+    enum Kind : uint8_t {
+        File,
+        Directory,
+        Opaque
+    };
+
+    struct Node {
+        uint64_t path_hash;
+        uint64_t size;
+        uint64_t inode;
+        int64_t mtime_ns;
+        // "/a/b" in paths; the root is ""
+        uint32_t path_offset;
+        uint32_t path_length;
+        // Children of a directory in name order
+        uint32_t first_child = kNone;
+        uint32_t next_sibling = kNone;
+        uint16_t mime = 0;
+        Kind kind;
+    };
+
+    enum class Lookup {
+        // Nothing exists at the path
+        Missing,
+        Found,
+        // The path is at or beneath an opaque node
+        Unknown
+    };
+
+    const Node* find(std::string_view path) const {
+        uint64_t hash = bundleHash(path);
+        size_t mask = slots.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            uint32_t index = slots[slot];
+            if (index == kNone) {
+                return nullptr;
+            }
+            const Node& node = nodes[index];
+            if (node.path_hash == hash && pathOf(node) == path) {
+                return &node;
+            }
+        }
+    }
+
+    // path is "/a/b", or "" for the root. A path that is not in the
+    // snapshot is Missing when its nearest known ancestor is a file or a
+    // directory, and Unknown when that ancestor is opaque.
+    Lookup resolve(std::string_view path, const Node*& node) const {
+        node = find(path);
+        if (node != nullptr) {
+            return node->kind == Opaque ? Lookup::Unknown : Lookup::Found;
+        }
+        while (!path.empty()) {
+            path = path.substr(0, path.rfind('/'));
+            if (const Node* ancestor = find(path)) {
+                return ancestor->kind == Opaque ? Lookup::Unknown : Lookup::Missing;
+            }
+        }
+        return Lookup::Missing;
+    }
+
+    std::string_view pathOf(const Node& node) const {
+        return std::string_view(paths.data() + node.path_offset, node.path_length);
+    }
+
+    std::string_view nameOf(const Node& node) const {
+        std::string_view path = pathOf(node);
+        return path.substr(path.rfind('/') + 1);
+    }
+
+    std::string_view mimeType(const Node& node) const { return mime_types[node.mime]; }
+    const Node& at(uint32_t index) const { return nodes[index]; }
+    size_t size() const { return nodes.size(); }
+
+private:
+    friend class TreeWatcher;
+
+    std::vector<Node> nodes;
+    std::string paths;
+    // Power of two, at most half full; node indices or kNone
+    std::vector<uint32_t> slots;
+    // Indexed by Node::mime; views of the server's MIME table
+    std::vector<std::string_view> mime_types;
+};
+
+// Keeps the published TreeSnapshot of the web root current. The first one
+// comes from a traversal spread over several threads; afterwards an inotify
+// watch on every directory feeds a master copy of the tree, and a new
+// snapshot is published once the events pause (at least every 100 ms while
+// they do not). If a watch cannot be added, for instance past
+// fs.inotify.max_user_watches, the snapshot is withdrawn and every request
+// goes to the disk as without one.
+class TreeWatcher {
+public:
+    TreeWatcher(int root_fd, std::string root_path, const MimeTypes& mime_types, Published<TreeSnapshot>& published,
+                unsigned threads)
+        : root_fd(root_fd), root_path(std::move(root_path)), mime_types(mime_types), published(published) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (inotify_fd < 0 || stop_fd < 0) {
+            throw std::runtime_error("Failed to create inotify watcher");
+        }
+        if (!scanAll(std::max(1u, threads))) {
+            throw std::runtime_error("Failed to watch " + this->root_path +
+                                     " (raise fs.inotify.max_user_watches or run without --snapshot)");
+        }
+        publish();
+        watcher = std::thread(&TreeWatcher::watchLoop, this);
+    }
+
+    ~TreeWatcher() {
+        uint64_t one = 1;
+        ssize_t ignored = write(stop_fd, &one, sizeof(one));
+        (void)ignored;
+        watcher.join();
+        close(inotify_fd);
+        close(stop_fd);
+    }
+
+    size_t entryCount() const { return entry_count.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr uint32_t kWatchMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                           IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW;
+    static constexpr int kQuietMillis = 10;
+    static constexpr int64_t kMaxDelayMillis = 100;
+
+    struct Meta {
+        TreeSnapshot::Kind kind;
+        uint64_t size;
+        uint64_t inode;
+        int64_t mtime_ns;
+    };
+
+    // Sorts '/' before every other byte, so a directory's subtree directly
+    // follows it
+    struct PathOrder {
+        bool operator()(const std::string& a, const std::string& b) const {
+            size_t common = std::min(a.size(), b.size());
+            for (size_t i = 0; i < common; i++) {
+                if (a[i] != b[i]) {
+                    return rank(a[i]) < rank(b[i]);
+                }
+            }
+            return a.size() < b.size();
+        }
+        static unsigned rank(char c) { return c == '/' ? 0 : static_cast<unsigned char>(c) + 1; }
+    };
+
+    enum class ScanResult {
+        Listed,
+        Unreadable,
+        WatchFailed
+    };
+
+    // What one directory scan found
+    struct ScanOutput {
+        std::vector<std::pair<std::string, Meta>> found;
+        std::vector<std::pair<int, std::string>> watches;
+        std::vector<std::string> unreadable;
+    };
+
+    int root_fd;
+    std::string root_path;
+    const MimeTypes& mime_types;
+    Published<TreeSnapshot>& published;
+    int inotify_fd = -1;
+    int stop_fd = -1;
+    std::thread watcher;
+    std::atomic<size_t> entry_count{0};
+    // Watcher thread only after the constructor
+    std::map<std::string, Meta, PathOrder> tree;
+    std::unordered_map<int, std::string> watch_paths;
+    std::map<std::string, int, PathOrder> directory_watches;
+    std::unordered_map<std::string_view, uint16_t> mime_ids;
+    std::vector<std::string_view> mime_table;
+
+    static Meta metaOf(const struct stat& st) {
+        TreeSnapshot::Kind kind = S_ISREG(st.st_mode)   ? TreeSnapshot::File
+                                  : S_ISDIR(st.st_mode) ? TreeSnapshot::Directory
+                                                        : TreeSnapshot::Opaque;
+        int64_t mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        return {kind, static_cast<uint64_t>(st.st_size), static_cast<uint64_t>(st.st_ino), mtime_ns};
+    }
+
+    static bool isBelow(const std::string& path, const std::string& directory) {
+        return path.size() > directory.size() && path[directory.size()] == '/' &&
+               path.compare(0, directory.size(), directory) == 0;
+    }
+
+    // The watch goes in before the listing, so nothing created in between
+    // is missed. Subdirectories are appended to pending.
+    ScanResult scanDirectory(const std::string& directory, ScanOutput& output, std::vector<std::string>& pending) {
+        std::string absolute = root_path + directory;
+        int wd = inotify_add_watch(inotify_fd, absolute.c_str(), kWatchMask);
+        if (wd < 0) {
+            return errno == ENOSPC || errno == ENOMEM ? ScanResult::WatchFailed : ScanResult::Unreadable;
+        }
+        output.watches.emplace_back(wd, directory);
+        int fd = openat(root_fd, directory.empty() ? "." : directory.c_str() + 1,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR* listing = fd < 0 ? nullptr : fdopendir(fd);
+        if (listing == nullptr) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return ScanResult::Unreadable;
+        }
+        while (struct dirent* entry = readdir(listing)) {
+            std::string_view name = entry->d_name;
+            if (name == "." || name == "..") {
+                continue;
+            }
+            struct stat st;
+            if (fstatat(dirfd(listing), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+            std::string child = directory + '/';
+            child += name;
+            Meta meta = metaOf(st);
+            if (meta.kind == TreeSnapshot::Directory) {
+                pending.push_back(child);
+            }
+            output.found.emplace_back(std::move(child), meta);
+        }
+        closedir(listing);
+        return ScanResult::Listed;
+    }
+
+    // Scans below directory (already in the tree) on the calling thread;
+    // false when a watch could not be added
+    bool scanSubtree(const std::string& directory) {
+        ScanOutput output;
+        std::vector<std::string> pending{directory};
+        while (!pending.empty()) {
+            std::string next = std::move(pending.back());
+            pending.pop_back();
+            ScanResult result = scanDirectory(next, output, pending);
+            if (result == ScanResult::WatchFailed) {
+                return false;
+            }
+            if (result == ScanResult::Unreadable) {
+                output.unreadable.push_back(std::move(next));
+            }
+        }
+        merge(output);
+        return true;
+    }
+
+    // The initial traversal: threads take directories off a shared stack
+    // and push the subdirectories they find
+    bool scanAll(unsigned threads) {
+        struct stat st;
+        if (fstatat(root_fd, "", &st, AT_EMPTY_PATH) < 0) {
+            return false;
+        }
+        tree.emplace(std::string(), metaOf(st));
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::vector<std::string> pending{std::string()};
+        size_t busy = 0;
+        bool failed = false;
+        std::vector<ScanOutput> outputs(threads);
+        auto work = [&](ScanOutput& output) {
+            std::vector<std::string> subdirectories;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                changed.wait(lock, [&] { return !pending.empty() || busy == 0 || failed; });
+                if (pending.empty() || failed) {
+                    return;
+                }
+                std::string directory = std::move(pending.back());
+                pending.pop_back();
+                busy++;
+                lock.unlock();
+                ScanResult result = scanDirectory(directory, output, subdirectories);
+                lock.lock();
+                busy--;
+                if (result == ScanResult::WatchFailed) {
+                    failed = true;
+                } else if (result == ScanResult::Unreadable) {
+                    output.unreadable.push_back(std::move(directory));
+                }
+                for (std::string& subdirectory : subdirectories) {
+                    pending.push_back(std::move(subdirectory));
+                }
+                subdirectories.clear();
+                changed.notify_all();
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < threads; i++) {
+            pool.emplace_back(work, std::ref(outputs[i]));
+        }
+        work(outputs[0]);
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+        if (failed) {
+            return false;
+        }
+        for (ScanOutput& output : outputs) {
+            merge(output);
+        }
+        return true;
+    }
+
+    void merge(ScanOutput& output) {
+        for (auto& [path, meta] : output.found) {
+            tree[std::move(path)] = meta;
+        }
+        for (auto& [wd, directory] : output.watches) {
+            watch_paths[wd] = directory;
+            directory_watches[std::move(directory)] = wd;
+        }
+        for (const std::string& directory : output.unreadable) {
+            auto it = tree.find(directory);
+            if (it != tree.end()) {
+                it->second.kind = TreeSnapshot::Opaque;
+            }
+        }
+    }
+
+    // Drops path and everything below it, with their watches
+    void erase(const std::string& path) {
+        auto first = directory_watches.lower_bound(path);
+        auto last = first;
+        while (last != directory_watches.end() && (last->first == path || isBelow(last->first, path))) {
+            inotify_rm_watch(inotify_fd, last->second);
+            watch_paths.erase(last->second);
+            ++last;
+        }
+        directory_watches.erase(first, last);
+
+        auto begin = tree.lower_bound(path);
+        auto end = begin;
+        while (end != tree.end() && (end->first == path || isBelow(end->first, path))) {
+            ++end;
+        }
+        tree.erase(begin, end);
+    }
+
+    // Re-reads path after an event about it; false when a watch failed
+    bool update(const std::string& path) {
+        struct stat st;
+        if (fstatat(root_fd, path.c_str() + 1, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            erase(path);
+            return true;
+        }
+        Meta meta = metaOf(st);
+        auto it = tree.find(path);
+        bool known_directory = it != tree.end() && it->second.kind == TreeSnapshot::Directory;
+        if (it != tree.end() && it->second.kind != meta.kind) {
+            erase(path);
+            known_directory = false;
+        }
+        tree[path] = meta;
+        return meta.kind != TreeSnapshot::Directory || known_directory || scanSubtree(path);
+    }
+
+    // Rebuilds from scratch, after the kernel dropped events
+    bool rescan() {
+        for (const auto& watch : watch_paths) {
+            inotify_rm_watch(inotify_fd, watch.first);
+        }
+        watch_paths.clear();
+        directory_watches.clear();
+        tree.clear();
+        struct stat st;
+        if (fstatat(root_fd, "", &st, AT_EMPTY_PATH) < 0) {
+            return false;
+        }
+        tree.emplace(std::string(), metaOf(st));
+        return scanSubtree(std::string());
+    }
+
+    // False when the snapshot can no longer be kept complete
+    bool handleEvent(const inotify_event& event) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            return rescan();
+        }
+        auto watch = watch_paths.find(event.wd);
+        if (watch == watch_paths.end()) {
+            return true;
+        }
+        if (event.mask & IN_IGNORED) {
+            auto directory = directory_watches.find(watch->second);
+            if (directory != directory_watches.end() && directory->second == event.wd) {
+                directory_watches.erase(directory);
+            }
+            watch_paths.erase(watch);
+            return true;
+        }
+        if (event.len == 0) {
+            return true; // about the directory itself; its parent reports it too
+        }
+        std::string path = watch->second + '/';
+        path += event.name;
+        if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+            erase(path);
+            return true;
+        }
+        return update(path);
+    }
+
+    uint16_t mimeId(std::string_view path) {
+        std::string_view type = mime_types.lookup(path);
+        auto it = mime_ids.find(type);
+        if (it != mime_ids.end()) {
+            return it->second;
+        }
+        uint16_t id = mime_table.size();
+        mime_ids.emplace(type, id);
+        mime_table.push_back(type);
+        return id;
+    }
+
+    void publish() {
+        auto snapshot = std::make_shared<TreeSnapshot>();
+        std::vector<TreeSnapshot::Node>& nodes = snapshot->nodes;
+        nodes.reserve(tree.size());
+        // Open directories from the root down, with their last child so far
+        std::vector<std::pair<uint32_t, uint32_t>> ancestors;
+        std::vector<const std::string*> ancestor_paths;
+        for (const auto& [path, meta] : tree) {
+            while (!ancestors.empty() && !isBelow(path, *ancestor_paths.back())) {
+                ancestors.pop_back();
+                ancestor_paths.pop_back();
+            }
+            uint32_t index = nodes.size();
+            TreeSnapshot::Node node;
+            node.path_hash = bundleHash(path);
+            node.size = meta.size;
+            node.inode = meta.inode;
+            node.mtime_ns = meta.mtime_ns;
+            node.path_offset = snapshot->paths.size();
+            node.path_length = path.size();
+            node.kind = meta.kind;
+            if (meta.kind == TreeSnapshot::File) {
+                node.mime = mimeId(path);
+            }
+            snapshot->paths += path;
+            if (!ancestors.empty()) {
+                auto& [parent, last_child] = ancestors.back();
+                if (last_child == TreeSnapshot::kNone) {
+                    nodes[parent].first_child = index;
+                } else {
+                    nodes[last_child].next_sibling = index;
+                }
+                last_child = index;
+            }
+            nodes.push_back(node);
+            if (meta.kind == TreeSnapshot::Directory) {
+                ancestors.emplace_back(index, TreeSnapshot::kNone);
+                ancestor_paths.push_back(&path);
+            }
+        }
+
+        size_t capacity = 16;
+        while (capacity < nodes.size() * 2) {
+            capacity *= 2;
+        }
+        snapshot->slots.assign(capacity, TreeSnapshot::kNone);
+        for (uint32_t i = 0; i < nodes.size(); i++) {
+            for (size_t slot = nodes[i].path_hash & (capacity - 1);; slot = (slot + 1) & (capacity - 1)) {
+                if (snapshot->slots[slot] == TreeSnapshot::kNone) {
+                    snapshot->slots[slot] = i;
+                    break;
+                }
+            }
+        }
+        if (mime_table.empty()) {
+            mime_table.push_back(MimeTypes::kDefaultType);
+        }
+        snapshot->mime_types = mime_table;
+        entry_count.store(nodes.size(), std::memory_order_relaxed);
+        published.publish(std::move(snapshot));
+    }
+
+    void watchLoop() {
+        alignas(struct inotify_event) char buffer[16 * 1024];
+        bool dirty = false;
+        int64_t dirty_since = 0;
+        auto nowMillis = [] {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        };
+        while (true) {
+            pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+            int ready = poll(fds, 2, dirty ? kQuietMillis : -1);
+            if (ready < 0 && errno != EINTR) {
+                return;
+            }
+            if (fds[1].revents) {
+                return;
+            }
+            bool complete = true;
+            ssize_t length;
+            while (complete && (length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+                for (ssize_t offset = 0; complete && offset < length;) {
+                    auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                    complete = handleEvent(*event);
+                    offset += sizeof(inotify_event) + event->len;
+                }
+                if (!dirty) {
+                    dirty = true;
+                    dirty_since = nowMillis();
+                }
+            }
+            if (!complete) {
+                std::cerr << "Failed to watch " << root_path
+                          << " (raise fs.inotify.max_user_watches); serving without the metadata snapshot"
+                          << std::endl;
+                entry_count.store(0, std::memory_order_relaxed);
+                published.publish(nullptr);
+                // Nothing more to do but wait for the stop
+                pollfd stop = {stop_fd, POLLIN, 0};
+                while (poll(&stop, 1, -1) < 0 && errno == EINTR) {}
+                return;
+            }
+            if (dirty && (ready == 0 || nowMillis() - dirty_since >= kMaxDelayMillis)) {
+                publish();
+                dirty = false;
+            }
+        }
+    }
+};
+
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+// Incremental HTTP/1.x request-head parser. It tokenizes the request line
+// and headers into string_views over the caller's receive buffer without
+// allocating. Parsing is resumable: feed the same (possibly grown or moved)
+// buffer again after more bytes arrive and scanning continues where it
+// stopped, with views rebased onto the new buffer address.
+class RequestParser {
+public:
+    enum class Status {
+        Incomplete,
+        Complete,
+        Error
+    };
+
+    static constexpr size_t max_headers = 64;
+
+    explicit RequestParser(size_t max_head_bytes = 16 * 1024) : max_head_bytes(max_head_bytes) {}
+
+    void reset() {
+        base = nullptr;
+        line_start = 0;
+        scan_offset = 0;
+        head_length = 0;
+        header_count = 0;
+        error_status = 0;
+        have_request_line = false;
+        request_method = request_target = request_version = std::string_view();
+    }
+
+    // data must start at the same request each call until reset()
+    Status parse(const char* data, size_t length) {
+        if (base != nullptr && base != data) {
+            rebase(data);
+        }
+        base = data;
+
+        const char* end = data + length;
+        while (true) {
+            const char* line = data + line_start;
+            const char* newline = scanFor(data + scan_offset, end, '\n', '\n');
+            if (newline == end) {
+                scan_offset = length;
+                if (length > max_head_bytes) {
+                    return fail(431);
+                }
+                return Status::Incomplete;
+            }
+
+            size_t next_line = newline - data + 1;
+            if (next_line > max_head_bytes) {
+                return fail(431);
+            }
+            const char* line_end = (newline > line && newline[-1] == '\r') ? newline - 1 : newline;
+            std::string_view text(line, line_end - line);
+            line_start = scan_offset = next_line;
+
+            if (!have_request_line) {
+                // Tolerate empty lines ahead of the request line (RFC 9112 2.2)
+                if (text.empty()) {
+                    continue;
+                }
+                if (!parseRequestLine(text)) {
+                    return fail(400);
+                }
+                have_request_line = true;
+                continue;
+            }
+
+            if (text.empty()) {
+                head_length = next_line;
+                return Status::Complete;
+            }
+            if (!parseHeaderLine(text)) {
+                return fail(error_status ? error_status : 400);
+            }
+        }
+    }
+
+    size_t headLength() const { return head_length; }
+    int errorStatus() const { return error_status; }
+    std::string_view method() const { return request_method; }
+    std::string_view target() const { return request_target; }
+    std::string_view version() const { return request_version; }
+    const HttpHeader* headers() const { return header_list; }
+    size_t headerCount() const { return header_count; }
+
+    // Case-insensitive lookup of the first header called name
+    std::string_view header(std::string_view name) const {
+        for (size_t i = 0; i < header_count; i++) {
+            if (equalsIgnoreCase(header_list[i].name, name)) {
+                return header_list[i].value;
+            }
+        }
+        return std::string_view();
+    }
+
+    static bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+    }
+
+    // Returns the first position in [p, end) holding a or b, or end
+    static const char* scanFor(const char* p, const char* end, char a, char b) {
+#if defined(__SSE4_2__)
+        const __m128i set = _mm_setr_epi8(a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        while (end - p >= 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            int index = _mm_cmpestri(set, 2, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY);
+            if (index < 16) {
+                return p + index;
+            }
+            p += 16;
+        }
+#elif defined(__SSE2__)
+        const __m128i va = _mm_set1_epi8(a);
+        const __m128i vb = _mm_set1_epi8(b);
+        while (end - p >= 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+            if (mask != 0) {
+                return p + __builtin_ctz(mask);
+            }
+            p += 16;
+        }
+#elif defined(__ARM_NEON)
+        const uint8x16_t va = vdupq_n_u8(static_cast<uint8_t>(a));
+        const uint8x16_t vb = vdupq_n_u8(static_cast<uint8_t>(b));
+        while (end - p >= 16) {
+            uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+            uint8x16_t eq = vorrq_u8(vceqq_u8(chunk, va), vceqq_u8(chunk, vb));
+            // Narrow each byte to a nibble to get a 64-bit match mask
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+            if (mask != 0) {
+                return p + (__builtin_ctzll(mask) >> 2);
+            }
+            p += 16;
+        }
+#endif
+        while (p < end && *p != a && *p != b) {
+            p++;
+        }
+        return p;
+    }
+
+private:
+    size_t max_head_bytes;
+    const char* base = nullptr;
+    size_t line_start = 0;
+    size_t scan_offset = 0;
+    size_t head_length = 0;
+    size_t header_count = 0;
+    int error_status = 0;
+    bool have_request_line = false;
+    std::string_view request_method;
+    std::string_view request_target;
+    std::string_view request_version;
+    HttpHeader header_list[max_headers];
+
+    Status fail(int status) {
+        error_status = status;
+        return Status::Error;
+    }
+
+    static bool isControl(char c) {
+        return static_cast<unsigned char>(c) < 0x20 || c == 0x7f;
+    }
+
+    static std::string_view trim(std::string_view text) {
+        while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+            text.remove_prefix(1);
+        }
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+            text.remove_suffix(1);
+        }
+        return text;
+    }
+
+    void rebase(const char* data) {
+        auto move = [&](std::string_view& view) {
+            if (view.data() != nullptr) {
+                view = std::string_view(data + (view.data() - base), view.size());
+            }
+        };
+        move(request_method);
+        move(request_target);
+        move(request_version);
+        for (size_t i = 0; i < header_count; i++) {
+            move(header_list[i].name);
+            move(header_list[i].value);
+        }
+    }
+
+    bool parseRequestLine(std::string_view line) {
+        const char* begin = line.data();
+        const char* end = begin + line.size();
+        const char* first_space = scanFor(begin, end, ' ', ' ');
+        if (first_space == end) {
+            return false;
+        }
+        const char* second_space = scanFor(first_space + 1, end, ' ', ' ');
+        if (second_space == end) {
+            return false;
+        }
+
+        request_method = std::string_view(begin, first_space - begin);
+        request_target = std::string_view(first_space + 1, second_space - first_space - 1);
+        request_version = std::string_view(second_space + 1, end - second_space - 1);
+        if (request_method.empty() || request_target.empty() || request_version.substr(0, 5) != "HTTP/") {
+            return false;
+        }
+        for (char c : line) {
+            if (isControl(c) && c != '\t') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parseHeaderLine(std::string_view line) {
+        // Obsolete line folding is rejected (RFC 9112 5.2)
+        if (line.front() == ' ' || line.front() == '\t') {
+            return false;
+        }
+        const char* colon = scanFor(line.data(), line.data() + line.size(), ':', ':');
+        if (colon == line.data() + line.size() || colon == line.data()) {
+            return false;
+        }
+
+        std::string_view name(line.data(), colon - line.data());
+        for (char c : name) {
+            if (c == ' ' || c == '\t' || isControl(c)) {
+                return false;
+            }
+        }
+        if (header_count == max_headers) {
+            error_status = 431;
+            return false;
+        }
+        size_t value_offset = colon - line.data() + 1;
+        header_list[header_count++] = HttpHeader{name, trim(line.substr(value_offset))};
+        return true;
+    }
+};
+
+class HTTPServer;
+class ResponseWriter;
+
+// What a route handler sees of a request: the method, target, headers and
+// the path parameters its pattern captured, all views into the receive
+// buffer that stay valid until the handler returns. A continuation that
+// runs later (ResponseWriter::defer) gets copies captured by the handler.
+// Request bodies are skipped by the server and not passed on.
+class Request {
+public:
+    static constexpr size_t kMaxParams = 8;
+
+    struct Param {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    explicit Request(const RequestParser& parser) : parser(parser) {
+        std::string_view target = parser.target();
+        size_t question = target.find('?');
+        request_path = target.substr(0, question);
+        if (question != std::string_view::npos) {
+            request_query = target.substr(question + 1);
+        }
+    }
+
+    std::string_view method() const { return parser.method(); }
+    std::string_view target() const { return parser.target(); }
+    // The target up to and after '?', as sent (still percent-encoded)
+    std::string_view path() const { return request_path; }
+    std::string_view query() const { return request_query; }
+    std::string_view header(std::string_view name) const { return parser.header(name); }
+    const HttpHeader* headers() const { return parser.headers(); }
+    size_t headerCount() const { return parser.headerCount(); }
+
+    // Value captured by ":name" or "*name", empty when there is none
+    std::string_view param(std::string_view name) const {
+        for (size_t i = 0; i < param_count; i++) {
+            if (param_list[i].name == name) {
+                return param_list[i].value;
+            }
+        }
+        return {};
+    }
+    const Param* params() const { return param_list; }
+    size_t paramCount() const { return param_count; }
+
+private:
+    friend class Router;
+
+    const RequestParser& parser;
+    std::string_view request_path;
+    std::string_view request_query;
+    Param param_list[kMaxParams];
+    size_t param_count = 0;
+};
+
+// The response side of a route. A handle rather than the response itself:
+// it names the connection (or HTTP/2 stream) and the request it answers,
+// and does nothing once that connection is gone or the response ended.
+// Use it on the event loop only, from the handler or a defer()
+// continuation.
+//
+// end(body) alone answers with a Content-Length. Bytes passed to write()
+// go out as they are written: as chunks on HTTP/1.1, as DATA frames on
+// HTTP/2 and until the close on HTTP/1.0. A handler that returns without
+// ending the response, and with nothing deferred, ends it.
+//
+// Written bytes are buffered until the client takes them. Once more than
+// kHighWater are queued, write() returns false; a producer should stop
+// and carry on from onDrain(), which runs once the queue is down to
+// kLowWater.
+class ResponseWriter {
+public:
+    static constexpr size_t kHighWater = 256 * 1024;
+    static constexpr size_t kLowWater = 64 * 1024;
+
+    // Before the head is sent; throw std::logic_error after
+    ResponseWriter& status(int code);
+    // Throws std::invalid_argument for a CR or LF in either part
+    ResponseWriter& header(std::string_view name, std::string_view value);
+    // Return false when the client is gone or the response has ended;
+    // write() also when the bytes left more than kHighWater queued
+    bool write(std::string_view bytes);
+    bool end(std::string_view bytes = {});
+    bool alive() const;
+    // Bytes written that have not gone out yet: waiting for the socket or,
+    // on HTTP/2, for the stream's turn and flow-control window
+    size_t queued() const;
+
+    // Runs resume(writer) on the loop once no more than kLowWater bytes are
+    // queued, straight after the handler when that is already so. Keeps
+    // the response open meanwhile, as defer() does, and is dropped once
+    // the client has gone. A second call replaces the first.
+    void onDrain(std::function<void(ResponseWriter&)> resume);
+
+    // Runs work() on a worker thread (on the loop, after the handler
+    // returns, when there are no workers) and then then(writer, result)
+    // back on the loop. An exception from either ends the response as one
+    // from the handler does: 500 before the head is sent, a closed stream
+    // after. The response stays open while continuations are pending. With
+    // the worker queue full it is answered with 503 and then never runs,
+    // nor does it once the client has gone.
+    template <typename Work, typename Then>
+    void defer(Work work, Then then) {
+        using Result = decltype(work());
+        static_assert(!std::is_void_v<Result>, "defer() work must return a value");
+        struct Outcome {
+            std::optional<Result> value;
+            std::exception_ptr error;
+        };
+        auto outcome = std::make_shared<Outcome>();
+        submit([work = std::move(work), outcome]() mutable {
+                   try {
+                       outcome->value.emplace(work());
+                   } catch (...) {
+                       outcome->error = std::current_exception();
+                   }
+               },
+               [then = std::move(then), outcome](ResponseWriter& writer) mutable {
+                   if (outcome->error) {
+                       std::rethrow_exception(outcome->error);
+                   }
+                   then(writer, std::move(*outcome->value));
+               });
+    }
+
+private:
+    friend class HTTPServer;
+
+    ResponseWriter(HTTPServer* server, int loop, int fd, uint64_t id, uint32_t stream_id, uint64_t route)
+        : server(server), loop(loop), fd(fd), id(id), stream_id(stream_id), route(route) {}
+
+    void submit(std::function<void()> work, std::function<void(ResponseWriter&)> resume);
+
+    HTTPServer* server;
+    int loop;
+    int fd;
+    uint64_t id;
+    uint32_t stream_id;
+    uint64_t route;
+};
+
+using RouteHandler = std::function<void(const Request&, ResponseWriter&)>;
+
+// A route fixed at compile time: an exact method and path and a handler
+// of any callable type, called directly
+template <typename Handler>
+struct StaticRoute {
+    std::string_view method;
+    std::string_view path;
+    Handler handler;
+};
+
+template <typename Handler>
+constexpr StaticRoute<Handler> route(std::string_view method, std::string_view path, Handler handler) {
+    return {method, path, std::move(handler)};
+}
+
+// Table of static routes expanded into a chain of comparisons and direct
+// calls, so the compiler can inline each handler; no std::function or
+// virtual call per route. Built with makeRoutes() and mounted on a Router.
+template <typename... Routes>
+class StaticRoutes {
+public:
+    explicit StaticRoutes(Routes... routes) : routes(std::move(routes)...) {}
+
+    // Calls the handler of the first route matching the request's method
+    // and path; false when none does
+    bool dispatch(const Request& request, ResponseWriter& writer) const {
+        return std::apply(
+            [&](const auto&... entry) {
+                return ((entry.method == request.method() && entry.path == request.path() &&
+                         (entry.handler(request, writer), true)) || ...);
+            },
+            routes);
+    }
+
+private:
+    std::tuple<Routes...> routes;
+};
+
+template <typename... Routes>
+StaticRoutes<Routes...> makeRoutes(Routes... routes) {
+    return StaticRoutes<Routes...>(std::move(routes)...);
+}
+
+// Routes registered at startup, matched against a request's path (as sent)
+// in a radix tree. A pattern is a path whose segments may be ":name",
+// matching one non-empty segment, or, last, "*name", matching the rest of
+// the path. Literal edges win over a parameter and a parameter over a
+// wildcard, backtracking when a more specific branch leads nowhere. The
+// tree is read-only once the server starts, so loops share it unlocked.
+class Router {
+public:
+    enum class Lookup {
+        Found,
+        // The path matches but not for this method; allowed lists the methods
+        WrongMethod,
+        None
+    };
+
+    // Throws std::invalid_argument for a malformed pattern, a parameter
+    // named differently from one already at the same place, or a method
+    // and pattern registered twice
+    Router& add(std::string_view method, std::string_view pattern, RouteHandler handler) {
+        if (method.empty() || pattern.empty() || pattern.front() != '/') {
+            throw std::invalid_argument("Route pattern must start with '/': " + std::string(pattern));
+        }
+        Node* node = &root;
+        std::string_view rest = pattern;
+        while (!rest.empty()) {
+            if (rest.front() == ':' || rest.front() == '*') {
+                bool wildcard = rest.front() == '*';
+                size_t end = wildcard ? rest.size() : std::min(rest.find('/'), rest.size());
+                std::string_view name = rest.substr(1, end - 1);
+                if (name.empty() || name.find_first_of(":*/") != std::string_view::npos ||
+                    (node->label.empty() ? node != &root : node->label.back() != '/')) {
+                    throw std::invalid_argument("Invalid parameter in route pattern: " + std::string(pattern));
+                }
+                std::unique_ptr<Node>& child = wildcard ? node->wildcard : node->param;
+                if (!child) {
+                    child = std::make_unique<Node>();
+                    child->name = std::string(name);
+                } else if (child->name != name) {
+                    throw std::invalid_argument("Route pattern " + std::string(pattern) + " renames parameter " +
+                                                child->name);
+                }
+                node = child.get();
+                rest.remove_prefix(end);
+                continue;
+            }
+            size_t end = std::min(rest.find_first_of(":*"), rest.size());
+            node = insertLiteral(*node, rest.substr(0, end));
+            rest.remove_prefix(end);
+        }
+        for (const auto& entry : node->handlers) {
+            if (entry.first == method) {
+                throw std::invalid_argument("Route registered twice: " + std::string(method) + " " +
+                                            std::string(pattern));
+            }
+        }
+        node->handlers.emplace_back(std::string(method), std::move(handler));
+        return *this;
+    }
+
+    // Static routes are tried ahead of the tree
+    template <typename... Routes>
+    Router& mount(StaticRoutes<Routes...> routes) {
+        mounted = [routes = std::move(routes)](const Request& request, ResponseWriter& writer) {
+            return routes.dispatch(request, writer);
+        };
+        return *this;
+    }
+
+    bool dispatchStatic(const Request& request, ResponseWriter& writer) const {
+        return mounted && mounted(request, writer);
+    }
+
+    // Fills request's parameters on a match, handler with the route's
+    // handler when the method matches too and allowed with the methods
+    // the path has when it does not
+    Lookup find(Request& request, const RouteHandler*& handler, std::string& allowed) const {
+        request.param_count = 0;
+        const Node* node = match(root, request.request_path, request);
+        if (node == nullptr) {
+            return Lookup::None;
+        }
+        for (const auto& entry : node->handlers) {
+            if (entry.first == request.method()) {
+                handler = &entry.second;
+                return Lookup::Found;
+            }
+        }
+        allowed.clear();
+        for (const auto& entry : node->handlers) {
+            allowed += allowed.empty() ? "" : ", ";
+            allowed += entry.first;
+        }
+        return Lookup::WrongMethod;
+    }
+
+    bool empty() const { return !mounted && root.children.empty(); }
+
+private:
+    struct Node {
+        // Literal bytes on the edge into the node; a parameter's or
+        // wildcard's name instead
+        std::string label;
+        std::string name;
+        // Literal children, each starting with a different byte
+        std::vector<std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> param;
+        std::unique_ptr<Node> wildcard;
+        std::vector<std::pair<std::string, RouteHandler>> handlers;
+    };
+
+    Node root;
+    std::function<bool(const Request&, ResponseWriter&)> mounted;
+
+    static Node* insertLiteral(Node& parent, std::string_view text) {
+        Node* node = &parent;
+        while (!text.empty()) {
+            auto it = std::find_if(node->children.begin(), node->children.end(),
+                                   [&](const std::unique_ptr<Node>& child) { return child->label[0] == text[0]; });
+            if (it == node->children.end()) {
+                node->children.push_back(std::make_unique<Node>());
+                node->children.back()->label = std::string(text);
+                return node->children.back().get();
+            }
+            Node& child = **it;
+            size_t common = 0;
+            while (common < child.label.size() && common < text.size() && child.label[common] == text[common]) {
+                common++;
+            }
+            if (common < child.label.size()) {
+                // Split the edge: the shared prefix becomes a node of its own
+                auto split = std::make_unique<Node>();
+                split->label = child.label.substr(0, common);
+                child.label.erase(0, common);
+                split->children.push_back(std::move(*it));
+                *it = std::move(split);
+            }
+            node = it->get();
+            text.remove_prefix(common);
+        }
+        return node;
+    }
+
+    static const Node* match(const Node& node, std::string_view path, Request& request) {
+        if (path.empty() && !node.handlers.empty()) {
+            return &node;
+        }
+        if (!path.empty()) {
+            for (const auto& child : node.children) {
+                if (child->label[0] == path[0]) {
+                    if (path.substr(0, child->label.size()) == child->label) {
+                        if (const Node* found = match(*child, path.substr(child->label.size()), request)) {
+                            return found;
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+        size_t params = request.param_count;
+        if (node.param && params < Request::kMaxParams) {
+            size_t end = std::min(path.find('/'), path.size());
+            if (end > 0) {
+                request.param_list[request.param_count++] = {node.param->name, path.substr(0, end)};
+                if (const Node* found = match(*node.param, path.substr(end), request)) {
+                    return found;
+                }
+                request.param_count = params;
+            }
+        }
+        if (node.wildcard && !node.wildcard->handlers.empty() && params < Request::kMaxParams) {
+            request.param_list[request.param_count++] = {node.wildcard->name, path};
+            return node.wildcard.get();
+        }
+        return nullptr;
+    }
+};
+
+// Free list of fixed-size receive buffers owned by one event loop, so
+// connections borrow storage only while they hold unread bytes
+class BufferPool {
+public:
+    explicit BufferPool(size_t buffer_size = 4096, size_t max_free = 1024)
+        : buffer_size(buffer_size), max_free(max_free) {}
+
+    size_t bufferSize() const { return buffer_size; }
+
+    std::unique_ptr<char[]> acquire() {
+        if (free_buffers.empty()) {
+            return std::unique_ptr<char[]>(new char[buffer_size]);
+        }
+        std::unique_ptr<char[]> buffer = std::move(free_buffers.back());
+        free_buffers.pop_back();
+        return buffer;
+    }
+
+    // Buffers that grew past the pool size are simply freed
+    void release(std::unique_ptr<char[]> buffer, size_t capacity) {
+        if (capacity == buffer_size && free_buffers.size() < max_free) {
+            free_buffers.push_back(std::move(buffer));
+        }
+    }
+
+private:
+    size_t buffer_size;
+    size_t max_free;
+    std::vector<std::unique_ptr<char[]>> free_buffers;
+};
+
+// Growable per-connection receive buffer. Unconsumed bytes live in
+// [begin, end); consume() advances begin and the buffer compacts or doubles
+// (up to a cap) only when a read needs room.
+class ReceiveBuffer {
+public:
+    const char* data() const { return storage.get() + begin; }
+    size_t size() const { return end - begin; }
+    bool empty() const { return begin == end; }
+    bool full(size_t max_capacity) const { return begin == 0 && end == max_capacity; }
+
+    // Returns the number of bytes writable at writePointer(), or 0 when the
+    // buffer already holds max_capacity unconsumed bytes
+    size_t prepare(BufferPool& pool, size_t max_capacity) {
+        if (!storage) {
+            storage = pool.acquire();
+            capacity = pool.bufferSize();
+        }
+        if (end == capacity && begin > 0) {
+            std::memmove(storage.get(), storage.get() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end == capacity && capacity < max_capacity) {
+            size_t grown = std::min(capacity * 2, max_capacity);
+            std::unique_ptr<char[]> larger(new char[grown]);
+            std::memcpy(larger.get(), storage.get(), end);
+            pool.release(std::move(storage), capacity);
+            storage = std::move(larger);
+            capacity = grown;
+        }
+        return capacity - end;
+    }
+
+    char* writePointer() { return storage.get() + end; }
+    void commit(size_t bytes) { end += bytes; }
+
+    void consume(size_t bytes) {
+        begin += bytes;
+        if (begin == end) {
+            begin = end = 0;
+        }
+    }
+
+    void release(BufferPool& pool) {
+        if (storage && empty()) {
+            pool.release(std::move(storage), capacity);
+            storage.reset();
+            capacity = 0;
+        }
+    }
+
+    void discard(BufferPool& pool) {
+        begin = end = 0;
+        release(pool);
+    }
+
+private:
+    std::unique_ptr<char[]> storage;
+    size_t capacity = 0;
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+// Bump allocator for the bytes of queued responses. Blocks come from the
+// loop's buffer pool and all go back at once in reset(), which runs each
+// time the connection's output drains, so steady-state serving does not
+// touch the global heap. Requests larger than a pool block get their own.
+class Arena {
+public:
+    explicit Arena(BufferPool& pool) : pool(&pool) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+        reset();
+    }
+
+    char* allocate(size_t bytes) {
+        if (blocks.empty() || block_used + bytes > blocks.back().capacity) {
+            addBlock(bytes);
+        }
+        char* pointer = blocks.back().memory.get() + block_used;
+        block_used += bytes;
+        return pointer;
+    }
+
+    void reset() {
+        for (Block& block : blocks) {
+            pool->release(std::move(block.memory), block.capacity);
+        }
+        blocks.clear();
+        block_used = 0;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> memory;
+        size_t capacity;
+    };
+
+    void addBlock(size_t bytes) {
+        Block block;
+        if (bytes <= pool->bufferSize()) {
+            block.memory = pool->acquire();
+            block.capacity = pool->bufferSize();
+        } else {
+            block.memory.reset(new char[bytes]);
+            block.capacity = bytes;
+        }
+        blocks.push_back(std::move(block));
+        block_used = 0;
+    }
+
+    BufferPool* pool;
+    std::vector<Block> blocks;
+    size_t block_used = 0;
+};
+
+// Frames a request body declared by Content-Length or chunked
+// Transfer-Encoding so the next request on the connection starts at the
+// right byte. Body bytes are appended to the caller's string if one is
+// given and skipped otherwise.
+class BodyDecoder {
+public:
+    enum class Status {
+        Incomplete,
+        Complete,
+        Error
+    };
+
+    bool active() const { return state != State::Idle; }
+
+    void startLength(uint64_t length) {
+        remaining = length;
+        chunked = false;
+        state = length > 0 ? State::Data : State::Idle;
+    }
+
+    void startChunked() {
+        remaining = 0;
+        chunked = true;
+        state = State::ChunkSize;
+    }
+
+    // Consumes body bytes from [data, data + length) and reports how many
+    // were used; incomplete framing lines are left for the next call
+    Status feed(const char* data, size_t length, size_t& consumed, std::string* body) {
+        size_t pos = 0;
+        Status status = Status::Incomplete;
+        while (pos < length && state != State::Idle) {
+            if (state == State::Data) {
+                size_t n = std::min<uint64_t>(remaining, length - pos);
+                if (body) {
+                    body->append(data + pos, n);
+                }
+                pos += n;
+                remaining -= n;
+                if (remaining == 0) {
+                    state = chunked ? State::ChunkEnd : State::Idle;
+                }
+                continue;
+            }
+
+            // Every other state consumes one CRLF-terminated line
+            const char* newline = static_cast<const char*>(memchr(data + pos, '\n', length - pos));
+            if (newline == nullptr) {
+                if (length - pos > max_line) {
+                    state = State::Idle;
+                    consumed = pos;
+                    return Status::Error;
+                }
+                break;
+            }
+            std::string_view line(data + pos, newline - (data + pos));
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            pos = newline - data + 1;
+
+            if (state == State::ChunkSize) {
+                if (!parseChunkSize(line)) {
+                    state = State::Idle;
+                    consumed = pos;
+                    return Status::Error;
+                }
+                state = remaining > 0 ? State::Data : State::Trailer;
+            } else if (state == State::ChunkEnd) {
+                if (!line.empty()) {
+                    state = State::Idle;
+                    consumed = pos;
+                    return Status::Error;
+                }
+                state = State::ChunkSize;
+            } else if (line.empty()) {
+                // Blank line ends the (ignored) trailer section
+                state = State::Idle;
+            }
+        }
+
+        if (state == State::Idle) {
+            status = Status::Complete;
+        }
+        consumed = pos;
+        return status;
+    }
+
+private:
+    enum class State {
+        Idle,
+        Data,
+        ChunkSize,
+        ChunkEnd,
+        Trailer
+    };
+
+    static constexpr size_t max_line = 4096;
+
+    State state = State::Idle;
+    uint64_t remaining = 0;
+    bool chunked = false;
+
+    bool parseChunkSize(std::string_view line) {
+        uint64_t size = 0;
+        size_t digits = 0;
+        for (char c : line) {
+            int value;
+            if (c >= '0' && c <= '9') {
+                value = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                value = c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                value = c - 'A' + 10;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                break; // chunk extensions are ignored
+            } else {
+                return false;
+            }
+            if (++digits > 15) {
+                return false;
+            }
+            size = size * 16 + value;
+        }
+        remaining = size;
+        return digits > 0;
+    }
+};
+
+// HPACK (RFC 7541): Huffman coding, the static table and the dynamic
+// table both ends of an HTTP/2 connection keep in step
+
+struct HuffmanCode {
+    uint32_t code;
+    uint8_t bits;
+};
+
+// Appendix B, indexed by symbol; 256 is EOS
+constexpr HuffmanCode kHuffmanCodes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+    {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+    {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+    {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+    {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+    {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+    {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30}
+};
+
+// The code is canonical (codes of one length are consecutive and follow
+// the shorter ones), so decoding needs only the first code and the symbols
+// of each length instead of a tree
+class HuffmanDecoder {
+public:
+    static const HuffmanDecoder& instance() {
+        static const HuffmanDecoder decoder;
+        return decoder;
+    }
+
+    // Appends the decoded bytes; false on EOS inside the string, padding
+    // longer than 7 bits or padding that is not the EOS prefix (5.2)
+    bool decode(const uint8_t* data, size_t length, std::string& out) const {
+        uint64_t bits = 0;
+        int available = 0;
+        size_t pos = 0;
+        while (true) {
+            while (available <= 56 && pos < length) {
+                bits |= uint64_t(data[pos++]) << (56 - available);
+                available += 8;
+            }
+            if (available == 0) {
+                return true;
+            }
+            int bits_used = 0;
+            int symbol = -1;
+            uint32_t code = 0;
+            for (int len = kMinBits; len <= kMaxBits && len <= available; len++) {
+                code = static_cast<uint32_t>(bits >> (64 - len));
+                if (code - first_code[len] < count[len]) {
+                    symbol = symbols[offset[len] + code - first_code[len]];
+                    bits_used = len;
+                    break;
+                }
+            }
+            if (symbol < 0) {
+                // Out of input mid-code: only a short run of ones may remain
+                return pos == length && available < 8 && (bits >> (64 - available)) == (1u << available) - 1;
+            }
+            if (symbol == 256) {
+                return false;
+            }
+            out += static_cast<char>(symbol);
+            bits <<= bits_used;
+            available -= bits_used;
+        }
+    }
+
+private:
+    static constexpr int kMinBits = 5;
+    static constexpr int kMaxBits = 30;
+
+    HuffmanDecoder() {
+        for (const HuffmanCode& c : kHuffmanCodes) {
+            count[c.bits]++;
+        }
+        uint32_t code = 0;
+        uint16_t index = 0;
+        for (int len = 1; len <= kMaxBits; len++) {
+            first_code[len] = code;
+            offset[len] = index;
+            index += count[len];
+            code = (code + count[len]) << 1;
+        }
+        uint16_t next[kMaxBits + 1];
+        std::memcpy(next, offset, sizeof(next));
+        for (int symbol = 0; symbol < 257; symbol++) {
+            symbols[next[kHuffmanCodes[symbol].bits]++] = static_cast<uint16_t>(symbol);
+        }
+    }
+
+    uint32_t first_code[kMaxBits + 1] = {};
+    uint32_t count[kMaxBits + 1] = {};
+    uint16_t offset[kMaxBits + 1] = {};
+    uint16_t symbols[257] = {};
+};
+
+inline size_t huffmanLength(std::string_view text) {
+    size_t bits = 0;
+    for (unsigned char c : text) {
+        bits += kHuffmanCodes[c].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+inline void huffmanEncode(std::string_view text, std::string& out) {
+    uint64_t bits = 0;
+    int pending = 0;
+    for (unsigned char c : text) {
+        bits = (bits << kHuffmanCodes[c].bits) | kHuffmanCodes[c].code;
+        pending += kHuffmanCodes[c].bits;
+        while (pending >= 8) {
+            pending -= 8;
+            out += static_cast<char>(bits >> pending);
+        }
+    }
+    if (pending > 0) {
+        // Padded with the most significant bits of EOS, all ones
+        out += static_cast<char>((bits << (8 - pending)) | ((1u << (8 - pending)) - 1));
+    }
+}
+
+// Appendix A
+constexpr std::pair<std::string_view, std::string_view> kHpackStaticTable[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""},
+    {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""}};
+constexpr size_t kHpackStaticEntries = std::size(kHpackStaticTable);
+
+// Dynamic table (2.3.2): newest entry first, evicted from the old end as
+// the size (32 bytes of overhead per entry plus name and value) exceeds
+// the limit
+class HpackTable {
+public:
+    size_t limit() const { return max_size; }
+
+    void setLimit(size_t bytes) {
+        max_size = bytes;
+        evict(0);
+    }
+
+    void add(std::string_view name, std::string_view value) {
+        size_t bytes = entrySize(name, value);
+        if (bytes > max_size) {
+            fields.clear();
+            size = 0;
+            return; // too large for the table: it is emptied, not filled (4.4)
+        }
+        evict(bytes);
+        fields.emplace_front(std::string(name), std::string(value));
+        size += bytes;
+    }
+
+    // 1-based HPACK index over the static table followed by this one
+    const std::pair<std::string, std::string>* dynamicEntry(size_t index) const {
+        index -= kHpackStaticEntries + 1;
+        return index < fields.size() ? &fields[index] : nullptr;
+    }
+
+    // Index of an entry with this name and value (exact) or only this name
+    // (name_only), 0 if none
+    size_t find(std::string_view name, std::string_view value, bool& exact) const {
+        size_t name_only = 0;
+        for (size_t i = 0; i < fields.size(); i++) {
+            if (fields[i].first == name) {
+                if (fields[i].second == value) {
+                    exact = true;
+                    return kHpackStaticEntries + 1 + i;
+                }
+                if (name_only == 0) {
+                    name_only = kHpackStaticEntries + 1 + i;
+                }
+            }
+        }
+        exact = false;
+        return name_only;
+    }
+
+private:
+    static size_t entrySize(std::string_view name, std::string_view value) { return 32 + name.size() + value.size(); }
+
+    void evict(size_t room) {
+        while (!fields.empty() && size + room > max_size) {
+            size -= entrySize(fields.back().first, fields.back().second);
+            fields.pop_back();
+        }
+    }
+
+    std::deque<std::pair<std::string, std::string>> fields;
+    size_t size = 0;
+    size_t max_size = 4096;
+};
+
+struct HpackField {
+    std::string name;
+    std::string value;
+};
+
+class HpackDecoder {
+public:
+    // Decodes one complete header block. False is a COMPRESSION_ERROR,
+    // fatal to the connection since the tables are out of step. Once the
+    // decoded list passes max_list_bytes (counted as in RFC 7541 4.1, 32
+    // bytes over name and value per field) oversized is set and no more
+    // fields are kept, but the rest of the block still updates the table.
+    bool decode(const uint8_t* data, size_t length, std::vector<HpackField>& fields, size_t max_list_bytes,
+                bool& oversized) {
+        fields.clear();
+        oversized = false;
+        size_t list_bytes = 0;
+        const uint8_t* end = data + length;
+        bool header_seen = false;
+        auto keep = [&](HpackField& field) {
+            list_bytes += field.name.size() + field.value.size() + 32;
+            if (list_bytes > max_list_bytes) {
+                oversized = true;
+                fields.clear();
+            }
+        };
+        while (data < end) {
+            uint8_t first = *data;
+            uint64_t index;
+            if (first & 0x80) {
+                // Indexed field; past the limit only checked, never copied
+                if (!readInteger(data, end, 7, index)) {
+                    return false;
+                }
+                if (oversized) {
+                    if (!valid(index)) {
+                        return false;
+                    }
+                } else if (!lookup(index, fields.emplace_back(), true)) {
+                    return false;
+                } else {
+                    keep(fields.back());
+                }
+                header_seen = true;
+                continue;
+            }
+            if ((first & 0xe0) == 0x20) {
+                // Table size update, only at the start of a block (4.2)
+                if (header_seen || !readInteger(data, end, 5, index) || index > max_limit) {
+                    return false;
+                }
+                table.setLimit(index);
+                continue;
+            }
+            bool indexing = (first & 0xc0) == 0x40;
+            if (!readInteger(data, end, indexing ? 6 : 4, index)) {
+                return false;
+            }
+            HpackField& field = oversized ? discarded : fields.emplace_back();
+            if (index == 0 ? !readString(data, end, field.name) : !lookup(index, field, false)) {
+                return false;
+            }
+            if (!readString(data, end, field.value)) {
+                return false;
+            }
+            if (indexing) {
+                table.add(field.name, field.value);
+            }
+            if (!oversized) {
+                keep(field);
+            }
+            header_seen = true;
+        }
+        return true;
+    }
+
+private:
+    static bool readInteger(const uint8_t*& data, const uint8_t* end, int prefix_bits, uint64_t& value) {
+        uint64_t mask = (1u << prefix_bits) - 1;
+        value = *data++ & mask;
+        if (value < mask) {
+            return true;
+        }
+        for (int shift = 0; shift <= 28; shift += 7) {
+            if (data == end) {
+                return false;
+            }
+            uint8_t byte = *data++;
+            value += uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false; // longer than any sane length or index
+    }
+
+    static bool readString(const uint8_t*& data, const uint8_t* end, std::string& out) {
+        if (data == end) {
+            return false;
+        }
+        bool huffman = *data & 0x80;
+        uint64_t length;
+        if (!readInteger(data, end, 7, length) || length > static_cast<uint64_t>(end - data)) {
+            return false;
+        }
+        out.clear();
+        bool ok = huffman ? HuffmanDecoder::instance().decode(data, length, out)
+                          : (out.assign(reinterpret_cast<const char*>(data), length), true);
+        data += length;
+        return ok;
+    }
+
+    bool valid(uint64_t index) const {
+        return index != 0 && (index <= kHpackStaticEntries || table.dynamicEntry(index) != nullptr);
+    }
+
+    bool lookup(uint64_t index, HpackField& field, bool with_value) const {
+        if (index == 0) {
+            return false;
+        }
+        if (index <= kHpackStaticEntries) {
+            field.name = kHpackStaticTable[index - 1].first;
+            if (with_value) {
+                field.value = kHpackStaticTable[index - 1].second;
+            }
+            return true;
+        }
+        const auto* entry = table.dynamicEntry(index);
+        if (entry == nullptr) {
+            return false;
+        }
+        field.name = entry->first;
+        if (with_value) {
+            field.value = entry->second;
+        }
+        return true;
+    }
+
+    HpackTable table;
+    // SETTINGS_HEADER_TABLE_SIZE we advertise (the default)
+    size_t max_limit = 4096;
+    // Literals of a block that is already over its limit, decoded only
+    // to keep the table in step
+    HpackField discarded;
+};
+
+class HpackEncoder {
+public:
+    // The peer's SETTINGS_HEADER_TABLE_SIZE; a smaller table is announced
+    // at the start of the next block
+    void setPeerLimit(size_t bytes) {
+        size_t limit = std::min<size_t>(bytes, 4096);
+        if (limit != table.limit()) {
+            table.setLimit(limit);
+            size_update_pending = true;
+        }
+    }
+
+    void beginBlock(std::string& out) {
+        if (size_update_pending) {
+            writeInteger(out, 0x20, 5, table.limit());
+            size_update_pending = false;
+        }
+    }
+
+    // Fields worth indexing repeat across responses (content-type, server,
+    // vary, ...); per-response ones (content-length, etag) are not indexed
+    // so they do not push the repeating ones out of the table
+    void encode(std::string& out, std::string_view name, std::string_view value, bool indexing) {
+        bool exact = false;
+        size_t index = table.find(name, value, exact);
+        if (exact) {
+            writeInteger(out, 0x80, 7, index);
+            return;
+        }
+        size_t name_index = 0;
+        for (size_t i = 0; i < kHpackStaticEntries; i++) {
+            if (kHpackStaticTable[i].first == name) {
+                if (kHpackStaticTable[i].second == value) {
+                    writeInteger(out, 0x80, 7, i + 1);
+                    return;
+                }
+                if (name_index == 0) {
+                    name_index = i + 1;
+                }
+            }
+        }
+        if (name_index == 0) {
+            name_index = index;
+        }
+        if (indexing) {
+            writeInteger(out, 0x40, 6, name_index);
+        } else {
+            writeInteger(out, 0x00, 4, name_index);
+        }
+        if (name_index == 0) {
+            writeString(out, name);
+        }
+        writeString(out, value);
+        if (indexing) {
+            table.add(name, value);
+        }
+    }
+
+private:
+    static void writeInteger(std::string& out, uint8_t flags, int prefix_bits, uint64_t value) {
+        uint64_t mask = (1u << prefix_bits) - 1;
+        if (value < mask) {
+            out += static_cast<char>(flags | value);
+            return;
+        }
+        out += static_cast<char>(flags | mask);
+        value -= mask;
+        while (value >= 0x80) {
+            out += static_cast<char>(0x80 | (value & 0x7f));
+            value >>= 7;
+        }
+        out += static_cast<char>(value);
+    }
+
+    static void writeString(std::string& out, std::string_view text) {
+        size_t encoded = huffmanLength(text);
+        if (encoded < text.size()) {
+            writeInteger(out, 0x80, 7, encoded);
+            huffmanEncode(text, out);
+        } else {
+            writeInteger(out, 0x00, 7, text.size());
+            out += text;
+        }
+    }
+
+    HpackTable table;
+    bool size_update_pending = false;
+};
+
+// HTTP/2 framing (RFC 9113)
+constexpr std::string_view kHttp2Preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+constexpr size_t kHttp2FrameHeaderBytes = 9;
+// SETTINGS_MAX_FRAME_SIZE in both directions: we advertise the default
+// and never send more, whatever the peer allows
+constexpr size_t kHttp2MaxFrameBytes = 16384;
+// Receive buffer cap of an HTTP/2 connection; holds a whole frame
+constexpr size_t kHttp2InputBytes = 32 * 1024;
+constexpr uint32_t kHttp2MaxStreams = 128;
+constexpr int64_t kHttp2MaxWindow = 0x7fffffff;
+constexpr int64_t kHttp2DefaultWindow = 65535;
+
+enum Http2FrameType : uint8_t {
+    Http2Data = 0x0,
+    Http2Headers = 0x1,
+    Http2Priority = 0x2,
+    Http2RstStream = 0x3,
+    Http2Settings = 0x4,
+    Http2PushPromise = 0x5,
+    Http2Ping = 0x6,
+    Http2GoAway = 0x7,
+    Http2WindowUpdate = 0x8,
+    Http2Continuation = 0x9,
+    // RFC 9218
+    Http2PriorityUpdate = 0x10
+};
+
+enum Http2Flag : uint8_t {
+    Http2EndStream = 0x1,
+    Http2Ack = 0x1,
+    Http2EndHeaders = 0x4,
+    Http2Padded = 0x8,
+    Http2PriorityFlag = 0x20
+};
+
+enum Http2Error : uint32_t {
+    Http2NoError = 0x0,
+    Http2ProtocolError = 0x1,
+    Http2InternalError = 0x2,
+    Http2FlowControlError = 0x3,
+    Http2StreamClosed = 0x5,
+    Http2FrameSizeError = 0x6,
+    Http2RefusedStream = 0x7,
+    Http2CompressionError = 0x9,
+    Http2EnhanceYourCalm = 0xb
+};
+
+// Headers that only mean something on one HTTP/1.1 hop (RFC 9113 8.2.2);
+// names are lowercase
+inline bool isConnectionSpecificHeader(std::string_view name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+           name == "transfer-encoding" || name == "upgrade";
+}
+
+// Reads urgency (u=0..7) and incremental (i) from a Priority field value
+// (RFC 9218 4), leaving either unchanged when absent or malformed
+inline void parsePriority(std::string_view field, uint8_t& urgency, bool& incremental) {
+    while (!field.empty()) {
+        size_t comma = field.find(',');
+        std::string_view member = field.substr(0, comma);
+        field = comma == std::string_view::npos ? std::string_view() : field.substr(comma + 1);
+        member = member.substr(0, member.find(';')); // parameters
+        while (!member.empty() && (member.front() == ' ' || member.front() == '\t')) {
+            member.remove_prefix(1);
+        }
+        while (!member.empty() && (member.back() == ' ' || member.back() == '\t')) {
+            member.remove_suffix(1);
+        }
+        if (member.size() == 3 && member.substr(0, 2) == "u=" && member[2] >= '0' && member[2] <= '7') {
+            urgency = static_cast<uint8_t>(member[2] - '0');
+        } else if (member == "i" || member == "i=?1") {
+            incremental = true;
+        } else if (member == "i=?0") {
+            incremental = false;
+        }
+    }
+}
+
+// Fixed-size pool for blocking work such as cold disk reads. Each worker
+// owns a deque: submissions are spread across the deques round-robin, a
+// worker takes the oldest task from its own deque and steals the newest from
+// a busier one when it runs dry, and a shared overflow queue absorbs bursts
+// beyond a deque's share. The total number of waiting tasks is bounded so
+// a slow disk turns into rejected submissions instead of memory growth.
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    ThreadPool(size_t thread_count, size_t max_queued)
+        : max_queued(max_queued), local_capacity(std::max<size_t>(1, max_queued / std::max<size_t>(1, thread_count))) {
+        for (size_t i = 0; i < thread_count; i++) {
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        for (size_t i = 0; i < thread_count; i++) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+    }
+
+    ~ThreadPool() {
+        shutdown();
+    }
+
+    // Returns false without queuing when max_queued tasks are already waiting
+    bool trySubmit(Task task) {
+        size_t depth = queued.load(std::memory_order_relaxed);
+        do {
+            if (depth >= max_queued || stopping) {
+                rejected.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        } while (!queued.compare_exchange_weak(depth, depth + 1, std::memory_order_relaxed));
+
+        WorkerQueue& queue = *queues[next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size()];
+        bool placed = false;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.size() < local_capacity) {
+                queue.tasks.push_back(std::move(task));
+                placed = true;
+            }
+        }
+        if (!placed) {
+            std::lock_guard<std::mutex> lock(overflow_mutex);
+            overflow.push_back(std::move(task));
+        }
+
+        available.fetch_add(1, std::memory_order_release);
+        { std::lock_guard<std::mutex> lock(idle_mutex); }
+        idle_cv.notify_one();
+        return true;
+    }
+
+    // Stops the workers; tasks that have not started are dropped
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            if (stopping) {
+                return;
+            }
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto& worker : workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    size_t queueDepth() const { return queued.load(std::memory_order_relaxed); }
+    size_t threadCount() const { return workers.size(); }
+    uint64_t completedCount() const { return completed.load(std::memory_order_relaxed); }
+    uint64_t rejectedCount() const { return rejected.load(std::memory_order_relaxed); }
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    size_t max_queued;
+    size_t local_capacity;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::mutex overflow_mutex;
+    std::deque<Task> overflow;
+    std::vector<std::thread> workers;
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+    std::atomic<bool> stopping{false};
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> available{0};
+    std::atomic<size_t> next_queue{0};
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> rejected{0};
+
+    bool takeTask(size_t index, Task& task) {
+        {
+            WorkerQueue& own = *queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(overflow_mutex);
+            if (!overflow.empty()) {
+                task = std::move(overflow.front());
+                overflow.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            WorkerQueue& victim = *queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t index) {
+        while (true) {
+            Task task;
+            if (takeTask(index, task)) {
+                available.fetch_sub(1, std::memory_order_relaxed);
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                task();
+                completed.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(idle_mutex);
+            idle_cv.wait(lock, [this] {
+                return stopping || available.load(std::memory_order_acquire) > 0;
+            });
+            if (stopping) {
+                return;
+            }
+        }
+    }
+};
+
+// Minimal io_uring wrapper over the raw syscalls, so the optional backend
+// needs nothing beyond the kernel headers. One instance per loop thread;
+// SQEs queued while handling completions go out in one io_uring_enter().
+class IoUring {
+public:
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        if (sqes != nullptr) {
+            munmap(sqes, sqes_bytes);
+        }
+        if (ring_memory != nullptr) {
+            munmap(ring_memory, ring_bytes);
+        }
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+    }
+
+    // Must be called on the thread that will submit (SINGLE_ISSUER)
+    void init(unsigned entries) {
+        struct io_uring_params params{};
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0 && errno == EINVAL) {
+            // Older kernels reject the hint flags
+            params = io_uring_params{};
+            ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (ring_fd < 0) {
+            throw std::runtime_error("io_uring_setup failed: " + std::string(strerror(errno)));
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+            throw std::runtime_error("io_uring backend needs a 5.5+ kernel");
+        }
+
+        ring_bytes = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                              params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+        void* memory = mmap(nullptr, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring_fd, IORING_OFF_SQ_RING);
+        if (memory == MAP_FAILED) {
+            throw std::runtime_error("Failed to map io_uring rings");
+        }
+        ring_memory = static_cast<char*>(memory);
+
+        sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+        memory = mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQES);
+        if (memory == MAP_FAILED) {
+            throw std::runtime_error("Failed to map io_uring SQEs");
+        }
+        sqes = static_cast<struct io_uring_sqe*>(memory);
+
+        sq_head = reinterpret_cast<unsigned*>(ring_memory + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(ring_memory + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(ring_memory + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(ring_memory + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        cq_head = reinterpret_cast<unsigned*>(ring_memory + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(ring_memory + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(ring_memory + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(ring_memory + params.cq_off.cqes);
+        local_tail = *sq_tail;
+    }
+
+    int fd() const { return ring_fd; }
+
+    // Returns a zeroed SQE, flushing the queue to the kernel if it is full;
+    // nullptr only if the kernel cannot take more work right now
+    struct io_uring_sqe* getSqe() {
+        if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            submit(0);
+            if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                return nullptr;
+            }
+        }
+        unsigned index = local_tail & sq_mask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        local_tail++;
+        return sqe;
+    }
+
+    // Publishes every queued SQE and waits for at least wait_nr completions.
+    // Returns the io_uring_enter result or -errno.
+    int submit(unsigned wait_nr) {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, nullptr, 0);
+        return ret < 0 ? -errno : ret;
+    }
+
+    // Calls fn for every available CQE. Each entry is copied out and the
+    // head advanced first, so fn may queue new SQEs.
+    template <typename Fn>
+    void forEachCompletion(Fn&& fn) {
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = cqes[head & cq_mask];
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            fn(cqe);
+        }
+    }
+
+    void registerFiles(const int* fds, unsigned count) {
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES, fds, count) < 0) {
+            throw std::runtime_error("Failed to register io_uring files");
+        }
+    }
+
+    // Replaces one registered file; -1 drops the ring's reference
+    bool updateFile(unsigned index, int fd) {
+        struct io_uring_files_update update{};
+        update.offset = index;
+        update.fds = reinterpret_cast<uint64_t>(&fd);
+        return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+    }
+
+private:
+    int ring_fd = -1;
+    char* ring_memory = nullptr;
+    size_t ring_bytes = 0;
+    struct io_uring_sqe* sqes = nullptr;
+    size_t sqes_bytes = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned local_tail = 0;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe* cqes = nullptr;
+};
+
+// Kernel-selected receive buffers backing multishot recv: the kernel picks
+// a free buffer per completion and the loop hands it back once the bytes
+// are copied into the connection's receive buffer. Uses PROVIDE_BUFFERS
+// rather than a registered buffer ring, which is not usable on every
+// kernel that accepts its registration.
+class ProvidedBuffers {
+public:
+    // Queues the initial hand-over; it is submitted with the first batch
+    void init(IoUring& uring, uint16_t group, unsigned count, size_t size) {
+        buffer_group = group;
+        buffer_size = size;
+        storage.reset(new char[count * size]);
+        struct io_uring_sqe* sqe = uring.getSqe();
+        if (sqe == nullptr) {
+            throw std::runtime_error("Failed to provide io_uring receive buffers");
+        }
+        prepare(sqe, 0, count);
+    }
+
+    const char* buffer(uint16_t id) const { return storage.get() + static_cast<size_t>(id) * buffer_size; }
+
+    void recycle(IoUring& uring, uint16_t id) {
+        pending.push_back(id);
+        while (!pending.empty()) {
+            struct io_uring_sqe* sqe = uring.getSqe();
+            if (sqe == nullptr) {
+                return; // retried with the next recycle
+            }
+            prepare(sqe, pending.back(), 1);
+            pending.pop_back();
+        }
+    }
+
+    // Completions of the hand-over SQEs carry this user_data
+    static constexpr uint64_t kUserData = 0;
+
+private:
+    void prepare(struct io_uring_sqe* sqe, uint16_t first_id, unsigned count) {
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = static_cast<int>(count);
+        sqe->addr = reinterpret_cast<uint64_t>(buffer(first_id));
+        sqe->len = static_cast<uint32_t>(buffer_size);
+        sqe->off = first_id;
+        sqe->buf_group = buffer_group;
+        sqe->user_data = kUserData;
+    }
+
+    std::unique_ptr<char[]> storage;
+    size_t buffer_size = 0;
+    uint16_t buffer_group = 0;
+    std::vector<uint16_t> pending;
+};
+
+// Metrics counters have a single writer, the owning loop's thread, so an
+// increment is a relaxed load and store rather than a locked RMW; scrapes
+// on other threads only read them
+inline void bump(std::atomic<uint64_t>& counter, uint64_t amount = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// Log-linear latency histogram in nanoseconds, HdrHistogram style: exact
+// below 16 ns, then 16 buckets per power of two (under 6.25% relative
+// error) up to 2^36 ns (about 69 s), where it saturates
+class LatencyHistogram {
+public:
+    static constexpr int kSubBucketBits = 4;
+    static constexpr int kSubBuckets = 1 << kSubBucketBits;
+    static constexpr int kMaxBits = 36;
+    static constexpr size_t kBuckets = kSubBuckets + (kMaxBits - kSubBucketBits) * kSubBuckets;
+
+    void record(std::chrono::steady_clock::duration elapsed) {
+        int64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        uint64_t value = nanos > 0 ? static_cast<uint64_t>(nanos) : 0;
+        bump(buckets[bucketOf(value)]);
+        bump(count);
+        bump(sum, value);
+    }
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < kSubBuckets) {
+            return value;
+        }
+        int bits = 64 - __builtin_clzll(value);
+        if (bits > kMaxBits) {
+            return kBuckets - 1;
+        }
+        int shift = bits - kSubBucketBits - 1;
+        return kSubBuckets + shift * kSubBuckets + ((value >> shift) - kSubBuckets);
+    }
+
+    // Smallest value above every value in the bucket
+    static uint64_t upperBound(size_t bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket + 1;
+        }
+        size_t shift = (bucket - kSubBuckets) / kSubBuckets;
+        uint64_t top = (bucket - kSubBuckets) % kSubBuckets + kSubBuckets;
+        return (top + 1) << shift;
+    }
+
+    std::atomic<uint64_t> buckets[kBuckets] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+};
+
+// One loop's counters. Cache-line aligned so no other thread's writes land
+// on these lines; /metrics sums every loop's copy when scraped.
+struct alignas(64) LoopMetrics {
+    static constexpr int kStatusCodes[] = {200, 206, 301, 304, 400, 403, 404, 405, 408, 416, 431, 500, 503};
+    static constexpr size_t kStatusSlots = std::size(kStatusCodes) + 1; // last one: any other code
+
+    void countStatus(int status) {
+        size_t slot = 0;
+        while (slot < std::size(kStatusCodes) && kStatusCodes[slot] != status) {
+            slot++;
+        }
+        bump(responses[slot]);
+    }
+
+    std::atomic<uint64_t> responses[kStatusSlots] = {};
+    std::atomic<uint64_t> bytes_sent{0};
+    std::atomic<uint64_t> connections_opened{0};
+    std::atomic<uint64_t> connections_closed{0};
+    std::atomic<uint64_t> accept_errors{0};
+    std::atomic<uint64_t> accept_pauses{0};
+    std::atomic<uint64_t> timeouts{0};
+    std::atomic<uint64_t> cache_hits{0};
+    std::atomic<uint64_t> cache_misses{0};
+    std::atomic<uint64_t> open_file_hits{0};
+    std::atomic<uint64_t> bundle_hits{0};
+    std::atomic<uint64_t> snapshot_not_found{0};
+    std::atomic<uint64_t> tls_handshakes{0};
+    std::atomic<uint64_t> tls_resumed{0};
+    std::atomic<uint64_t> tls_handshake_errors{0};
+    std::atomic<uint64_t> ktls_connections{0};
+    std::atomic<uint64_t> http2_connections{0};
+    std::atomic<uint64_t> http2_streams{0};
+    // Parsing a complete request head; handling it up to the queued
+    // response, including any worker hop; from the read that delivered the
+    // request to the write that sent the response's first byte
+    LatencyHistogram parse;
+    LatencyHistogram handle;
+    LatencyHistogram first_byte;
+};
+
+// One response as the access log records it. Fixed size, so a loop's ring
+// is a flat array; request strings longer than their share are truncated.
+struct AccessRecord {
+    static constexpr size_t kPathBytes = 256;
+    static constexpr size_t kTextBytes = 450;
+
+    // Wall clock and time since the request arrived when its last byte was
+    // written, and the handling from parsed head to started response
+    // (worker hop included)
+    int64_t time_ns = 0;
+    uint64_t latency_ns = 0;
+    uint64_t handle_ns = 0;
+    uint64_t bytes = 0;
+    // IPv4 address, network byte order
+    uint32_t peer = 0;
+    uint16_t status = 0;
+    // 10, 11 or 20; 0 when the request head could not be parsed
+    uint8_t version = 0;
+    uint8_t method_length = 0;
+    uint16_t path_length = 0;
+    uint16_t referer_length = 0;
+    uint16_t agent_length = 0;
+    char method[16];
+    // Path, referer and user agent, back to back
+    char text[kTextBytes];
+
+    void setRequest(std::string_view method_text, std::string_view path, std::string_view referer,
+                    std::string_view agent) {
+        method_length = static_cast<uint8_t>(std::min(method_text.size(), sizeof(method)));
+        memcpy(method, method_text.data(), method_length);
+        path_length = static_cast<uint16_t>(std::min(path.size(), kPathBytes));
+        referer_length = static_cast<uint16_t>(std::min(referer.size(), (kTextBytes - path_length) / 2));
+        agent_length = static_cast<uint16_t>(std::min(agent.size(), kTextBytes - path_length - referer_length));
+        memcpy(text, path.data(), path_length);
+        memcpy(text + path_length, referer.data(), referer_length);
+        memcpy(text + path_length + referer_length, agent.data(), agent_length);
+    }
+
+    std::string_view methodText() const { return {method, method_length}; }
+    std::string_view path() const { return {text, path_length}; }
+    std::string_view referer() const { return {text + path_length, referer_length}; }
+    std::string_view agent() const { return {text + path_length + referer_length, agent_length}; }
+};
+
+static_assert(sizeof(AccessRecord) == 512, "AccessRecord layout");
+
+// Single-producer, single-consumer ring of access records: a loop fills
+// and publishes slots, the log writer drains them. The two indexes sit on
+// separate cache lines and the producer caches the consumer's, so it reads
+// the writer's line only when the ring looks full. A full ring drops the
+// record and counts it; the loop never waits.
+class AccessLogRing {
+public:
+    static constexpr size_t kRecords = 4096;
+
+    explicit AccessLogRing(double sample_rate) : records(new AccessRecord[kRecords]), sample_rate(sample_rate) {}
+
+    // Producer: whether to log a response; errors always are
+    bool sample(int status) {
+        if (status >= 400 || sample_rate >= 1) {
+            return true;
+        }
+        sample_credit += sample_rate;
+        if (sample_credit < 1) {
+            return false;
+        }
+        sample_credit -= 1;
+        return true;
+    }
+
+    // Producer: the slot to fill before publish(), or nullptr when full
+    AccessRecord* claim() {
+        uint64_t next = write_index.load(std::memory_order_relaxed);
+        if (next - cached_read_index >= kRecords) {
+            cached_read_index = read_index.load(std::memory_order_acquire);
+            if (next - cached_read_index >= kRecords) {
+                bump(dropped);
+                return nullptr;
+            }
+        }
+        return &records[next % kRecords];
+    }
+
+    void publish() {
+        write_index.store(write_index.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: visit(record) for every published record, oldest first
+    template <typename Visit>
+    size_t drain(Visit&& visit) {
+        uint64_t next = read_index.load(std::memory_order_relaxed);
+        uint64_t end = write_index.load(std::memory_order_acquire);
+        for (uint64_t i = next; i != end; i++) {
+            visit(records[i % kRecords]);
+        }
+        read_index.store(end, std::memory_order_release);
+        return end - next;
+    }
+
+    uint64_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    std::unique_ptr<AccessRecord[]> records;
+    // Producer's line
+    alignas(64) std::atomic<uint64_t> write_index{0};
+    uint64_t cached_read_index = 0;
+    double sample_rate;
+    double sample_credit = 0;
+    std::atomic<uint64_t> dropped{0};
+    // Consumer's line
+    alignas(64) std::atomic<uint64_t> read_index{0};
+};
+
+// Formats the loops' records on its own thread and appends each batch to
+// the log with one write(). reopen() (SIGHUP) opens the path again, so
+// logrotate can move the old file away; "-" logs to standard output.
+class AccessLog {
+public:
+    AccessLog(std::string path, AccessLogFormat format) : path(std::move(path)), format(format) {
+        fd = openLog();
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open access log " + this->path + ": " + strerror(errno));
+        }
+    }
+
+    ~AccessLog() {
+        stop();
+        if (fd > STDERR_FILENO) {
+            close(fd);
+        }
+    }
+
+    void start(std::vector<AccessLogRing*> sources) {
+        rings = std::move(sources);
+        writer = std::thread(&AccessLog::run, this);
+    }
+
+    // Writes what the rings still hold and stops the writer
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        if (writer.joinable()) {
+            writer.join();
+        }
+    }
+
+    void reopen() { reopen_requested.store(true, std::memory_order_relaxed); }
+
+    uint64_t writtenCount() const { return written.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr auto kFlushInterval = std::chrono::milliseconds(20);
+
+    std::string path;
+    AccessLogFormat format;
+    int fd = -1;
+    std::vector<AccessLogRing*> rings;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::atomic<bool> reopen_requested{false};
+    std::atomic<uint64_t> written{0};
+    // Formatted timestamp of the second the last record fell in
+    int64_t formatted_second = -1;
+    char formatted_time[32];
+    size_t formatted_length = 0;
+
+    int openLog() const {
+        if (path == "-") {
+            return STDOUT_FILENO;
+        }
+        return open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+
+    void run() {
+        std::string batch;
+        bool last = false;
+        bool busy = false;
+        while (!last) {
+            // A ring that was a quarter full is drained again at once
+            if (!busy) {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeup.wait_for(lock, kFlushInterval, [this] { return stopping; });
+                last = stopping;
+            } else {
+                std::lock_guard<std::mutex> lock(mutex);
+                last = stopping;
+            }
+            if (reopen_requested.exchange(false, std::memory_order_relaxed) && path != "-") {
+                int reopened = openLog();
+                if (reopened < 0) {
+                    std::cerr << "Failed to reopen access log " << path << ": " << strerror(errno) << std::endl;
+                } else {
+                    close(fd);
+                    fd = reopened;
+                }
+            }
+            uint64_t count = 0;
+            busy = false;
+            for (AccessLogRing* ring : rings) {
+                size_t drained = ring->drain([&](const AccessRecord& record) { appendRecord(record, batch); });
+                busy = busy || drained >= AccessLogRing::kRecords / 4;
+                count += drained;
+            }
+            if (batch.empty()) {
+                continue;
+            }
+            size_t offset = 0;
+            while (offset < batch.size()) {
+                ssize_t n = write(fd, batch.data() + offset, batch.size() - offset);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    std::cerr << "Failed to write access log " << path << ": " << strerror(errno) << std::endl;
+                    break;
+                }
+                offset += n;
+            }
+            written.store(written.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+            batch.clear();
+        }
+    }
+
+    static void appendNumber(std::string& out, uint64_t value) {
+        char buffer[24];
+        out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer);
+    }
+
+    static void appendSeconds(std::string& out, uint64_t nanos) {
+        char buffer[32];
+        int length = snprintf(buffer, sizeof(buffer), "%.6f", nanos / 1e9);
+        out.append(buffer, length);
+    }
+
+    static void appendAddress(std::string& out, uint32_t peer) {
+        char buffer[INET_ADDRSTRLEN];
+        out += inet_ntop(AF_INET, &peer, buffer, sizeof(buffer)) ? buffer : "-";
+    }
+
+    static std::string_view protocol(const AccessRecord& record) {
+        switch (record.version) {
+        case 10:
+            return "HTTP/1.0";
+        case 11:
+            return "HTTP/1.1";
+        case 20:
+            return "HTTP/2.0";
+        default:
+            return "-";
+        }
+    }
+
+    // "[10/Oct/2000:13:55:36 +0000]" or "2000-10-10T13:55:36", formatted
+    // once per second
+    std::string_view timestamp(int64_t time_ns) {
+        int64_t second = time_ns / 1000000000;
+        if (second != formatted_second) {
+            time_t t = static_cast<time_t>(second);
+            struct tm tm;
+            gmtime_r(&t, &tm);
+            const char* pattern = format == AccessLogFormat::Json ? "%Y-%m-%dT%H:%M:%S" : "[%d/%b/%Y:%H:%M:%S +0000]";
+            formatted_length = strftime(formatted_time, sizeof(formatted_time), pattern, &tm);
+            formatted_second = second;
+        }
+        return {formatted_time, formatted_length};
+    }
+
+    // Quotes and backslashes escaped, other bytes outside printable ASCII
+    // as \xHH, as nginx does; JSON takes \u00HH
+    void appendEscaped(std::string& out, std::string_view text) const {
+        static constexpr char kHex[] = "0123456789abcdef";
+        for (unsigned char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
+            } else if (c < 0x20 || c >= 0x7f) {
+                out += format == AccessLogFormat::Json ? "\\u00" : "\\x";
+                out += kHex[c >> 4];
+                out += kHex[c & 15];
+            } else {
+                out += static_cast<char>(c);
+            }
+        }
+    }
+
+    void appendRecord(const AccessRecord& record, std::string& out) {
+        if (format == AccessLogFormat::Json) {
+            out += "{\"time\":\"";
+            out += timestamp(record.time_ns);
+            char millis[8];
+            snprintf(millis, sizeof(millis), ".%03dZ", static_cast<int>(record.time_ns / 1000000 % 1000));
+            out += millis;
+            out += "\",\"remote\":\"";
+            appendAddress(out, record.peer);
+            out += "\",\"method\":\"";
+            appendEscaped(out, record.methodText());
+            out += "\",\"path\":\"";
+            appendEscaped(out, record.path());
+            out += "\",\"protocol\":\"";
+            out += protocol(record);
+            out += "\",\"status\":";
+            appendNumber(out, record.status);
+            out += ",\"bytes\":";
+            appendNumber(out, record.bytes);
+            out += ",\"latency\":";
+            appendSeconds(out, record.latency_ns);
+            out += ",\"handle\":";
+            appendSeconds(out, record.handle_ns);
+            out += ",\"referer\":\"";
+            appendEscaped(out, record.referer());
+            out += "\",\"user_agent\":\"";
+            appendEscaped(out, record.agent());
+            out += "\"}\n";
+            return;
+        }
+
+        // Combined Log Format, then latency and handling time in seconds
+        appendAddress(out, record.peer);
+        out += " - - ";
+        out += timestamp(record.time_ns);
+        out += " \"";
+        if (record.version == 0) {
+            out += '-';
+        } else {
+            appendEscaped(out, record.methodText());
+            out += ' ';
+            appendEscaped(out, record.path());
+            out += ' ';
+            out += protocol(record);
+        }
+        out += "\" ";
+        appendNumber(out, record.status);
+        out += ' ';
+        appendNumber(out, record.bytes);
+        out += " \"";
+        if (record.referer_length == 0) {
+            out += '-';
+        }
+        appendEscaped(out, record.referer());
+        out += "\" \"";
+        if (record.agent_length == 0) {
+            out += '-';
+        }
+        appendEscaped(out, record.agent());
+        out += "\" ";
+        appendSeconds(out, record.latency_ns);
+        out += ' ';
+        appendSeconds(out, record.handle_ns);
+        out += '\n';
+    }
+};
+
+// Stages of a request a trace records. Read and write cover the system
+// calls (with io_uring, handing bytes to and from the ring); handle covers
+// routing and answering the request, with resolve (path and snapshot),
+// lookup (caches), load (open and read, on a worker when there are
+// workers) and route (an application handler or continuation) inside it.
+// Request runs from the read that completed a request to the write of its
+// first response byte.
+enum TraceStage : uint8_t {
+    TraceAccept,
+    TraceRead,
+    TraceParse,
+    TraceHandle,
+    TraceResolve,
+    TraceLookup,
+    TraceLoad,
+    TraceRoute,
+    TraceWrite,
+    TraceRequest,
+    kTraceStages
+};
+
+constexpr const char* kTraceStageNames[kTraceStages] = {"accept", "read",  "parse", "handle", "resolve",
+                                                        "lookup", "load",  "route", "write",  "request"};
+
+struct TraceEvent {
+    int64_t start_ns;
+    int64_t end_ns;
+    uint64_t connection;
+    // Bytes moved by a read or write
+    uint64_t bytes;
+    // Thread the stage ran on (a worker's for loads)
+    int32_t thread;
+    TraceStage stage;
+};
+
+// Flight recorder of one event loop (--trace): its latest stage spans,
+// overwriting the oldest. Only the loop's thread records into it or copies
+// it out, so neither takes a lock; spans that ran on workers are recorded
+// when their results come back. Times are steady_clock, the clock of the
+// timestamps the loop already takes for its latency metrics.
+class TraceBuffer {
+public:
+    explicit TraceBuffer(size_t capacity) : events(std::max<size_t>(capacity, 1)) {}
+
+    static int64_t now() { return nanos(std::chrono::steady_clock::now()); }
+
+    static int64_t nanos(std::chrono::steady_clock::time_point time) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+
+    void record(TraceStage stage, uint64_t connection, int64_t start_ns, int64_t end_ns, uint64_t bytes = 0,
+                int32_t thread = 0) {
+        HTTP_TRACE_PROBE(stage, connection, start_ns, end_ns);
+        events[next] = {start_ns, end_ns, connection, bytes, thread != 0 ? thread : loop_thread, stage};
+        next = next + 1 == events.size() ? 0 : next + 1;
+        count = std::min(count + 1, events.size());
+    }
+
+    // Oldest first
+    void copyTo(std::vector<TraceEvent>& out) const {
+        out.reserve(out.size() + count);
+        size_t first = count < events.size() ? 0 : next;
+        for (size_t i = 0; i < count; i++) {
+            out.push_back(events[(first + i) % events.size()]);
+        }
+    }
+
+    int32_t thread() const { return loop_thread; }
+
+private:
+    std::vector<TraceEvent> events;
+    size_t next = 0;
+    size_t count = 0;
+    // Kernel thread id of the loop; the recorder is created on it
+    int32_t loop_thread = static_cast<int32_t>(syscall(SYS_gettid));
+};
+
+// Records a stage from construction to finish() or destruction, with the
+// growth of counter as its bytes; does nothing without a buffer, so a
+// build with tracing off pays one test per stage
+class TraceSpan {
+public:
+    TraceSpan(TraceBuffer* buffer, TraceStage stage, uint64_t connection, const uint64_t* counter = nullptr)
+        : buffer(buffer), counter(counter), connection(connection), stage(stage) {
+        if (buffer != nullptr) {
+            start_ns = TraceBuffer::now();
+            baseline = counter != nullptr ? *counter : 0;
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    ~TraceSpan() { finish(); }
+
+    void finish() {
+        if (buffer != nullptr) {
+            buffer->record(stage, connection, start_ns, TraceBuffer::now(), counter != nullptr ? *counter - baseline : 0);
+            buffer = nullptr;
+        }
+    }
+
+private:
+    TraceBuffer* buffer;
+    const uint64_t* counter;
+    uint64_t connection;
+    int64_t start_ns = 0;
+    uint64_t baseline = 0;
+    TraceStage stage;
+};
+
+// Chrome trace event JSON (chrome://tracing, ui.perfetto.dev) of the
+// recorders' events, each list with the loop thread it came from. Stages
+// are complete events on the thread that ran them, so nested ones stack
+// into a flame chart; requests, which overlap on a loop, are async events
+// with a track each.
+inline std::string formatChromeTrace(const std::vector<std::pair<int32_t, std::vector<TraceEvent>>>& threads) {
+    std::string out;
+    char buffer[32];
+    auto number = [&](int64_t value) { out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer); };
+    // Microseconds with the nanoseconds as decimals
+    auto micros = [&](int64_t ns) {
+        number(ns / 1000);
+        out += '.';
+        int fraction = static_cast<int>(ns % 1000);
+        out += static_cast<char>('0' + fraction / 100);
+        out += static_cast<char>('0' + fraction / 10 % 10);
+        out += static_cast<char>('0' + fraction % 10);
+    };
+    std::string pid = std::to_string(getpid());
+    bool first = true;
+    auto open = [&](const char* name, const char* phase, int32_t thread) {
+        out += first ? "\n{\"name\":\"" : ",\n{\"name\":\"";
+        first = false;
+        out += name;
+        out += "\",\"ph\":\"";
+        out += phase;
+        out += "\",\"pid\":";
+        out += pid;
+        out += ",\"tid\":";
+        number(thread);
+    };
+
+    out = "{\"traceEvents\":[";
+    std::vector<int32_t> workers;
+    int64_t request_id = 0;
+    for (size_t i = 0; i < threads.size(); i++) {
+        open("thread_name", "M", threads[i].first);
+        out += ",\"args\":{\"name\":\"loop ";
+        number(static_cast<int64_t>(i));
+        out += "\"}}";
+        for (const TraceEvent& event : threads[i].second) {
+            if (event.thread != threads[i].first &&
+                std::find(workers.begin(), workers.end(), event.thread) == workers.end()) {
+                workers.push_back(event.thread);
+            }
+            if (event.stage == TraceRequest) {
+                request_id++;
+                for (const char* phase : {"b", "e"}) {
+                    open(kTraceStageNames[event.stage], phase, event.thread);
+                    out += ",\"cat\":\"request\",\"id\":";
+                    number(request_id);
+                    out += ",\"ts\":";
+                    micros(phase[0] == 'b' ? event.start_ns : event.end_ns);
+                    out += ",\"args\":{\"connection\":";
+                    number(static_cast<int64_t>(event.connection));
+                    out += "}}";
+                }
+                continue;
+            }
+            open(kTraceStageNames[event.stage], "X", event.thread);
+            out += ",\"cat\":\"stage\",\"ts\":";
+            micros(event.start_ns);
+            out += ",\"dur\":";
+            micros(std::max<int64_t>(event.end_ns - event.start_ns, 0));
+            out += ",\"args\":{\"connection\":";
+            number(static_cast<int64_t>(event.connection));
+            if (event.bytes != 0) {
+                out += ",\"bytes\":";
+                number(static_cast<int64_t>(event.bytes));
+            }
+            out += "}}";
+        }
+    }
+    for (int32_t worker : workers) {
+        open("thread_name", "M", worker);
+        out += ",\"args\":{\"name\":\"worker\"}}";
+    }
+    out += "\n],\"displayTimeUnit\":\"ns\"}\n";
+    return out;
+}
+
+// Hierarchical timing wheel (Varghese & Lauck), one per loop. Four levels
+// of 64 slots; level L holds timers due within 64^(L+1) ticks, and a slot
+// of a higher level is pushed down a level when the one below wraps, so
+// scheduling and cancelling are O(1) and a tick costs its due timers plus
+// the occasional cascade. Nodes are intrusive, one per connection.
+class TimerWheel {
+public:
+    struct Node {
+        Node* prev = nullptr;
+        Node* next = nullptr;
+        uint64_t expiry = 0;
+        void* owner = nullptr;
+
+        bool linked() const { return prev != nullptr; }
+    };
+
+    static constexpr int kLevels = 4;
+    static constexpr int kSlotBits = 6;
+    static constexpr uint64_t kSlots = 1 << kSlotBits;
+
+    explicit TimerWheel(uint64_t now = 0) : current(now) {
+        for (auto& level : slots) {
+            for (Node& head : level) {
+                head.prev = head.next = &head;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    uint64_t now() const { return current; }
+    size_t size() const { return count; }
+
+    // Expiries not after the current tick fire on the next one
+    void schedule(Node& node, uint64_t expiry) {
+        if (node.linked()) {
+            if (node.expiry == expiry) {
+                return;
+            }
+            cancel(node);
+        }
+        node.expiry = std::max(expiry, current + 1);
+        uint64_t delta = node.expiry - current;
+        int level = 0;
+        while (level < kLevels - 1 && delta >= (kSlots << (kSlotBits * level))) {
+            level++;
+        }
+        // Beyond the top level's reach the timer is parked in its furthest
+        // slot and re-placed when that slot cascades
+        uint64_t slot_tick = std::min(node.expiry, current + (kSlots << (kSlotBits * level)) - 1);
+        link(slots[level][(slot_tick >> (kSlotBits * level)) & (kSlots - 1)], node);
+        count++;
+    }
+
+    void cancel(Node& node) {
+        if (!node.linked()) {
+            return;
+        }
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+        count--;
+    }
+
+    // Runs every tick up to now, calling expire(node) for each due timer
+    // after unlinking it; expire may schedule or cancel any timer
+    template <typename Fn>
+    void advance(uint64_t now, Fn&& expire) {
+        if (count == 0) {
+            current = std::max(current, now);
+            return;
+        }
+        while (current < now) {
+            current++;
+            for (int level = kLevels - 1; level > 0; level--) {
+                if ((current & ((uint64_t(1) << (kSlotBits * level)) - 1)) == 0) {
+                    cascade(slots[level][(current >> (kSlotBits * level)) & (kSlots - 1)]);
+                }
+            }
+            Node pending;
+            take(slots[0][current & (kSlots - 1)], pending);
+            while (pending.next != &pending) {
+                Node& node = *pending.next;
+                cancel(node);
+                if (node.expiry > current) {
+                    schedule(node, node.expiry);
+                } else {
+                    expire(node);
+                }
+            }
+        }
+    }
+
+private:
+    Node slots[kLevels][kSlots];
+    uint64_t current;
+    size_t count = 0;
+
+    static void link(Node& head, Node& node) {
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    // Moves a slot's list onto an empty local head, so that expiring its
+    // timers may re-schedule into the same slot without being revisited
+    static void take(Node& head, Node& into) {
+        into.prev = into.next = &into;
+        if (head.next == &head) {
+            return;
+        }
+        into.next = head.next;
+        into.prev = head.prev;
+        into.next->prev = &into;
+        into.prev->next = &into;
+        head.prev = head.next = &head;
+    }
+
+    void cascade(Node& head) {
+        Node pending;
+        take(head, pending);
+        while (pending.next != &pending) {
+            Node& node = *pending.next;
+            cancel(node);
+            schedule(node, node.expiry);
+        }
+    }
+};
+
+// Per-connection state machine driven by the event loop
+enum class ConnectionState {
+    // TLS handshake in progress; Reading follows
+    Handshaking,
+    Reading,
+    Writing,
+    // Write side shut down after an error; unread input is drained so the
+    // close does not turn into a reset that destroys the response
+    Lingering,
+    Closing
+};
+
+// Descriptor behind the file segments of several HTTP/2 DATA frames,
+// closed with the last of them
+struct SharedFile {
+    int fd;
+
+    explicit SharedFile(int fd) : fd(fd) {}
+    SharedFile(const SharedFile&) = delete;
+    SharedFile& operator=(const SharedFile&) = delete;
+    ~SharedFile() { close(fd); }
+};
+
+// One queued piece of a response: bytes owned by the connection, bytes
+// shared with the file cache, or a file range sent zero-copy with sendfile()
+struct OutputSegment {
+    // Memory segments: arena bytes owned by the connection, or bytes kept
+    // alive by shared (a file cache entry or a mapped bundle)
+    const char* data = nullptr;
+    size_t length = 0;
+    std::shared_ptr<const void> shared;
+    size_t data_offset = 0;
+    int file_fd = -1;
+    off_t file_offset = 0;
+    size_t file_remaining = 0;
+    // Set when file_fd is shared rather than owned by the segment
+    std::shared_ptr<const SharedFile> file_owner;
+    bool sendfile_unsupported = false;
+    // Referenced by an io_uring send that has not completed; must not change
+    bool in_flight = false;
+
+    bool isFile() const { return file_fd >= 0; }
+    bool owned() const { return !isFile() && !shared; }
+    const char* bytes() const { return data; }
+    size_t size() const { return length; }
+};
+
+// Most segments gathered into one sendmsg(); a full processRequests() batch
+constexpr int kMaxOutputIov = 64;
+
+// Shared segments at least this large are sent with MSG_ZEROCOPY when the
+// socket allows it; below that the notification costs more than the copy
+constexpr size_t kZeroCopyMinBytes = 32 * 1024;
+
+// FIFO of output segments in a power-of-two ring that only ever grows, so
+// queueing and popping segments stops allocating once it has warmed up
+class SegmentQueue {
+public:
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    OutputSegment& front() { return slots[head]; }
+    OutputSegment& back() { return (*this)[count - 1]; }
+    OutputSegment& operator[](size_t index) { return slots[(head + index) & (slots.size() - 1)]; }
+    const OutputSegment& operator[](size_t index) const { return slots[(head + index) & (slots.size() - 1)]; }
+
+    void push_back(OutputSegment segment) {
+        if (count == slots.size()) {
+            grow();
+        }
+        count++;
+        back() = std::move(segment);
+    }
+
+    void pop_front() {
+        // Drop the reference held on shared bytes now, not when the slot is reused
+        slots[head] = OutputSegment();
+        head = (head + 1) & (slots.size() - 1);
+        count--;
+    }
+
+private:
+    void grow() {
+        std::vector<OutputSegment> larger(std::max<size_t>(8, slots.size() * 2));
+        for (size_t i = 0; i < count; i++) {
+            larger[i] = std::move((*this)[i]);
+        }
+        slots.swap(larger);
+        head = 0;
+    }
+
+    std::vector<OutputSegment> slots;
+    size_t head = 0;
+    size_t count = 0;
+};
+
+struct Connection;
+
+// One HTTP/2 stream. Its handler writes an HTTP/1.1-format response into
+// responder, a Connection of its own that is never on a socket; the
+// response head becomes a HEADERS frame and the body is cut into DATA
+// frames as flow control and priority allow.
+struct Http2Stream {
+    uint32_t id = 0;
+    std::unique_ptr<Connection> responder;
+    // The request rendered as an HTTP/1.1 head, which responder's parser
+    // points into
+    std::string request;
+    // Status line and header lines of the response once it is ready
+    std::string response_head;
+    int64_t send_window = kHttp2DefaultWindow;
+    // RFC 9218 priority: lower urgency goes first; incremental responses
+    // of one urgency share the connection, the others go one at a time
+    uint8_t urgency = 3;
+    bool incremental = false;
+    // The client's END_STREAM has arrived
+    bool remote_closed = false;
+    bool response_ready = false;
+    bool headers_sent = false;
+    // In the session's ready list for its urgency
+    bool scheduled = false;
+};
+
+struct Http2Session {
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    std::unordered_map<uint32_t, std::unique_ptr<Http2Stream>> streams;
+    // Streams with response frames to send, by urgency. Entries of streams
+    // that closed or moved to another urgency are skipped when reached.
+    std::deque<uint32_t> ready[8];
+    bool preface_received = false;
+    bool settings_received = false;
+    // Header block being reassembled from HEADERS and CONTINUATION frames
+    uint32_t header_stream = 0;
+    bool header_end_stream = false;
+    std::string header_block;
+    // Highest stream opened; a GOAWAY promises to answer up to it
+    uint32_t last_stream_id = 0;
+    // Connection send window and the peer's SETTINGS_INITIAL_WINDOW_SIZE
+    int64_t send_window = kHttp2DefaultWindow;
+    int64_t initial_window = kHttp2DefaultWindow;
+    // DATA received since the last connection WINDOW_UPDATE
+    size_t unacknowledged_bytes = 0;
+    bool goaway_sent = false;
+    // A connection error was sent; nothing else is
+    bool failed = false;
+    // Scratch space reused by every header block; fields is empty when the
+    // block decoded to more than SETTINGS_MAX_HEADER_LIST_SIZE
+    std::vector<HpackField> fields;
+    bool fields_oversized = false;
+    std::string scratch;
+    std::string name;
+};
+
+struct Connection {
+    int fd;
+    uint64_t id = 0;
+    ConnectionState state = ConnectionState::Reading;
+    ReceiveBuffer input;
+    RequestParser parser;
+    BodyDecoder body;
+    SegmentQueue output;
+    // Backs the owned output segments; reset whenever output drains
+    Arena arena;
+    size_t output_memory = 0;
+    bool readable = false;
+    bool peer_closed = false;
+    bool close_after_write = false;
+    bool linger_on_close = false;
+    // A worker is producing the current response; later pipelined requests wait
+    bool awaiting_worker = false;
+    // The response a route handler is producing: its number on this
+    // connection, which ResponseWriter handles must name, the status and
+    // header lines until the head is queued, and the defer() continuations
+    // still to run. While response_open the bytes queued so far are not
+    // the whole response, so neither the end of an HTTP/2 stream nor the
+    // access log line goes out.
+    struct RouteState {
+        uint64_t id = 0;
+        int status = 200;
+        std::string headers;
+        int pending = 0;
+        bool head_sent = false;
+        // HTTP/1.1 request: a body written piecemeal is chunked
+        bool chunkable = false;
+        bool chunked = false;
+        // Failed after the head went out; an HTTP/2 stream is reset
+        bool aborted = false;
+        // The onDrain() continuation, posted once the queue runs low
+        std::function<void()> drained;
+    } route;
+    uint64_t route_sequence = 0;
+    bool response_open = false;
+    int requests_served = 0;
+    // The one deadline the connection is waiting on, and the fixed ones
+    // behind it (wheel ticks; 0 when unset): the whole next request head
+    // must arrive by head_deadline, a lingering close ends by
+    // linger_deadline; a blocked response must make progress by
+    // write_deadline, armed when bytes_written was write_deadline_written
+    TimerWheel::Node timer;
+    uint64_t head_deadline = 0;
+    uint64_t linger_deadline = 0;
+    uint64_t write_deadline = 0;
+    uint64_t write_deadline_written = 0;
+    // The owning loop's counters
+    LoopMetrics* metrics = nullptr;
+    // Last read that returned bytes, and that time as of the request being
+    // handled and when its handling started
+    std::chrono::steady_clock::time_point received_at;
+    std::chrono::steady_clock::time_point request_received_at;
+    std::chrono::steady_clock::time_point handle_started_at;
+    // Bytes ever queued and written on this connection (by a responder,
+    // handed to its HTTP/2 connection), and where in that stream each
+    // response whose first byte is still unsent begins.
+    // Responses beyond the ring's capacity go unmeasured.
+    uint64_t bytes_queued = 0;
+    uint64_t bytes_written = 0;
+    struct PendingResponse {
+        uint64_t offset;
+        std::chrono::steady_clock::time_point received_at;
+    };
+    static constexpr size_t kPendingResponses = 64;
+    PendingResponse pending_responses[kPendingResponses];
+    size_t pending_head = 0;
+    size_t pending_count = 0;
+    // Access logging: the owning loop's ring, or nullptr; the peer; the
+    // request being answered (copied, as a worker's response outlives the
+    // parser's view); and the sampled responses not yet completely written,
+    // each from the stream offsets where it and its body begin. The last
+    // one's body offset is set when its head is complete, while
+    // log_head_open.
+    AccessLogRing* access_log = nullptr;
+    uint32_t peer_address = 0;
+    std::unique_ptr<AccessRecord> log_request;
+    bool log_request_valid = false;
+    bool log_head_open = false;
+    struct LoggedResponse {
+        uint64_t offset;
+        uint64_t body_offset;
+        std::chrono::steady_clock::time_point received_at;
+        AccessRecord record;
+    };
+    std::vector<LoggedResponse> logged_responses;
+    // The owning loop's trace recorder, if tracing
+    TraceBuffer* trace = nullptr;
+    // SO_ZEROCOPY is enabled and the kernel has not reported copying anyway
+    bool zerocopy = false;
+    bool corked = false;
+    // TLS session, nullptr on plain TCP. With kernel TLS on the send side
+    // the socket encrypts whatever is written to it, so the plain writev
+    // and sendfile paths apply; otherwise output goes through SSL_write.
+    struct ssl_st* tls = nullptr;
+    bool ktls_send = false;
+    // close_notify was sent, or the session failed and must not send one
+    bool tls_finished = false;
+    // HTTP/2 connections: the framing and streams; a stream's responder
+    // has stream_id set instead
+    std::unique_ptr<Http2Session> http2;
+    uint32_t stream_id = 0;
+
+    // MSG_ZEROCOPY sends the kernel may still read from: each send's
+    // sequence number and the shared bytes it keeps alive until the
+    // completion arrives on the socket's error queue
+    struct ZeroCopyHold {
+        uint32_t sequence;
+        std::shared_ptr<const void> bytes;
+    };
+    std::vector<ZeroCopyHold> zerocopy_holds;
+    uint32_t zerocopy_sequence = 0;
+
+    // io_uring backend only: received bytes that did not fit the receive
+    // buffer yet, the message of the send in flight, and the count of
+    // operations that still reference this object after it is closed
+    struct UringState {
+        std::string stash;
+        struct msghdr msg{};
+        struct iovec iov[kMaxOutputIov];
+        int inflight = 0;
+        bool recv_armed = false;
+        bool send_inflight = false;
+        bool poll_inflight = false;
+        bool closed = false;
+    } uring;
+
+    Connection(int fd, size_t max_header_bytes, BufferPool& pool)
+        : fd(fd), parser(max_header_bytes), arena(pool) {
+        timer.owner = this;
+    }
+
+    ~Connection() {
+        clearOutput();
+#ifdef HTTP_HAVE_TLS
+        SSL_free(tls);
+#endif
+    }
+
+    // Prepares a closed connection for reuse on a new socket; input and
+    // output must already be released
+    void reset(int new_fd) {
+        fd = new_fd;
+        id = 0;
+        state = ConnectionState::Reading;
+        parser.reset();
+        body = BodyDecoder();
+        readable = false;
+        peer_closed = false;
+        close_after_write = false;
+        linger_on_close = false;
+        awaiting_worker = false;
+        route.pending = 0;
+        route.drained = nullptr;
+        response_open = false;
+        requests_served = 0;
+        head_deadline = 0;
+        linger_deadline = 0;
+        write_deadline = 0;
+        write_deadline_written = 0;
+        bytes_queued = 0;
+        bytes_written = 0;
+        pending_head = 0;
+        pending_count = 0;
+        access_log = nullptr;
+        peer_address = 0;
+        log_request_valid = false;
+        log_head_open = false;
+        logged_responses.clear();
+        trace = nullptr;
+        zerocopy = false;
+        corked = false;
+        ktls_send = false;
+        tls_finished = false;
+        http2.reset();
+        stream_id = 0;
+        zerocopy_holds.clear();
+        zerocopy_sequence = 0;
+        uring.stash.clear();
+        uring.inflight = 0;
+        uring.recv_armed = false;
+        uring.send_inflight = false;
+        uring.poll_inflight = false;
+        uring.closed = false;
+    }
+
+    // Copy bytes into the arena. Consecutive copies are contiguous there,
+    // so headers of pipelined responses coalesce into one segment.
+    void queueData(std::string_view bytes) {
+        if (bytes.empty()) {
+            return;
+        }
+        char* copy = arena.allocate(bytes.size());
+        std::memcpy(copy, bytes.data(), bytes.size());
+        output_memory += bytes.size();
+        bytes_queued += bytes.size();
+        if (!output.empty()) {
+            OutputSegment& last = output.back();
+            if (last.owned() && !last.in_flight && last.data + last.length == copy) {
+                last.length += bytes.size();
+                return;
+            }
+        }
+        OutputSegment segment;
+        segment.data = copy;
+        segment.length = bytes.size();
+        output.push_back(std::move(segment));
+    }
+
+    // Queue bytes owned by someone else (the file cache) without copying
+    void queueShared(std::shared_ptr<const std::string> bytes) {
+        size_t length = bytes->size();
+        queueShared(std::move(bytes), 0, length);
+    }
+
+    void queueShared(std::shared_ptr<const std::string> bytes, size_t offset, size_t length) {
+        const char* data = bytes->data() + offset;
+        queueShared(std::move(bytes), data, length);
+    }
+
+    // data stays valid for as long as owner is alive
+    void queueShared(std::shared_ptr<const void> owner, const char* data, size_t length) {
+        OutputSegment segment;
+        segment.data = data;
+        segment.length = length;
+        segment.shared = std::move(owner);
+        output.push_back(std::move(segment));
+        bytes_queued += length;
+    }
+
+    // Takes ownership of file_fd
+    void queueFile(int file_fd, off_t offset, size_t length) {
+        OutputSegment segment;
+        segment.file_fd = file_fd;
+        segment.file_offset = offset;
+        segment.file_remaining = length;
+        output.push_back(std::move(segment));
+        bytes_queued += length;
+    }
+
+    void queueSharedFile(std::shared_ptr<const SharedFile> file, off_t offset, size_t length) {
+        OutputSegment segment;
+        segment.file_fd = file->fd;
+        segment.file_offset = offset;
+        segment.file_remaining = length;
+        segment.file_owner = std::move(file);
+        output.push_back(std::move(segment));
+        bytes_queued += length;
+    }
+
+    // Called when a request head has been parsed, if access logging
+    void beginLog(const RequestParser& request) {
+        if (!log_request) {
+            log_request = std::make_unique<AccessRecord>();
+        }
+        std::string_view version = request.version();
+        log_request->version = stream_id != 0 ? 20 : version == "HTTP/1.0" ? 10 : 11;
+        log_request->setRequest(request.method(), request.target(), request.header("Referer"),
+                                request.header("User-Agent"));
+        log_request_valid = true;
+    }
+
+    // Called before a response's first byte is queued
+    void startResponse(int status) {
+        metrics->countStatus(status);
+        if (pending_count < kPendingResponses) {
+            pending_responses[(pending_head + pending_count++) % kPendingResponses] = {bytes_queued,
+                                                                                       request_received_at};
+        }
+        if (access_log != nullptr) {
+            log_head_open = false;
+            logResponse(status);
+        }
+    }
+
+    // The head of the response last started is queued; what follows is
+    // its body
+    void headQueued() {
+        if (log_head_open) {
+            logged_responses.back().body_offset = bytes_queued;
+            log_head_open = false;
+        }
+    }
+
+    // A response is queued whole, or streamed with nothing queued after it,
+    // so one ends where the next begins, or at bytes_queued for the last
+    // once it has ended. A responder
+    // hands its bytes to the HTTP/2 connection, so its responses are logged
+    // when it is released. The first forced ones are logged regardless.
+    void flushLog(size_t forced = 0) {
+        auto endOf = [this](size_t i) {
+            return i + 1 < logged_responses.size() ? logged_responses[i + 1].offset : bytes_queued;
+        };
+        if (logged_responses.empty() || (forced == 0 && bytes_written < endOf(0))) {
+            return;
+        }
+        size_t done = 0;
+        auto now = std::chrono::steady_clock::now();
+        struct timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        while (done < logged_responses.size()) {
+            LoggedResponse& response = logged_responses[done];
+            uint64_t end = endOf(done);
+            if (done >= forced && (bytes_written < end || (response_open && done + 1 == logged_responses.size()))) {
+                break; // not completely written, or still being produced
+            }
+            // Like %b, the body only
+            uint64_t sent = stream_id != 0 ? end : std::min(end, bytes_written);
+            response.record.bytes = sent > response.body_offset ? sent - response.body_offset : 0;
+            response.record.latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                now - response.received_at).count();
+            response.record.time_ns = static_cast<int64_t>(wall.tv_sec) * 1000000000 + wall.tv_nsec;
+            if (AccessRecord* slot = access_log->claim()) {
+                *slot = response.record;
+                access_log->publish();
+            }
+            done++;
+        }
+        logged_responses.erase(logged_responses.begin(), logged_responses.begin() + done);
+    }
+
+    void logResponse(int status) {
+        bool parsed = log_request_valid;
+        log_request_valid = false;
+        if (!access_log->sample(status)) {
+            return;
+        }
+        if (logged_responses.size() >= kPendingResponses) {
+            // Deep pipelining: the oldest goes out with what was sent of it
+            flushLog(1);
+        }
+        logged_responses.push_back({bytes_queued, bytes_queued, request_received_at, {}});
+        log_head_open = true;
+        AccessRecord& record = logged_responses.back().record;
+        if (parsed) {
+            record = *log_request;
+            record.handle_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - handle_started_at).count();
+        } else {
+            record.setRequest({}, {}, {}, {});
+        }
+        record.peer = peer_address;
+        record.status = static_cast<uint16_t>(status);
+    }
+
+    // A responder never writes: the response it started is measured on its
+    // HTTP/2 connection, from where the stream's HEADERS are queued there
+    void handOverFirstByte(Connection& parent) {
+        if (pending_count == 0) {
+            return;
+        }
+        if (parent.pending_count < kPendingResponses) {
+            parent.pending_responses[(parent.pending_head + parent.pending_count++) % kPendingResponses] = {
+                parent.bytes_queued, pending_responses[pending_head].received_at};
+        }
+        pending_head = (pending_head + 1) % kPendingResponses;
+        pending_count--;
+    }
+
+    // Called after every successful write
+    void noteWritten(size_t bytes) {
+        bytes_written += bytes;
+        bump(metrics->bytes_sent, bytes);
+        if (access_log != nullptr) {
+            flushLog();
+        }
+        if (pending_count == 0 || pending_responses[pending_head].offset >= bytes_written) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        while (pending_count > 0 && pending_responses[pending_head].offset < bytes_written) {
+            metrics->first_byte.record(now - pending_responses[pending_head].received_at);
+            if (trace != nullptr) {
+                trace->record(TraceRequest, id, TraceBuffer::nanos(pending_responses[pending_head].received_at),
+                              TraceBuffer::nanos(now));
+            }
+            pending_head = (pending_head + 1) % kPendingResponses;
+            pending_count--;
+        }
+    }
+
+    void popOutput() {
+        OutputSegment& segment = output.front();
+        if (segment.file_fd >= 0 && !segment.file_owner) {
+            close(segment.file_fd);
+        }
+        if (segment.owned()) {
+            output_memory -= segment.length;
+        }
+        output.pop_front();
+        if (output.empty()) {
+            arena.reset();
+        }
+    }
+
+    void clearOutput() {
+        while (!output.empty()) {
+            popOutput();
+        }
+    }
+};
+
+// CPUs in a list such as "0-3,8,10-11", in the order given; throws on
+// malformed input
+inline std::vector<int> parseCpuList(std::string_view list) {
+    std::vector<int> cpus;
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string_view item = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+        size_t dash = item.find('-');
+        int first = -1;
+        int last = -1;
+        std::string_view low = item.substr(0, dash);
+        std::string_view high = dash == std::string_view::npos ? low : item.substr(dash + 1);
+        auto a = std::from_chars(low.data(), low.data() + low.size(), first);
+        auto b = std::from_chars(high.data(), high.data() + high.size(), last);
+        if (a.ec != std::errc() || a.ptr != low.data() + low.size() || b.ec != std::errc() ||
+            b.ptr != high.data() + high.size() || first < 0 || last < first || last >= CPU_SETSIZE) {
+            throw std::runtime_error("Invalid CPU list: " + std::string(item));
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// NUMA node of a CPU from sysfs, or -1 when the kernel does not say
+inline int cpuNode(int cpu) {
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        return -1;
+    }
+    int node = -1;
+    while (dirent* entry = readdir(dir)) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+class HTTPServer {
+private:
+    // Route responses are written through the server's connections
+    friend class ResponseWriter;
+
+    struct EventLoop {
+        int index = 0;
+        // CPU the loop is pinned to and its NUMA node, or -1
+        int cpu = -1;
+        int node = -1;
+        int listen_fd = -1;
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::thread thread;
+        // Declared before the connections, whose arenas return blocks to it
+        BufferPool buffer_pool;
+        LoopMetrics metrics;
+        // This loop's shard of the file cache, if caching
+        std::unique_ptr<FileCache> file_cache;
+        // Drained by the access log's writer, if logging
+        std::unique_ptr<AccessLogRing> access_log;
+        // Stage recorder, if tracing; created on the loop's thread
+        std::unique_ptr<TraceBuffer> trace;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;
+        // Closed connections kept for reuse
+        std::vector<std::unique_ptr<Connection>> spare_connections;
+        // Bytes of MSG_ZEROCOPY sends on sockets closed before their
+        // completions arrived, kept until the kernel has surely let go
+        std::vector<std::pair<std::chrono::steady_clock::time_point, std::shared_ptr<const void>>> zerocopy_orphans;
+        uint64_t next_connection_id = 1;
+        // Scratch strings reused by every request on this loop
+        std::string request_path;
+        std::string cache_key;
+        // This loop's references to the bundle and the tree snapshot, and
+        // the bundle's again under a count of the loop's own: responses
+        // copy bundle_owner, so their counts stay off the line every loop
+        // shares
+        Published<AssetBundle>::Reader bundle;
+        Published<TreeSnapshot>::Reader snapshot;
+        std::shared_ptr<const void> bundle_owner;
+        // Work finished on other threads, run by the loop after a wakeup
+        std::mutex completions_mutex;
+        std::vector<std::function<void()>> completions;
+        // Connection deadlines, in seconds since timer_epoch
+        TimerWheel timers;
+        std::chrono::steady_clock::time_point timer_epoch = std::chrono::steady_clock::now();
+        // Not accepting: at the connection limit or out of descriptors
+        bool accept_paused = false;
+        // io_uring backend only: a multishot accept is outstanding
+        bool accept_armed = false;
+        // Set once the loop has seen draining: it no longer accepts and
+        // exits when its connections are gone or at the deadline
+        bool draining = false;
+        std::chrono::steady_clock::time_point drain_deadline;
+        // Closed connections not yet free for reuse: with epoll until the
+        // current batch of events (which may still name them) is handled,
+        // with io_uring until their operations have completed
+        std::vector<std::unique_ptr<Connection>> retired;
+        // This loop's own SSL_CTX, so handshakes on different loops share no
+        // context lock or session cache; nullptr without TLS
+        struct ssl_ctx_st* tls_ctx = nullptr;
+        // io_uring backend only
+        IoUring ring;
+        ProvidedBuffers recv_buffers;
+        struct __kernel_timespec sweep_interval{1, 0};
+    };
+
+    // io_uring user_data: the Connection pointer (8-byte aligned) with the
+    // operation kind in the low three bits
+    enum UringOp : uint64_t {
+        // Cancellations and buffer hand-overs; zero is ProvidedBuffers::kUserData
+        UringIgnore = 0,
+        UringAccept,
+        UringWakeup,
+        UringSweep,
+        UringRecv,
+        UringSend,
+        UringPoll
+    };
+
+    // Result of resolving and opening a request path. Produced on a worker
+    // (or inline when there are none) and turned into a response on the loop.
+    // Conditional and range request headers: views into the request, or
+    // into an OwnedConditions copy while the request waits for a worker
+    struct RequestConditions {
+        std::string_view if_none_match;
+        std::string_view if_modified_since;
+        std::string_view range;
+        std::string_view if_range;
+    };
+
+    struct OwnedConditions {
+        std::string if_none_match;
+        std::string if_modified_since;
+        std::string range;
+        std::string if_range;
+
+        RequestConditions view() const { return {if_none_match, if_modified_since, range, if_range}; }
+    };
+
+    struct FileLookup {
+        int status = 200;
+        std::shared_ptr<const FileCache::Entry> entry;
+        int file_fd = -1;
+        size_t file_size = 0;
+        RepresentationHeaders headers;
+    };
+
+    int server_fd;
+    int port;
+    std::string web_root;
+    // Canonical web_root, resolved once at startup, and a descriptor every
+    // request path is opened beneath
+    std::string root_path;
+    int root_fd;
+    int loop_threads;
+    bool reuse_port;
+    bool pin_threads;
+    std::vector<int> loop_cpus;
+    bool incoming_cpu;
+    // Distinct NUMA nodes of the pinned loops
+    int numa_nodes = 0;
+    int keepalive_timeout;
+    int max_keepalive_requests;
+    size_t max_connections;
+    // max_connections split across the loops
+    size_t loop_max_connections = 0;
+    int listen_backlog;
+    bool defer_accept;
+    int header_timeout;
+    int body_timeout;
+    int write_timeout;
+    size_t max_header_bytes;
+    size_t cache_max_file_bytes;
+    // Shards of the file cache live in the loops; their bodies live here
+    size_t cache_max_bytes;
+    std::unique_ptr<BodyStore> body_store;
+    size_t open_file_cache_entries;
+    std::unique_ptr<OpenFileCache> open_files;
+    std::string bundle_path;
+    bool bundle_populate;
+    bool bundle_lock;
+    // The mounted bundle, replaced on SIGHUP
+    Published<AssetBundle> bundle;
+    bool metadata_snapshot;
+    bool autoindex;
+    Published<TreeSnapshot> snapshot;
+    std::unique_ptr<TreeWatcher> tree_watcher;
+    int worker_threads;
+    size_t worker_queue_limit;
+    std::unique_ptr<ThreadPool> worker_pool;
+    DateCache date_cache;
+    std::string keepalive_header;
+    IoBackend io_backend;
+    bool zerocopy;
+    bool compression;
+    std::vector<std::pair<std::string, std::string>> cache_control_rules;
+    std::string metrics_path;
+    std::string access_log_path;
+    AccessLogFormat access_log_format;
+    double access_log_sample;
+    std::unique_ptr<AccessLog> access_log;
+    std::string trace_path;
+    size_t trace_events;
+    int drain_timeout;
+    std::string reload_socket;
+    std::string tls_certificate;
+    std::string tls_key;
+    std::string tls_ticket_key_file;
+    bool http2;
+    // Application routes, or nullptr when there are none
+    std::shared_ptr<const Router> router;
+    std::atomic<bool> running;
+    // Graceful shutdown in progress; drain_deadline is written before it
+    // is set
+    std::atomic<bool> draining{false};
+    std::chrono::steady_clock::time_point drain_deadline;
+    // Signal numbers (0 for stop()) for the supervising thread; written from
+    // the signal handler, so only write() touches it there
+    int control_pipe[2] = {-1, -1};
+    // Counts loop threads that have returned
+    int loops_done_fd = -1;
+    // Listening reload socket, and while taking over, the connection to
+    // the old process that is acknowledged once the loops run
+    int reload_fd = -1;
+    int takeover_fd = -1;
+    // Loops still polling the shared listener; the last to drain closes it
+    std::atomic<int> shared_listener_users{0};
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    MimeTypes mime_types;
+
+    std::string_view getMimeType(std::string_view path) const {
+        return mime_types.lookup(path);
+    }
+
+    int createListener() {
+        // Create socket
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to create socket");
+        }
+
+        // Set socket options
+        int opt = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            close(fd);
+            throw std::runtime_error("Failed to set socket options");
+        }
+        if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            close(fd);
+            throw std::runtime_error("Failed to set SO_REUSEPORT");
+        }
+
+        // Bind socket
+        struct sockaddr_in address;
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+
+        if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            close(fd);
+            throw std::runtime_error("Failed to bind socket");
+        }
+
+        // Connections that have sent nothing yet are not worth an accept();
+        // the kernel hands them over once data arrives or the timeout passes
+        if (defer_accept) {
+            setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &header_timeout, sizeof(header_timeout));
+        }
+
+        // Listen for connections
+        if (listen(fd, listen_backlog) < 0) {
+            close(fd);
+            throw std::runtime_error("Failed to listen");
+        }
+        return fd;
+    }
+
+    // A connection is accepted by the loop pinned to the CPU that handled
+    // its SYN, which with RX queue interrupts bound per CPU is also where
+    // its packets arrive. Kernels from 6.2 pick the listener whose
+    // SO_INCOMING_CPU matches by themselves; the reuseport program maps the
+    // CPU to the listener's index in the group for older ones. Listeners
+    // join the group in loop order, inherited ones included, as the running
+    // process hands them over in that order.
+    void steerIncomingCpu() {
+        std::vector<sock_filter> program;
+        program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+        for (auto& loop : loops) {
+            if (setsockopt(loop->listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &loop->cpu, sizeof(loop->cpu)) < 0) {
+                throw std::runtime_error("Failed to set SO_INCOMING_CPU");
+            }
+            program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(loop->cpu), 0, 1));
+            program.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(loop->index)));
+        }
+        // Connections received on CPUs without a loop are spread over all
+        program.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(loops.size())));
+        program.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+        sock_fprog fprog{static_cast<unsigned short>(program.size()), program.data()};
+        if (setsockopt(loops[0]->listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog)) < 0) {
+            throw std::runtime_error("Failed to attach the reuseport CPU program");
+        }
+    }
+
+#ifdef HTTP_HAVE_TLS
+    // Session ticket keys: key name, HMAC key and AES key
+    static constexpr size_t kTicketKeyBytes = 16 + 32 + 32;
+
+    static std::string tlsError() {
+        char text[256];
+        ERR_error_string_n(ERR_get_error(), text, sizeof(text));
+        ERR_clear_error();
+        return text;
+    }
+
+    std::string loadTicketKeys() const {
+        std::string keys(kTicketKeyBytes, '\0');
+        if (tls_ticket_key_file.empty()) {
+            if (RAND_bytes(reinterpret_cast<unsigned char*>(keys.data()), keys.size()) != 1) {
+                throw std::runtime_error("Failed to generate TLS session ticket keys");
+            }
+            return keys;
+        }
+        std::ifstream file(tls_ticket_key_file, std::ios::binary);
+        if (!file || !file.read(keys.data(), keys.size()) || file.peek() != std::ifstream::traits_type::eof()) {
+            throw std::runtime_error("TLS ticket key file " + tls_ticket_key_file + " must hold exactly " +
+                                     std::to_string(kTicketKeyBytes) + " bytes");
+        }
+        return keys;
+    }
+
+    // h2 when the client offers it (ours is the preference), else HTTP/1.1;
+    // a client offering only others carries on without ALPN
+    static int selectAlpn(SSL*, const unsigned char** out, unsigned char* out_length, const unsigned char* in,
+                          unsigned in_length, void* arg) {
+        static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+        bool http2 = static_cast<const HTTPServer*>(arg)->http2;
+        const unsigned char* offered = http2 ? protocols : protocols + 3;
+        unsigned char* selected = nullptr;
+        if (SSL_select_next_proto(&selected, out_length, offered, sizeof(protocols) - 1 - (offered - protocols), in,
+                                  in_length) != OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    // One per loop. Resumption is stateless tickets only, sealed with keys
+    // every context shares, so a session resumes on whichever loop (or,
+    // with a ticket key file, whichever process) the client lands on and no
+    // session cache is shared between threads.
+    SSL_CTX* createTlsContext(std::string& ticket_keys) {
+        SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+        if (ctx == nullptr) {
+            throw std::runtime_error("Failed to create TLS context: " + tlsError());
+        }
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_ENABLE_KTLS
+        // Record encryption moves into the kernel once the handshake is
+        // done, where the kernel and cipher support it
+        options |= SSL_OP_ENABLE_KTLS;
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+        options |= SSL_OP_IGNORE_UNEXPECTED_EOF; // most clients close without close_notify
+#endif
+        SSL_CTX_set_options(ctx, options);
+        // Idle keep-alive connections hold no record buffers
+        SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                  SSL_MODE_RELEASE_BUFFERS);
+        if (SSL_CTX_use_certificate_chain_file(ctx, tls_certificate.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, tls_key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1) {
+            std::string error = tlsError();
+            SSL_CTX_free(ctx);
+            throw std::runtime_error("Failed to load TLS certificate " + tls_certificate + ": " + error);
+        }
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+        if (SSL_CTX_set_tlsext_ticket_keys(ctx, ticket_keys.data(), ticket_keys.size()) != 1) {
+            SSL_CTX_free(ctx);
+            throw std::runtime_error("Failed to set TLS session ticket keys");
+        }
+        SSL_CTX_set_alpn_select_cb(ctx, selectAlpn, this);
+        return ctx;
+    }
+#endif
+
+    // Runs on the loop's thread before it allocates anything, so that its
+    // buffers, connections and io_uring ring come from the CPU's own node
+    void pinThread(EventLoop& loop) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop.cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            std::cerr << "Failed to pin loop " << loop.index << " to CPU " << loop.cpu << std::endl;
+            return;
+        }
+#ifdef MPOL_PREFERRED
+        // First touch already places pages on the running CPU's node; the
+        // policy keeps them there even when the loop briefly runs elsewhere
+        if (numa_nodes > 1 && loop.node >= 0) {
+            unsigned long mask[16] = {};
+            size_t bits = sizeof(mask) * CHAR_BIT;
+            if (static_cast<size_t>(loop.node) < bits) {
+                mask[loop.node / (sizeof(long) * CHAR_BIT)] |= 1ul << (loop.node % (sizeof(long) * CHAR_BIT));
+                if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, bits + 1) < 0) {
+                    std::cerr << "Failed to prefer NUMA node " << loop.node << " for loop " << loop.index
+                              << ": " << strerror(errno) << std::endl;
+                }
+            }
+        }
+#endif
+    }
+
+    void runLoop(EventLoop& loop) {
+        if (loop.cpu >= 0) {
+            pinThread(loop);
+        }
+        if (!trace_path.empty()) {
+            loop.trace = std::make_unique<TraceBuffer>(trace_events);
+        }
+        if (io_backend == IoBackend::Uring) {
+            runUringLoop(loop);
+        } else {
+            runEpollLoop(loop);
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(loops_done_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void runEpollLoop(EventLoop& loop) {
+        // The listener is level-triggered; when shared it is registered with
+        // EPOLLEXCLUSIVE so one loop wakes per burst. Clients are edge-triggered.
+        // epoll data.ptr is nullptr for the listener, &loop for the wakeup
+        // eventfd and the Connection for everything else.
+        epoll_event events[256];
+
+        while (running) {
+            // Wake at least once a second to run the timer wheel
+            int n = epoll_wait(loop.epoll_fd, events, 256, 1000);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "epoll_wait failed" << std::endl;
+                break;
+            }
+            // First, so deadlines armed for this batch start from a fresh tick
+            runTimers(loop, std::chrono::steady_clock::now());
+
+            for (int i = 0; i < n; i++) {
+                void* tag = events[i].data.ptr;
+                if (tag == nullptr) {
+                    // A drain earlier in this batch may have closed the listener
+                    if (!loop.draining) {
+                        acceptConnections(loop);
+                    }
+                } else if (tag == &loop) {
+                    uint64_t value;
+                    while (read(loop.wake_fd, &value, sizeof(value)) > 0) {}
+                    runCompletions(loop);
+                    refreshBundle(loop);
+                    snapshot.refresh(loop.snapshot);
+                    if (draining.load(std::memory_order_acquire) && !loop.draining) {
+                        beginDrain(loop);
+                    }
+                } else {
+                    handleEvent(loop, *static_cast<Connection*>(tag), events[i].events);
+                }
+            }
+            for (auto& conn : loop.retired) {
+                releaseConnection(loop, std::move(conn));
+            }
+            loop.retired.clear();
+
+            if (loop.draining &&
+                (loop.connections.empty() || std::chrono::steady_clock::now() >= loop.drain_deadline)) {
+                break;
+            }
+        }
+
+        for (auto& entry : loop.connections) {
+            close(entry.first);
+        }
+        loop.connections.clear();
+    }
+
+    // Completion-driven loop: multishot accept and recv (with a provided
+    // buffer ring) stay armed, sends are SENDMSG operations, and everything
+    // queued while handling one batch of CQEs is submitted together. The
+    // connection state machine is the same one the epoll loop drives.
+    void runUringLoop(EventLoop& loop) {
+        try {
+            loop.ring.init(4096);
+            loop.recv_buffers.init(loop.ring, 0, 1024, loop.buffer_pool.bufferSize());
+            // Fixed files skip the per-operation fd lookup on the hot fds
+            int fixed_files[2] = {loop.listen_fd, loop.wake_fd};
+            loop.ring.registerFiles(fixed_files, 2);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            stop();
+            return;
+        }
+
+        armUringAccept(loop);
+        armUringWakeup(loop);
+        armUringSweep(loop);
+
+        while (running) {
+            int ret = loop.ring.submit(1);
+            if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+                std::cerr << "io_uring_enter failed" << std::endl;
+                break;
+            }
+            runTimers(loop, std::chrono::steady_clock::now());
+            loop.ring.forEachCompletion([&](const struct io_uring_cqe& cqe) {
+                handleUringCompletion(loop, cqe);
+            });
+
+            // Recycle closed connections once the kernel is done with them
+            auto& retired = loop.retired;
+            for (size_t i = 0; i < retired.size();) {
+                if (retired[i]->uring.inflight == 0) {
+                    releaseConnection(loop, std::move(retired[i]));
+                    retired[i] = std::move(retired.back());
+                    retired.pop_back();
+                } else {
+                    i++;
+                }
+            }
+            if (loop.draining &&
+                (loop.connections.empty() || std::chrono::steady_clock::now() >= loop.drain_deadline)) {
+                break;
+            }
+        }
+
+        for (auto& entry : loop.connections) {
+            close(entry.first);
+        }
+        loop.connections.clear();
+        loop.retired.clear();
+    }
+
+    static uint64_t uringTag(Connection* conn, UringOp op) {
+        return reinterpret_cast<uint64_t>(conn) | op;
+    }
+
+    void armUringAccept(EventLoop& loop) {
+        struct io_uring_sqe* sqe = loop.ring.getSqe();
+        if (sqe == nullptr) {
+            return;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = 0; // fixed file index of the listener
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = uringTag(nullptr, UringAccept);
+        loop.accept_armed = true;
+    }
+
+    void armUringWakeup(EventLoop& loop) {
+        struct io_uring_sqe* sqe = loop.ring.getSqe();
+        if (sqe == nullptr) {
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = 1; // fixed file index of the wakeup eventfd
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = uringTag(nullptr, UringWakeup);
+    }
+
+    void armUringSweep(EventLoop& loop) {
+        struct io_uring_sqe* sqe = loop.ring.getSqe();
+        if (sqe == nullptr) {
+            return;
+        }
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = reinterpret_cast<uint64_t>(&loop.sweep_interval);
+        sqe->len = 1;
+        sqe->user_data = uringTag(nullptr, UringSweep);
+    }
+
+    bool armUringRecv(EventLoop& loop, Connection& conn) {
+        struct io_uring_sqe* sqe = loop.ring.getSqe();
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn.fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = uringTag(&conn, UringRecv);
+        conn.uring.recv_armed = true;
+        conn.uring.inflight++;
+        return true;
+    }
+
+    bool submitUringSend(EventLoop& loop, Connection& conn) {
+        struct io_uring_sqe* sqe = loop.ring.getSqe();
+        if (sqe == nullptr) {
+            return false;
+        }
+        int count = gatherMemorySegments(conn, conn.uring.iov, kMaxOutputIov, GatherMode::All);
+        for (int i = 0; i < count; i++) {
+            conn.output[i].in_flight = true;
+        }
+        conn.uring.msg = msghdr{};
+        conn.uring.msg.msg_iov = conn.uring.iov;
+        conn.uring.msg.msg_iovlen = count;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&conn.uring.msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | (fileFollows(conn, count) ? MSG_MORE : 0);
+        sqe->user_data = uringTag(&conn, UringSend);
+        conn.uring.send_inflight = true;
+        conn.uring.inflight++;
+        return true;
+    }
+
+    bool submitUringPollOut(EventLoop& loop, Connection& conn) {
+        struct io_uring_sqe* sqe = loop.ring.getSqe();
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = conn.fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = uringTag(&conn, UringPoll);
+        conn.uring.poll_inflight = true;
+        conn.uring.inflight++;
+        return true;
+    }
+
+    void cancelUringOp(EventLoop& loop, Connection* conn, UringOp op) {
+        struct io_uring_sqe* sqe = loop.ring.getSqe();
+        if (sqe == nullptr) {
+            return;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = uringTag(conn, op);
+        sqe->user_data = uringTag(nullptr, UringIgnore);
+    }
+
+    void handleUringCompletion(EventLoop& loop, const struct io_uring_cqe& cqe) {
+        auto op = static_cast<UringOp>(cqe.user_data & 7);
+        Connection* conn = reinterpret_cast<Connection*>(cqe.user_data & ~uint64_t(7));
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+
+        switch (op) {
+        case UringAccept:
+            if (!more) {
+                loop.accept_armed = false;
+            }
+            if (cqe.res >= 0) {
+                addUringConnection(loop, cqe.res);
+                if (loop.connections.size() >= loop_max_connections) {
+                    pauseAccepting(loop);
+                }
+            } else if (cqe.res == -EMFILE || cqe.res == -ENFILE) {
+                bump(loop.metrics.accept_errors);
+                pauseAccepting(loop); // until a descriptor is freed
+            } else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECANCELED && running) {
+                bump(loop.metrics.accept_errors);
+                std::cerr << "Failed to accept connection" << std::endl;
+            }
+            if (!loop.accept_armed && !loop.accept_paused && !loop.draining) {
+                armUringAccept(loop);
+            }
+            return;
+        case UringWakeup: {
+            uint64_t value;
+            while (read(loop.wake_fd, &value, sizeof(value)) > 0) {}
+            runCompletions(loop);
+            refreshBundle(loop);
+            snapshot.refresh(loop.snapshot);
+            if (draining.load(std::memory_order_acquire) && !loop.draining) {
+                beginDrain(loop);
+            }
+            if (!more) {
+                armUringWakeup(loop);
+            }
+            return;
+        }
+        case UringSweep:
+            // Only wakes the loop, which runs the timer wheel every batch
+            armUringSweep(loop);
+            return;
+        case UringIgnore:
+            return;
+        default:
+            break;
+        }
+
+        if (!more) {
+            conn->uring.inflight--;
+        }
+
+        if (op == UringRecv) {
+            if (!more) {
+                conn->uring.recv_armed = false;
+            }
+            if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (!conn->uring.closed) {
+                    deliverReceived(loop, *conn, loop.recv_buffers.buffer(buffer_id), cqe.res);
+                }
+                loop.recv_buffers.recycle(loop.ring, buffer_id);
+            } else if (cqe.res != -ENOBUFS) {
+                // EOF, error or cancellation: answer what is buffered, then close
+                conn->peer_closed = true;
+            }
+            if (conn->uring.closed) {
+                return;
+            }
+            if (!conn->uring.recv_armed && !conn->peer_closed && !armUringRecv(loop, *conn)) {
+                conn->peer_closed = true;
+            }
+        } else if (op == UringSend) {
+            conn->uring.send_inflight = false;
+            for (size_t i = 0; i < conn->output.size() && conn->output[i].in_flight; i++) {
+                conn->output[i].in_flight = false;
+            }
+            if (conn->uring.closed) {
+                return;
+            }
+            if (cqe.res >= 0) {
+                conn->noteWritten(cqe.res);
+                advanceMemorySegments(*conn, cqe.res);
+                OutputSegment& front = conn->output.front();
+                if (front.data_offset == front.size()) {
+                    conn->popOutput();
+                }
+            } else if (cqe.res == -EAGAIN) {
+                submitUringPollOut(loop, *conn);
+            } else if (cqe.res != -EINTR) {
+                conn->clearOutput();
+                conn->close_after_write = true;
+            }
+        } else if (op == UringPoll) {
+            conn->uring.poll_inflight = false;
+            if (conn->uring.closed) {
+                return;
+            }
+        }
+
+        driveConnection(loop, *conn);
+    }
+
+    void addUringConnection(EventLoop& loop, int client_socket) {
+        TraceSpan span(loop.trace.get(), TraceAccept, loop.next_connection_id);
+        auto connection = acquireConnection(loop, client_socket);
+        Connection& conn = *connection;
+        loop.connections.emplace(client_socket, std::move(connection));
+        if (!armUringRecv(loop, conn)) {
+            closeConnection(loop, conn);
+            return;
+        }
+        updateTimer(loop, conn);
+    }
+
+    // Copies received bytes into the receive buffer; whatever does not fit
+    // under the cap waits in the stash until requests are consumed
+    void deliverReceived(EventLoop& loop, Connection& conn, const char* data, size_t length) {
+        conn.received_at = std::chrono::steady_clock::now();
+        if (conn.state == ConnectionState::Lingering) {
+            return;
+        }
+        if (conn.uring.stash.empty()) {
+            while (length > 0) {
+                size_t space = conn.input.prepare(loop.buffer_pool, inputLimit(conn));
+                if (space == 0) {
+                    break;
+                }
+                size_t n = std::min(space, length);
+                std::memcpy(conn.input.writePointer(), data, n);
+                conn.input.commit(n);
+                data += n;
+                length -= n;
+            }
+        }
+        conn.uring.stash.append(data, length);
+        conn.readable = !conn.uring.stash.empty();
+    }
+
+    void readFromStash(EventLoop& loop, Connection& conn) {
+        std::string& stash = conn.uring.stash;
+        size_t offset = 0;
+        while (offset < stash.size()) {
+            size_t space = conn.input.prepare(loop.buffer_pool, inputLimit(conn));
+            if (space == 0) {
+                break;
+            }
+            size_t n = std::min(space, stash.size() - offset);
+            std::memcpy(conn.input.writePointer(), stash.data() + offset, n);
+            conn.input.commit(n);
+            offset += n;
+        }
+        stash.erase(0, offset);
+        conn.readable = !stash.empty();
+    }
+
+    // Writes as much output as possible without blocking: file ranges go out
+    // inline with sendfile(), memory segments as one SENDMSG. Returns false
+    // while an operation is in flight; its completion drives the connection.
+    bool writeUring(EventLoop& loop, Connection& conn) {
+        if (conn.uring.send_inflight || conn.uring.poll_inflight) {
+            return false;
+        }
+        while (!conn.output.empty()) {
+            OutputSegment& segment = conn.output.front();
+            if (!segment.isFile()) {
+                if (submitUringSend(loop, conn)) {
+                    return false;
+                }
+                conn.clearOutput();
+                conn.close_after_write = true;
+                return true;
+            }
+
+            if (conn.output.size() > 1) {
+                setCork(conn, true);
+            }
+            ssize_t sent = sendFileSegment(conn.fd, segment);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if ((errno == EAGAIN || errno == EWOULDBLOCK) && submitUringPollOut(loop, conn)) {
+                    return false;
+                }
+                conn.clearOutput();
+                conn.close_after_write = true;
+                return true;
+            }
+            if (sent == 0) {
+                conn.clearOutput();
+                conn.close_after_write = true;
+                return true;
+            }
+            conn.noteWritten(sent);
+            if (segment.file_remaining == 0) {
+                conn.popOutput();
+            }
+        }
+
+        setCork(conn, false);
+        return true;
+    }
+
+    // Hands fn to the loop's thread; safe to call from any thread
+    void postCompletion(EventLoop& loop, std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(loop.completions_mutex);
+            loop.completions.push_back(std::move(fn));
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(loop.wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void runCompletions(EventLoop& loop) {
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lock(loop.completions_mutex);
+            ready.swap(loop.completions);
+        }
+        for (auto& fn : ready) {
+            fn();
+        }
+    }
+
+    void acceptConnections(EventLoop& loop) {
+        while (true) {
+            if (loop.connections.size() >= loop_max_connections) {
+                pauseAccepting(loop);
+                return;
+            }
+            int64_t accept_started = loop.trace ? TraceBuffer::now() : 0;
+            int client_socket = accept4(loop.listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EMFILE || errno == ENFILE) {
+                    // Level-triggered, the listener would wake us right
+                    // back; wait for a close or the next tick instead
+                    bump(loop.metrics.accept_errors);
+                    pauseAccepting(loop);
+                    return;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK && running) {
+                    bump(loop.metrics.accept_errors);
+                    std::cerr << "Failed to accept connection" << std::endl;
+                }
+                return;
+            }
+
+            auto connection = acquireConnection(loop, client_socket);
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = connection.get();
+            if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+                close(client_socket);
+                bump(loop.metrics.connections_closed);
+                releaseConnection(loop, std::move(connection));
+                continue;
+            }
+            Connection& conn = *connection;
+            loop.connections.emplace(client_socket, std::move(connection));
+            if (loop.trace) {
+                loop.trace->record(TraceAccept, conn.id, accept_started, TraceBuffer::now());
+            }
+            updateTimer(loop, conn);
+        }
+    }
+
+    // Connection objects are recycled per loop, so connection churn does not
+    // allocate either
+    std::unique_ptr<Connection> acquireConnection(EventLoop& loop, int client_socket) {
+        std::unique_ptr<Connection> conn;
+        if (loop.spare_connections.empty()) {
+            conn = std::make_unique<Connection>(client_socket, max_header_bytes, loop.buffer_pool);
+        } else {
+            conn = std::move(loop.spare_connections.back());
+            loop.spare_connections.pop_back();
+            conn->reset(client_socket);
+        }
+        conn->id = loop.next_connection_id++;
+        conn->head_deadline = loop.timers.now() + header_timeout + 1;
+        conn->metrics = &loop.metrics;
+        conn->trace = loop.trace.get();
+        bump(loop.metrics.connections_opened);
+        if (loop.access_log) {
+            conn->access_log = loop.access_log.get();
+            sockaddr_in peer{};
+            socklen_t length = sizeof(peer);
+            if (getpeername(client_socket, reinterpret_cast<sockaddr*>(&peer), &length) == 0) {
+                conn->peer_address = peer.sin_addr.s_addr;
+            }
+        }
+
+        // Responses leave in as few sendmsg() calls as possible, each ending
+        // at a response boundary, so Nagle would only delay them; MSG_MORE
+        // and TCP_CORK hold back partial packets where more data follows
+        int one = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (zerocopy && io_backend == IoBackend::Epoll && loop.tls_ctx == nullptr) {
+            conn->zerocopy = setsockopt(client_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        }
+#ifdef HTTP_HAVE_TLS
+        if (loop.tls_ctx != nullptr) {
+            startTls(loop, *conn);
+        }
+#endif
+        return conn;
+    }
+
+    void releaseConnection(EventLoop& loop, std::unique_ptr<Connection> conn) {
+        if (conn->access_log != nullptr) {
+            conn->flushLog(conn->logged_responses.size());
+        }
+        conn->clearOutput();
+        conn->input.discard(loop.buffer_pool);
+        if (loop.spare_connections.size() < 1024) {
+            loop.spare_connections.push_back(std::move(conn));
+        }
+    }
+
+    // Runs on the loop once draining is set: stops accepting and closes the
+    // keep-alive connections that are between requests. The rest close
+    // after their current response, which says "Connection: close".
+    void beginDrain(EventLoop& loop) {
+        loop.draining = true;
+        loop.drain_deadline = drain_deadline;
+        if (io_backend == IoBackend::Uring) {
+            // Submitted now: the loop may exit before its next submit
+            cancelUringOp(loop, nullptr, UringAccept);
+            loop.ring.submit(0);
+            loop.ring.updateFile(0, -1);
+        } else {
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, loop.listen_fd, nullptr);
+        }
+        // With the last reference gone new connections are refused at once;
+        // after a handoff the successor holds its own
+        if (reuse_port) {
+            close(loop.listen_fd);
+        } else if (shared_listener_users.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            close(server_fd);
+            server_fd = -1;
+        }
+        loop.listen_fd = -1;
+        // HTTP/2 connections waiting on the client get their GOAWAY from
+        // the state machine
+        std::vector<Connection*> idle;
+        for (auto& entry : loop.connections) {
+            Connection& conn = *entry.second;
+            if (betweenRequests(conn) || (conn.http2 && conn.state == ConnectionState::Reading)) {
+                idle.push_back(&conn);
+            }
+        }
+        for (Connection* conn : idle) {
+            if (!conn->http2) {
+                closeGently(*conn);
+            }
+            driveConnection(loop, *conn);
+        }
+    }
+
+    // Has served a request and holds no part of the next one (HTTP/1.1)
+    static bool betweenRequests(const Connection& conn) {
+        return conn.state == ConnectionState::Reading && conn.requests_served > 0 && !conn.awaiting_worker &&
+               !conn.readable && conn.input.size() == 0 && !conn.http2;
+    }
+
+    // A next request may already be in flight; lingering after the FIN
+    // keeps it from turning into a reset the client cannot retry
+    static void closeGently(Connection& conn) {
+        conn.close_after_write = true;
+        conn.linger_on_close = true;
+        conn.state = ConnectionState::Writing;
+    }
+
+    // Advances the loop's timer wheel to now, once per second of it
+    void runTimers(EventLoop& loop, std::chrono::steady_clock::time_point now) {
+        uint64_t tick = std::chrono::duration_cast<std::chrono::seconds>(now - loop.timer_epoch).count();
+        if (tick <= loop.timers.now()) {
+            return;
+        }
+        loop.timers.advance(tick, [&](TimerWheel::Node& node) {
+            expireConnection(loop, *static_cast<Connection*>(node.owner));
+        });
+        if (loop.accept_paused) {
+            resumeAccepting(loop); // out of descriptors a moment ago
+        }
+
+        // A closed socket's queue is retransmitted for at most a few
+        // minutes (tcp_orphan_retries)
+        auto& orphans = loop.zerocopy_orphans;
+        orphans.erase(std::remove_if(orphans.begin(), orphans.end(),
+                                     [now](const auto& orphan) { return now - orphan.first >= std::chrono::minutes(5); }),
+                      orphans.end());
+    }
+
+    // Points the connection's timer at the deadline of whatever it now waits
+    // for: the rest of a request head, progress on a body or a write, the
+    // next request on an idle keep-alive connection, or the end of a linger.
+    // Called whenever the state machine stops.
+    void updateTimer(EventLoop& loop, Connection& conn) {
+        uint64_t now = loop.timers.now();
+        uint64_t expiry = 0;
+        // The write deadline is pushed back only when bytes went out since
+        // it was armed; stops of the state machine without progress keep
+        // the old deadline
+        auto writeDeadline = [&] {
+            if (conn.write_deadline == 0 || conn.bytes_written != conn.write_deadline_written) {
+                conn.write_deadline = now + write_timeout + 1;
+                conn.write_deadline_written = conn.bytes_written;
+            }
+            return conn.write_deadline;
+        };
+        bool writing = false;
+        switch (conn.state) {
+        case ConnectionState::Handshaking:
+            expiry = conn.head_deadline; // the handshake counts towards the first head
+            break;
+        case ConnectionState::Reading:
+            if (conn.awaiting_worker || http2AwaitingWorker(conn)) {
+                loop.timers.cancel(conn.timer);
+                conn.write_deadline = 0;
+                return;
+            }
+            if (conn.body.active()) {
+                expiry = now + body_timeout + 1;
+            } else if (conn.http2 && !conn.http2->streams.empty()) {
+                expiry = writeDeadline(); // responses held up by the client's flow control
+                writing = true;
+            } else if (conn.input.size() > 0 || conn.requests_served == 0) {
+                if (conn.head_deadline == 0) {
+                    conn.head_deadline = now + header_timeout + 1;
+                }
+                expiry = conn.head_deadline;
+            } else {
+                expiry = now + std::max(1, keepalive_timeout) + 1;
+            }
+            break;
+        case ConnectionState::Writing:
+            expiry = writeDeadline();
+            writing = true;
+            break;
+        case ConnectionState::Lingering:
+            expiry = conn.linger_deadline;
+            break;
+        case ConnectionState::Closing:
+            return;
+        }
+        if (!writing) {
+            conn.write_deadline = 0;
+        }
+        loop.timers.schedule(conn.timer, expiry);
+    }
+
+    // A deadline passed. A partly received head is answered with 408 (RFC
+    // 9110 15.5.9); everything else is simply closed.
+    void expireConnection(EventLoop& loop, Connection& conn) {
+        bump(loop.metrics.timeouts);
+        if (conn.http2 && conn.state == ConnectionState::Reading && !conn.http2->failed) {
+            // With a GOAWAY the client knows no request was lost
+            queueGoAway(conn, Http2NoError);
+            closeGently(conn);
+            driveConnection(loop, conn);
+            return;
+        }
+        if (conn.state == ConnectionState::Reading && !conn.body.active() && conn.input.size() > 0) {
+            conn.input.consume(conn.input.size());
+            conn.close_after_write = true;
+            conn.linger_on_close = true;
+            sendError(conn, 408, "Request Timeout");
+            conn.state = ConnectionState::Writing;
+            driveConnection(loop, conn);
+            return;
+        }
+        closeConnection(loop, conn);
+    }
+
+    // Stops taking connections off the listener; the kernel keeps queuing
+    // them up to the backlog, and other loops sharing it still accept
+    void pauseAccepting(EventLoop& loop) {
+        if (loop.accept_paused || loop.draining) {
+            return;
+        }
+        loop.accept_paused = true;
+        bump(loop.metrics.accept_pauses);
+        if (io_backend == IoBackend::Uring) {
+            // Multishot accept keeps draining the backlog until the cancel
+            // reaches the kernel, so push it out now; whatever it already
+            // accepted is still served
+            if (loop.accept_armed) {
+                cancelUringOp(loop, nullptr, UringAccept);
+                loop.ring.submit(0);
+            }
+        } else {
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, loop.listen_fd, nullptr);
+        }
+    }
+
+    void resumeAccepting(EventLoop& loop) {
+        if (!loop.accept_paused || loop.draining || loop.connections.size() >= loop_max_connections) {
+            return;
+        }
+        loop.accept_paused = false;
+        if (io_backend == IoBackend::Uring) {
+            // A cancelled accept not yet completed re-arms when it does
+            if (!loop.accept_armed) {
+                armUringAccept(loop);
+            }
+            return;
+        }
+        epoll_event ev{};
+        ev.events = reuse_port ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = nullptr;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.listen_fd, &ev) < 0) {
+            std::cerr << "Failed to resume accepting on loop " << loop.index << std::endl;
+        }
+    }
+
+    void handleEvent(EventLoop& loop, Connection& conn, uint32_t events) {
+        if (conn.fd < 0) {
+            return; // closed earlier in this batch, e.g. by a worker completion
+        }
+        if ((events & EPOLLERR) && (conn.zerocopy || !conn.zerocopy_holds.empty())) {
+            // Zero-copy completions raise EPOLLERR too; only a pending
+            // socket error is fatal
+            reapZeroCopy(conn);
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+                events &= ~EPOLLERR;
+            }
+        }
+        if (events & EPOLLERR) {
+            closeConnection(loop, conn);
+            return;
+        }
+
+        // Edge-triggered: remember readiness until a read returns EAGAIN
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+            conn.readable = true;
+        }
+        driveConnection(loop, conn);
+    }
+
+    // Advance the state machine until it has to wait on the socket or a worker
+    void driveConnection(EventLoop& loop, Connection& conn) {
+        stepConnection(loop, conn);
+        if (conn.fd >= 0) {
+            notifyDrained(loop, conn);
+            updateTimer(loop, conn); // closed ones stay retired until the batch ends
+        }
+    }
+
+    void stepConnection(EventLoop& loop, Connection& conn) {
+        while (true) {
+            switch (conn.state) {
+            case ConnectionState::Handshaking:
+#ifdef HTTP_HAVE_TLS
+                if (!continueHandshake(loop, conn)) {
+                    return; // wait for the client's next flight or for room to send ours
+                }
+#endif
+                break;
+            case ConnectionState::Reading:
+                if (conn.readable) {
+                    readFromConnection(loop, conn);
+                }
+                processRequests(loop, conn);
+                conn.input.release(loop.buffer_pool);
+                if (conn.state == ConnectionState::Reading) {
+                    if (conn.awaiting_worker) {
+                        return;
+                    }
+                    if (conn.readable && !conn.input.full(inputLimit(conn))) {
+                        continue; // a full buffer stopped the read; there is room again
+                    }
+                    if (conn.http2 && settleHttp2(loop, conn)) {
+                        continue;
+                    }
+                    if (loop.draining && !conn.peer_closed && betweenRequests(conn)) {
+                        closeGently(conn);
+                        continue;
+                    }
+                    if (!conn.peer_closed) {
+                        return; // wait for more input
+                    }
+                    conn.state = ConnectionState::Closing;
+                }
+                break;
+            case ConnectionState::Writing:
+                if (!writeToConnection(loop, conn)) {
+                    return; // wait for EPOLLOUT
+                }
+                if (conn.http2 && !conn.close_after_write) {
+                    // Window updates and new requests come in while a
+                    // response goes out, and may change what should be next
+                    if (conn.readable || !conn.input.empty()) {
+                        conn.state = ConnectionState::Reading;
+                        continue;
+                    }
+                    if (fillHttp2(loop, conn)) {
+                        continue;
+                    }
+                }
+                if (conn.awaiting_worker) {
+                    conn.state = ConnectionState::Reading;
+                    return; // the completion resumes the connection
+                }
+                if (!conn.close_after_write) {
+                    conn.state = ConnectionState::Reading;
+                } else if (conn.linger_on_close && !conn.peer_closed) {
+                    finishTls(conn);
+                    shutdown(conn.fd, SHUT_WR);
+                    conn.linger_deadline = loop.timers.now() + 2 + 1;
+                    conn.state = ConnectionState::Lingering;
+                } else {
+                    conn.state = ConnectionState::Closing;
+                }
+                break;
+            case ConnectionState::Lingering:
+                if (!drainConnection(loop, conn)) {
+                    return;
+                }
+                conn.state = ConnectionState::Closing;
+                break;
+            case ConnectionState::Closing:
+                closeConnection(loop, conn);
+                return;
+            }
+        }
+    }
+
+    void readFromConnection(EventLoop& loop, Connection& conn) {
+        TraceSpan span(loop.trace.get(), TraceRead, conn.id);
+        if (io_backend == IoBackend::Uring) {
+            readFromStash(loop, conn);
+            return;
+        }
+
+        // Drain the socket until it would block or the buffer reaches its cap
+        while (true) {
+            size_t space = conn.input.prepare(loop.buffer_pool, inputLimit(conn));
+            if (space == 0) {
+                return; // still readable; processRequests must make room
+            }
+            ssize_t bytes_read = receive(conn, conn.input.writePointer(), space);
+            if (bytes_read > 0) {
+                conn.input.commit(bytes_read);
+                conn.received_at = std::chrono::steady_clock::now();
+                continue;
+            }
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            conn.readable = false;
+            if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                // EOF or hard error: answer what is buffered, then close
+                conn.peer_closed = true;
+            }
+            return;
+        }
+    }
+
+    // read() for plain connections, SSL_read() with errno set the same way
+    // (EAGAIN while the next record is incomplete) for TLS ones
+    static ssize_t receive(Connection& conn, char* buffer, size_t length) {
+#ifdef HTTP_HAVE_TLS
+        if (conn.tls != nullptr) {
+            ERR_clear_error();
+            int bytes_read = SSL_read(conn.tls, buffer, static_cast<int>(std::min<size_t>(length, INT_MAX)));
+            if (bytes_read > 0) {
+                return bytes_read;
+            }
+            switch (SSL_get_error(conn.tls, bytes_read)) {
+            case SSL_ERROR_ZERO_RETURN:
+                return 0;
+            case SSL_ERROR_WANT_READ:
+            case SSL_ERROR_WANT_WRITE:
+                errno = EAGAIN;
+                return -1;
+            default:
+                conn.tls_finished = true;
+                errno = ECONNRESET;
+                return -1;
+            }
+        }
+#endif
+        return read(conn.fd, buffer, length);
+    }
+
+    // Reads and discards input; returns true once the peer has closed.
+    // TLS records are discarded undecrypted.
+    bool drainConnection(EventLoop& loop, Connection& conn) {
+        if (io_backend == IoBackend::Uring) {
+            // The armed recv keeps discarding; EOF sets peer_closed
+            conn.uring.stash.clear();
+            conn.readable = false;
+            return conn.peer_closed;
+        }
+
+        char buffer[4096];
+        while (true) {
+            ssize_t bytes_read = read(conn.fd, buffer, sizeof(buffer));
+            if (bytes_read > 0) {
+                continue;
+            }
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            return bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+    }
+
+    void processRequests(EventLoop& loop, Connection& conn) {
+        if (http2 && conn.requests_served == 0 && !conn.http2 && conn.tls == nullptr && !conn.input.empty()) {
+            // HTTP/2 with prior knowledge: the client preface can never
+            // start an HTTP/1.1 request that makes sense
+            size_t length = std::min(conn.input.size(), kHttp2Preface.size());
+            if (std::memcmp(conn.input.data(), kHttp2Preface.data(), length) == 0) {
+                if (length < kHttp2Preface.size()) {
+                    return;
+                }
+                startHttp2(loop, conn);
+            }
+        }
+        if (conn.http2) {
+            processHttp2(loop, conn);
+            return;
+        }
+
+        // Answer every complete request already buffered, in order, so
+        // pipelined requests do not need a fresh read each. Stop once enough
+        // output is queued and resume after it has been flushed.
+        size_t consumed = 0;
+        while (!conn.close_after_write && !conn.awaiting_worker &&
+               conn.output_memory < 256 * 1024 && conn.output.size() < 64) {
+            // Skip the body of the previous request before parsing the next head
+            if (conn.body.active()) {
+                size_t used = 0;
+                auto status = conn.body.feed(conn.input.data() + consumed, conn.input.size() - consumed, used, nullptr);
+                consumed += used;
+                if (status == BodyDecoder::Status::Incomplete) {
+                    break;
+                }
+                if (status == BodyDecoder::Status::Error) {
+                    conn.close_after_write = true;
+                    conn.linger_on_close = true;
+                    consumed = conn.input.size();
+                    break;
+                }
+                continue;
+            }
+
+            auto parse_started = std::chrono::steady_clock::now();
+            auto status = conn.parser.parse(conn.input.data() + consumed, conn.input.size() - consumed);
+            auto parsed_at = std::chrono::steady_clock::now();
+            conn.request_received_at = conn.received_at;
+            if (status == RequestParser::Status::Incomplete) {
+                if (consumed > 0 || !conn.input.full(inputLimit(conn))) {
+                    break;
+                }
+                // The buffer is at its cap and still holds no complete head
+                conn.close_after_write = true;
+                conn.linger_on_close = true;
+                sendError(conn, 431, "Request Header Fields Too Large");
+                conn.state = ConnectionState::Writing;
+                consumed = conn.input.size();
+                break;
+            }
+            conn.state = ConnectionState::Writing;
+            if (status == RequestParser::Status::Error || !startBody(conn, conn.parser)) {
+                // The stream cannot be re-synchronized after a bad head
+                conn.close_after_write = true;
+                conn.linger_on_close = true;
+                int code = status == RequestParser::Status::Error ? conn.parser.errorStatus() : 400;
+                sendError(conn, code, code == 431 ? "Request Header Fields Too Large" : "Bad Request");
+                consumed = conn.input.size();
+                break;
+            }
+            loop.metrics.parse.record(parsed_at - parse_started);
+            if (loop.trace) {
+                loop.trace->record(TraceParse, conn.id, TraceBuffer::nanos(parse_started), TraceBuffer::nanos(parsed_at));
+            }
+            conn.handle_started_at = parsed_at;
+            conn.head_deadline = 0;
+            if (conn.access_log != nullptr) {
+                conn.beginLog(conn.parser);
+            }
+            handleRequest(loop, conn, conn.parser);
+            if (!conn.awaiting_worker) {
+                loop.metrics.handle.record(std::chrono::steady_clock::now() - parsed_at);
+            }
+            consumed += conn.parser.headLength();
+            conn.parser.reset();
+        }
+        conn.input.consume(consumed);
+
+        if (conn.peer_closed && conn.state == ConnectionState::Writing) {
+            conn.close_after_write = true;
+        }
+    }
+
+    // Sets up body framing from Content-Length / Transfer-Encoding. Returns
+    // false when the framing is ambiguous or invalid (RFC 9112 6.3): every
+    // Content-Length field, and each element of a list in one, must give
+    // the same length; the Transfer-Encoding fields together must end with
+    // one chunked.
+    static bool startBody(Connection& conn, const RequestParser& request) {
+        bool has_transfer_encoding = false;
+        bool chunked_last = false;
+        int chunked_count = 0;
+        bool has_content_length = false;
+        uint64_t length = 0;
+
+        auto nextElement = [](std::string_view& list) {
+            size_t comma = list.find(',');
+            std::string_view element = list.substr(0, comma);
+            list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+            while (!element.empty() && (element.front() == ' ' || element.front() == '\t')) {
+                element.remove_prefix(1);
+            }
+            while (!element.empty() && (element.back() == ' ' || element.back() == '\t')) {
+                element.remove_suffix(1);
+            }
+            return element;
+        };
+
+        const HttpHeader* headers = request.headers();
+        for (size_t i = 0; i < request.headerCount(); i++) {
+            std::string_view list = headers[i].value;
+            if (RequestParser::equalsIgnoreCase(headers[i].name, "Transfer-Encoding")) {
+                has_transfer_encoding = true;
+                while (!list.empty()) {
+                    std::string_view coding = nextElement(list);
+                    if (coding.empty()) {
+                        continue;
+                    }
+                    chunked_last = RequestParser::equalsIgnoreCase(coding, "chunked");
+                    chunked_count += chunked_last;
+                }
+            } else if (RequestParser::equalsIgnoreCase(headers[i].name, "Content-Length")) {
+                do {
+                    std::string_view digits = nextElement(list);
+                    if (digits.empty()) {
+                        return false;
+                    }
+                    uint64_t value = 0;
+                    for (char c : digits) {
+                        if (c < '0' || c > '9' || value > (UINT64_MAX - 9) / 10) {
+                            return false;
+                        }
+                        value = value * 10 + (c - '0');
+                    }
+                    if (has_content_length && value != length) {
+                        return false;
+                    }
+                    has_content_length = true;
+                    length = value;
+                } while (!list.empty());
+            }
+        }
+
+        if (has_transfer_encoding) {
+            // Reject TE+CL outright: disagreeing framing enables smuggling
+            if (has_content_length || !chunked_last || chunked_count != 1) {
+                return false;
+            }
+            conn.body.startChunked();
+            return true;
+        }
+        if (has_content_length) {
+            conn.body.startLength(length);
+        }
+        return true;
+    }
+
+    bool writeToConnection(EventLoop& loop, Connection& conn) {
+        TraceSpan span(conn.output.empty() ? nullptr : loop.trace.get(), TraceWrite, conn.id, &conn.bytes_written);
+        if (io_backend == IoBackend::Uring) {
+            return writeUring(loop, conn);
+        }
+#ifdef HTTP_HAVE_TLS
+        if (conn.tls != nullptr && !conn.ktls_send) {
+            return writeTls(conn);
+        }
+#endif
+
+        while (!conn.output.empty()) {
+            ssize_t sent;
+            if (conn.output.front().isFile()) {
+                if (conn.output.size() > 1) {
+                    setCork(conn, true);
+                }
+                sent = sendFileSegment(conn.fd, conn.output.front());
+            } else {
+                sent = sendMemorySegments(conn);
+            }
+
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return false;
+                }
+                conn.clearOutput();
+                conn.close_after_write = true;
+                return true;
+            }
+            if (sent > 0) {
+                conn.noteWritten(sent);
+            }
+
+            OutputSegment& segment = conn.output.front();
+            if (!segment.isFile()) {
+                if (segment.data_offset == segment.size()) {
+                    conn.popOutput();
+                }
+            } else if (sent == 0) {
+                // File shrank under us; the promised Content-Length cannot be met
+                conn.clearOutput();
+                conn.close_after_write = true;
+                return true;
+            } else if (segment.file_remaining == 0) {
+                conn.popOutput();
+            }
+        }
+
+        setCork(conn, false);
+        return true;
+    }
+
+    // Gathers the leading in-memory segments into one sendmsg() and advances
+    // them by the number of bytes written. Fully written segments other than
+    // the front one are popped here. On zero-copy sockets large shared
+    // segments get a MSG_ZEROCOPY sendmsg() of their own, since arena bytes
+    // are reused as soon as the output drains.
+    static ssize_t sendMemorySegments(Connection& conn) {
+        struct iovec iov[kMaxOutputIov];
+        struct msghdr msg{};
+        msg.msg_iov = iov;
+        GatherMode mode = GatherMode::All;
+        if (conn.zerocopy) {
+            mode = zeroCopyCandidate(conn.output.front()) ? GatherMode::ZeroCopy : GatherMode::Copied;
+        }
+        int count = gatherMemorySegments(conn, iov, kMaxOutputIov, mode);
+        msg.msg_iovlen = count;
+
+        // Headers ahead of a file range or a zero-copy body wait for it
+        int flags = MSG_NOSIGNAL;
+        if (fileFollows(conn, count) ||
+            (mode == GatherMode::Copied && static_cast<size_t>(count) < conn.output.size() &&
+             zeroCopyCandidate(conn.output[count]))) {
+            flags |= MSG_MORE;
+        }
+        if (mode == GatherMode::ZeroCopy) {
+            flags |= MSG_ZEROCOPY;
+        }
+
+        ssize_t sent = sendmsg(conn.fd, &msg, flags);
+        if (sent < 0 && mode == GatherMode::ZeroCopy && errno == ENOBUFS) {
+            // Out of optmem for notifications; plain sends from here on
+            conn.zerocopy = false;
+            errno = EINTR;
+            return -1;
+        }
+        if (sent > 0) {
+            if (mode == GatherMode::ZeroCopy) {
+                for (int i = 0; i < count; i++) {
+                    conn.zerocopy_holds.push_back({conn.zerocopy_sequence, conn.output[i].shared});
+                }
+                conn.zerocopy_sequence++;
+            }
+            advanceMemorySegments(conn, sent);
+        }
+        return sent;
+    }
+
+    enum class GatherMode {
+        All,
+        // Stop before a zero-copy candidate
+        Copied,
+        // Only consecutive shared segments, starting with a candidate
+        ZeroCopy
+    };
+
+    static bool zeroCopyCandidate(const OutputSegment& segment) {
+        return segment.shared && !segment.isFile() && segment.size() - segment.data_offset >= kZeroCopyMinBytes;
+    }
+
+    static bool fileFollows(const Connection& conn, int gathered) {
+        return static_cast<size_t>(gathered) < conn.output.size() && conn.output[gathered].isFile();
+    }
+
+    // Fills iov with the unsent parts of the leading in-memory segments
+    static int gatherMemorySegments(Connection& conn, struct iovec* iov, int max_count, GatherMode mode) {
+        int count = 0;
+        for (size_t i = 0; i < conn.output.size() && count < max_count && !conn.output[i].isFile(); i++) {
+            OutputSegment& segment = conn.output[i];
+            if ((mode == GatherMode::Copied && count > 0 && zeroCopyCandidate(segment)) ||
+                (mode == GatherMode::ZeroCopy && !segment.shared)) {
+                break;
+            }
+            iov[count].iov_base = const_cast<char*>(segment.bytes() + segment.data_offset);
+            iov[count].iov_len = segment.size() - segment.data_offset;
+            count++;
+        }
+        return count;
+    }
+
+    // Releases the holds of MSG_ZEROCOPY sends the kernel reports finished.
+    // A report that it copied after all turns zero-copy off for the socket.
+    static void reapZeroCopy(Connection& conn) {
+        while (true) {
+            char control[128];
+            struct msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(conn.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                return;
+            }
+            for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+                if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                      (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                    continue;
+                }
+                struct sock_extended_err error;
+                std::memcpy(&error, CMSG_DATA(cm), sizeof(error));
+                if (error.ee_origin != SO_EE_ORIGIN_ZEROCOPY || error.ee_errno != 0) {
+                    continue;
+                }
+                if (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                    conn.zerocopy = false;
+                }
+                // Completions cover the inclusive range [ee_info, ee_data]
+                uint32_t first = error.ee_info;
+                uint32_t span = error.ee_data - first;
+                auto& holds = conn.zerocopy_holds;
+                holds.erase(std::remove_if(holds.begin(), holds.end(),
+                                           [first, span](const Connection::ZeroCopyHold& hold) {
+                                               return hold.sequence - first <= span;
+                                           }),
+                            holds.end());
+            }
+        }
+    }
+
+    // TCP_CORK holds partial packets while a file range is followed by more
+    // output (multipart parts), so part headers share packets with file data
+    static void setCork(Connection& conn, bool on) {
+        if (conn.corked == on) {
+            return;
+        }
+        int value = on ? 1 : 0;
+        setsockopt(conn.fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+        conn.corked = on;
+    }
+
+    // Advances the leading in-memory segments past sent bytes
+    static void advanceMemorySegments(Connection& conn, size_t sent) {
+        size_t remaining = sent;
+        while (true) {
+            OutputSegment& segment = conn.output.front();
+            size_t available = segment.size() - segment.data_offset;
+            if (remaining < available || conn.output.size() == 1 || conn.output[1].isFile()) {
+                segment.data_offset += std::min(remaining, available);
+                break;
+            }
+            remaining -= available;
+            conn.popOutput();
+        }
+    }
+
+    // Sends the next piece of a file range, advancing the segment. Uses
+    // sendfile() so bytes go from the page cache straight to the socket, and
+    // falls back to pread()+send() in 64 KB chunks where sendfile is refused.
+    static ssize_t sendFileSegment(int socket_fd, OutputSegment& segment) {
+        size_t chunk = std::min<size_t>(segment.file_remaining, 1 << 30);
+        if (!segment.sendfile_unsupported) {
+            ssize_t sent = sendfile(socket_fd, segment.file_fd, &segment.file_offset, chunk);
+            if (sent >= 0) {
+                segment.file_remaining -= sent;
+                return sent;
+            }
+            if (errno != EINVAL && errno != ENOSYS) {
+                return -1;
+            }
+            segment.sendfile_unsupported = true;
+        }
+
+        char buffer[65536];
+        ssize_t bytes_read = pread(segment.file_fd, buffer, std::min(chunk, sizeof(buffer)), segment.file_offset);
+        if (bytes_read <= 0) {
+            return bytes_read;
+        }
+        ssize_t sent = send(socket_fd, buffer, bytes_read, MSG_NOSIGNAL);
+        if (sent > 0) {
+            segment.file_offset += sent;
+            segment.file_remaining -= sent;
+        }
+        return sent;
+    }
+
+#ifdef HTTP_HAVE_TLS
+    void startTls(EventLoop& loop, Connection& conn) {
+        conn.tls = SSL_new(loop.tls_ctx);
+        if (conn.tls == nullptr || SSL_set_fd(conn.tls, conn.fd) != 1) {
+            ERR_clear_error();
+            conn.tls_finished = true;
+            conn.state = ConnectionState::Closing; // closed on its first event
+            return;
+        }
+        SSL_set_accept_state(conn.tls);
+        conn.state = ConnectionState::Handshaking;
+    }
+
+    // Returns false while the handshake waits on the socket
+    bool continueHandshake(EventLoop& loop, Connection& conn) {
+        ERR_clear_error();
+        int result = SSL_do_handshake(conn.tls);
+        if (result == 1) {
+            bump(loop.metrics.tls_handshakes);
+            if (SSL_session_reused(conn.tls)) {
+                bump(loop.metrics.tls_resumed);
+            }
+            conn.ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn.tls));
+            if (conn.ktls_send) {
+                bump(loop.metrics.ktls_connections);
+            }
+            const unsigned char* protocol = nullptr;
+            unsigned protocol_length = 0;
+            SSL_get0_alpn_selected(conn.tls, &protocol, &protocol_length);
+            if (protocol_length == 2 && std::memcmp(protocol, "h2", 2) == 0) {
+                startHttp2(loop, conn);
+            }
+            // The first request may have arrived with the client's Finished
+            // and its readiness edge was spent on the handshake
+            conn.readable = true;
+            conn.state = ConnectionState::Reading;
+            return true;
+        }
+        int error = SSL_get_error(conn.tls, result);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            return false;
+        }
+        ERR_clear_error();
+        bump(loop.metrics.tls_handshake_errors);
+        conn.tls_finished = true;
+        conn.state = ConnectionState::Closing;
+        return true;
+    }
+
+    // Output of a TLS connection without kernel TLS. Small memory segments
+    // are gathered into one full record, so headers and a small body cost
+    // one record and one send rather than one each; large ones and file
+    // ranges go a record at a time. A write that has to wait is retried with
+    // the same leading bytes, as SSL_write requires.
+    bool writeTls(Connection& conn) {
+        constexpr size_t kRecordBytes = 16 * 1024;
+        char buffer[kRecordBytes];
+        while (!conn.output.empty()) {
+            OutputSegment& front = conn.output.front();
+            const char* data = buffer;
+            size_t length = 0;
+            if (front.isFile()) {
+                ssize_t bytes_read = pread(front.file_fd, buffer, std::min(front.file_remaining, kRecordBytes),
+                                           front.file_offset);
+                if (bytes_read <= 0) {
+                    // Unreadable or shrank; the promised Content-Length cannot be met
+                    conn.clearOutput();
+                    conn.close_after_write = true;
+                    return true;
+                }
+                length = bytes_read;
+            } else if (front.size() - front.data_offset >= kRecordBytes) {
+                data = front.bytes() + front.data_offset;
+                length = front.size() - front.data_offset;
+            } else {
+                for (size_t i = 0; i < conn.output.size() && length < kRecordBytes && !conn.output[i].isFile(); i++) {
+                    const OutputSegment& segment = conn.output[i];
+                    size_t take = std::min(segment.size() - segment.data_offset, kRecordBytes - length);
+                    std::memcpy(buffer + length, segment.bytes() + segment.data_offset, take);
+                    length += take;
+                }
+            }
+
+            ERR_clear_error();
+            int sent = SSL_write(conn.tls, data, static_cast<int>(std::min<size_t>(length, INT_MAX)));
+            if (sent <= 0) {
+                int error = SSL_get_error(conn.tls, sent);
+                if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) {
+                    return false;
+                }
+                ERR_clear_error();
+                conn.tls_finished = true;
+                conn.clearOutput();
+                conn.close_after_write = true;
+                return true;
+            }
+            conn.noteWritten(sent);
+
+            if (front.isFile()) {
+                front.file_offset += sent;
+                front.file_remaining -= sent;
+                if (front.file_remaining == 0) {
+                    conn.popOutput();
+                }
+                continue;
+            }
+            advanceMemorySegments(conn, sent);
+            OutputSegment& segment = conn.output.front();
+            if (!segment.isFile() && segment.data_offset == segment.size()) {
+                conn.popOutput();
+            }
+        }
+        return true;
+    }
+#endif
+
+    // Sends close_notify once, best effort, before the write side closes
+    static void finishTls(Connection& conn) {
+#ifdef HTTP_HAVE_TLS
+        if (conn.tls != nullptr && !conn.tls_finished && SSL_is_init_finished(conn.tls)) {
+            ERR_clear_error();
+            SSL_shutdown(conn.tls);
+            ERR_clear_error();
+        }
+#endif
+        conn.tls_finished = true;
+    }
+
+    // HTTP/2. Frames are parsed straight out of the receive buffer; each
+    // stream's request is rendered as an HTTP/1.1 head and handled like one,
+    // and the HTTP/1.1-format response the handler queues on the stream's
+    // responder is reframed: the head through HPACK into HEADERS, the body
+    // into DATA frames that slice the same cached bytes and file ranges.
+
+    // Sends the server preface. Pushes are never sent, so the client's
+    // SETTINGS_ENABLE_PUSH needs no answer.
+    void startHttp2(EventLoop& loop, Connection& conn) {
+        conn.http2 = std::make_unique<Http2Session>();
+        bump(loop.metrics.http2_connections);
+        char settings[12];
+        putSetting(settings, 0x3, kHttp2MaxStreams); // SETTINGS_MAX_CONCURRENT_STREAMS
+        putSetting(settings + 6, 0x6, static_cast<uint32_t>(max_header_bytes)); // SETTINGS_MAX_HEADER_LIST_SIZE
+        queueHttp2Frame(conn, Http2Settings, 0, 0, std::string_view(settings, sizeof(settings)));
+    }
+
+    static void putSetting(char* out, uint16_t identifier, uint32_t value) {
+        out[0] = static_cast<char>(identifier >> 8);
+        out[1] = static_cast<char>(identifier);
+        putUint32(out + 2, value);
+    }
+
+    static void putUint32(char* out, uint32_t value) {
+        out[0] = static_cast<char>(value >> 24);
+        out[1] = static_cast<char>(value >> 16);
+        out[2] = static_cast<char>(value >> 8);
+        out[3] = static_cast<char>(value);
+    }
+
+    static uint32_t readUint32(const uint8_t* in) {
+        return uint32_t(in[0]) << 24 | uint32_t(in[1]) << 16 | uint32_t(in[2]) << 8 | in[3];
+    }
+
+    static void queueHttp2FrameHeader(Connection& conn, uint8_t type, uint8_t flags, uint32_t stream_id,
+                                      size_t length) {
+        char header[kHttp2FrameHeaderBytes];
+        header[0] = static_cast<char>(length >> 16);
+        header[1] = static_cast<char>(length >> 8);
+        header[2] = static_cast<char>(length);
+        header[3] = static_cast<char>(type);
+        header[4] = static_cast<char>(flags);
+        putUint32(header + 5, stream_id);
+        conn.queueData(std::string_view(header, sizeof(header)));
+    }
+
+    static void queueHttp2Frame(Connection& conn, uint8_t type, uint8_t flags, uint32_t stream_id,
+                                std::string_view payload) {
+        queueHttp2FrameHeader(conn, type, flags, stream_id, payload.size());
+        conn.queueData(payload);
+    }
+
+    static void queueRstStream(Connection& conn, uint32_t stream_id, Http2Error code) {
+        char payload[4];
+        putUint32(payload, code);
+        queueHttp2Frame(conn, Http2RstStream, 0, stream_id, std::string_view(payload, sizeof(payload)));
+    }
+
+    // Streams above last_stream_id are ignored from now on; the connection
+    // closes once the ones below it are answered
+    static void queueGoAway(Connection& conn, Http2Error code) {
+        Http2Session& session = *conn.http2;
+        char payload[8];
+        putUint32(payload, session.last_stream_id);
+        putUint32(payload + 4, code);
+        queueHttp2Frame(conn, Http2GoAway, 0, 0, std::string_view(payload, sizeof(payload)));
+        session.goaway_sent = true;
+    }
+
+    // Connection error (RFC 9113 5.4.1): GOAWAY, then close
+    static void failHttp2(Connection& conn, Http2Error code) {
+        if (conn.http2->failed) {
+            return;
+        }
+        queueGoAway(conn, code);
+        conn.http2->failed = true;
+        conn.close_after_write = true;
+        conn.linger_on_close = true;
+        conn.state = ConnectionState::Writing;
+    }
+
+    static Http2Stream* findStream(Connection& conn, uint32_t stream_id) {
+        if (!conn.http2) {
+            return nullptr;
+        }
+        auto it = conn.http2->streams.find(stream_id);
+        return it == conn.http2->streams.end() ? nullptr : it->second.get();
+    }
+
+    // A stream whose route is parked on onDrain(), or has bytes out of its
+    // head queued, waits on the client, not on a worker
+    static bool http2AwaitingWorker(const Connection& conn) {
+        if (!conn.http2) {
+            return false;
+        }
+        for (const auto& entry : conn.http2->streams) {
+            const Connection& responder = *entry.second->responder;
+            if (responder.awaiting_worker && !responder.route.drained &&
+                !(responder.route.head_sent && routeQueued(responder) > 0)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t inputLimit(const Connection& conn) const {
+        return conn.http2 ? std::max(max_header_bytes, kHttp2InputBytes) : max_header_bytes;
+    }
+
+    // Handles every complete frame in the receive buffer, then queues what
+    // the streams have ready to send
+    void processHttp2(EventLoop& loop, Connection& conn) {
+        Http2Session& session = *conn.http2;
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(conn.input.data());
+        size_t size = conn.input.size();
+        size_t consumed = 0;
+        if (!session.preface_received) {
+            size_t length = std::min(size, kHttp2Preface.size());
+            if (std::memcmp(data, kHttp2Preface.data(), length) != 0) {
+                conn.input.consume(size);
+                conn.state = ConnectionState::Closing; // not HTTP/2; there is no one to send GOAWAY to
+                return;
+            }
+            if (length < kHttp2Preface.size()) {
+                return;
+            }
+            session.preface_received = true;
+            consumed = kHttp2Preface.size();
+        }
+
+        while (!session.failed && size - consumed >= kHttp2FrameHeaderBytes) {
+            const uint8_t* frame = data + consumed;
+            size_t length = size_t(frame[0]) << 16 | size_t(frame[1]) << 8 | frame[2];
+            uint8_t type = frame[3];
+            uint8_t flags = frame[4];
+            uint32_t stream_id = readUint32(frame + 5) & 0x7fffffff;
+            if (length > kHttp2MaxFrameBytes) {
+                failHttp2(conn, Http2FrameSizeError);
+                break;
+            }
+            if (size - consumed < kHttp2FrameHeaderBytes + length) {
+                break;
+            }
+            if (!session.settings_received && type != Http2Settings) {
+                failHttp2(conn, Http2ProtocolError); // the client preface ends with SETTINGS
+                break;
+            }
+            handleHttp2Frame(loop, conn, type, flags, stream_id, frame + kHttp2FrameHeaderBytes, length);
+            consumed += kHttp2FrameHeaderBytes + length;
+            // Only a partly received frame is held to the head deadline
+            conn.head_deadline = 0;
+        }
+        conn.input.consume(session.failed ? size : consumed);
+
+        fillHttp2(loop, conn);
+        if (!conn.output.empty()) {
+            conn.state = ConnectionState::Writing;
+        }
+    }
+
+    void handleHttp2Frame(EventLoop& loop, Connection& conn, uint8_t type, uint8_t flags, uint32_t stream_id,
+                          const uint8_t* payload, size_t length) {
+        Http2Session& session = *conn.http2;
+        if (session.header_stream != 0 && (type != Http2Continuation || stream_id != session.header_stream)) {
+            failHttp2(conn, Http2ProtocolError); // a header block is not interleaved with anything (6.10)
+            return;
+        }
+        switch (type) {
+        case Http2Data: {
+            if (stream_id == 0 || stream_id > session.last_stream_id) {
+                failHttp2(conn, Http2ProtocolError);
+                return;
+            }
+            if ((flags & Http2Padded) && (length == 0 || payload[0] >= length)) {
+                failHttp2(conn, Http2ProtocolError);
+                return;
+            }
+            // Request bodies are discarded; the connection window is given
+            // back in batches and each stream's window covers whatever a
+            // GET-only server lets a client send before its response
+            session.unacknowledged_bytes += length;
+            if (session.unacknowledged_bytes >= kHttp2DefaultWindow / 2) {
+                char increment[4];
+                putUint32(increment, static_cast<uint32_t>(session.unacknowledged_bytes));
+                queueHttp2Frame(conn, Http2WindowUpdate, 0, 0, std::string_view(increment, sizeof(increment)));
+                session.unacknowledged_bytes = 0;
+            }
+            Http2Stream* stream = findStream(conn, stream_id);
+            if (stream != nullptr && (flags & Http2EndStream)) {
+                stream->remote_closed = true;
+            }
+            return; // frames on streams already closed are dropped
+        }
+        case Http2Headers: {
+            if (stream_id == 0 || stream_id % 2 == 0) {
+                failHttp2(conn, Http2ProtocolError);
+                return;
+            }
+            size_t offset = 0;
+            size_t padding = 0;
+            if (flags & Http2Padded) {
+                if (length == 0) {
+                    failHttp2(conn, Http2ProtocolError);
+                    return;
+                }
+                padding = payload[0];
+                offset = 1;
+            }
+            if (flags & Http2PriorityFlag) {
+                offset += 5; // RFC 7540 priorities; superseded by the priority header
+            }
+            if (offset + padding > length) {
+                failHttp2(conn, Http2ProtocolError);
+                return;
+            }
+            session.header_stream = stream_id;
+            session.header_end_stream = flags & Http2EndStream;
+            session.header_block.assign(reinterpret_cast<const char*>(payload) + offset, length - offset - padding);
+            if (flags & Http2EndHeaders) {
+                finishHeaderBlock(loop, conn);
+            }
+            return;
+        }
+        case Http2Continuation:
+            if (session.header_stream == 0 || stream_id != session.header_stream) {
+                failHttp2(conn, Http2ProtocolError);
+                return;
+            }
+            session.header_block.append(reinterpret_cast<const char*>(payload), length);
+            if (session.header_block.size() > 2 * max_header_bytes) {
+                failHttp2(conn, Http2EnhanceYourCalm); // the decoded list can only be larger
+                return;
+            }
+            if (flags & Http2EndHeaders) {
+                finishHeaderBlock(loop, conn);
+            }
+            return;
+        case Http2Priority:
+            if (stream_id == 0) {
+                failHttp2(conn, Http2ProtocolError);
+            } else if (length != 5) {
+                queueRstStream(conn, stream_id, Http2FrameSizeError);
+                closeStream(loop, conn, stream_id);
+            }
+            return;
+        case Http2RstStream:
+            if (stream_id == 0 || stream_id > session.last_stream_id) {
+                failHttp2(conn, Http2ProtocolError);
+            } else if (length != 4) {
+                failHttp2(conn, Http2FrameSizeError);
+            } else {
+                closeStream(loop, conn, stream_id);
+            }
+            return;
+        case Http2Settings:
+            handleSettings(loop, conn, flags, stream_id, payload, length);
+            return;
+        case Http2PushPromise:
+            failHttp2(conn, Http2ProtocolError); // clients never push
+            return;
+        case Http2Ping:
+            if (stream_id != 0) {
+                failHttp2(conn, Http2ProtocolError);
+            } else if (length != 8) {
+                failHttp2(conn, Http2FrameSizeError);
+            } else if (!(flags & Http2Ack)) {
+                queueHttp2Frame(conn, Http2Ping, Http2Ack, 0, std::string_view(reinterpret_cast<const char*>(payload), 8));
+            }
+            return;
+        case Http2GoAway:
+            if (stream_id != 0) {
+                failHttp2(conn, Http2ProtocolError);
+            } else if (!session.goaway_sent) {
+                queueGoAway(conn, Http2NoError); // finish what was asked, then close
+            }
+            return;
+        case Http2WindowUpdate: {
+            if (length != 4) {
+                failHttp2(conn, Http2FrameSizeError);
+                return;
+            }
+            int64_t increment = readUint32(payload) & 0x7fffffff;
+            if (stream_id == 0) {
+                if (increment == 0) {
+                    failHttp2(conn, Http2ProtocolError);
+                } else if ((session.send_window += increment) > kHttp2MaxWindow) {
+                    failHttp2(conn, Http2FlowControlError);
+                }
+                return;
+            }
+            Http2Stream* stream = findStream(conn, stream_id);
+            if (stream == nullptr) {
+                return;
+            }
+            if (increment == 0 || (stream->send_window += increment) > kHttp2MaxWindow) {
+                queueRstStream(conn, stream_id, increment == 0 ? Http2ProtocolError : Http2FlowControlError);
+                closeStream(loop, conn, stream_id);
+                return;
+            }
+            scheduleStream(session, *stream);
+            return;
+        }
+        case Http2PriorityUpdate: {
+            if (stream_id != 0) {
+                failHttp2(conn, Http2ProtocolError);
+                return;
+            }
+            if (length < 4) {
+                failHttp2(conn, Http2FrameSizeError);
+                return;
+            }
+            Http2Stream* stream = findStream(conn, readUint32(payload) & 0x7fffffff);
+            if (stream == nullptr) {
+                return; // streams not yet open keep the priority their request carries
+            }
+            uint8_t urgency = stream->urgency;
+            parsePriority(std::string_view(reinterpret_cast<const char*>(payload) + 4, length - 4), stream->urgency,
+                          stream->incremental);
+            if (stream->scheduled && stream->urgency != urgency) {
+                session.ready[stream->urgency].push_back(stream->id);
+            }
+            return;
+        }
+        default:
+            return; // unknown types are ignored (5.5)
+        }
+    }
+
+    void handleSettings(EventLoop& loop, Connection& conn, uint8_t flags, uint32_t stream_id, const uint8_t* payload,
+                        size_t length) {
+        Http2Session& session = *conn.http2;
+        if (stream_id != 0) {
+            failHttp2(conn, Http2ProtocolError);
+            return;
+        }
+        if (flags & Http2Ack) {
+            if (length != 0) {
+                failHttp2(conn, Http2FrameSizeError);
+            }
+            return;
+        }
+        if (length % 6 != 0) {
+            failHttp2(conn, Http2FrameSizeError);
+            return;
+        }
+        for (size_t offset = 0; offset < length; offset += 6) {
+            uint16_t identifier = uint16_t(payload[offset]) << 8 | payload[offset + 1];
+            uint32_t value = readUint32(payload + offset + 2);
+            switch (identifier) {
+            case 0x1: // SETTINGS_HEADER_TABLE_SIZE
+                session.encoder.setPeerLimit(value);
+                break;
+            case 0x2: // SETTINGS_ENABLE_PUSH
+                if (value > 1) {
+                    failHttp2(conn, Http2ProtocolError);
+                    return;
+                }
+                break;
+            case 0x4: { // SETTINGS_INITIAL_WINDOW_SIZE applies to open streams too (6.9.2)
+                if (value > kHttp2MaxWindow) {
+                    failHttp2(conn, Http2FlowControlError);
+                    return;
+                }
+                int64_t delta = int64_t(value) - session.initial_window;
+                session.initial_window = value;
+                for (auto& entry : session.streams) {
+                    Http2Stream& stream = *entry.second;
+                    if ((stream.send_window += delta) > kHttp2MaxWindow) {
+                        failHttp2(conn, Http2FlowControlError);
+                        return;
+                    }
+                    scheduleStream(session, stream);
+                }
+                break;
+            }
+            case 0x5: // SETTINGS_MAX_FRAME_SIZE; frames we send stay at the minimum
+                if (value < kHttp2MaxFrameBytes || value > 0xffffff) {
+                    failHttp2(conn, Http2ProtocolError);
+                    return;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        session.settings_received = true;
+        queueHttp2Frame(conn, Http2Settings, Http2Ack, 0, std::string_view());
+    }
+
+    // A complete header block: a new request, or trailers that end one
+    void finishHeaderBlock(EventLoop& loop, Connection& conn) {
+        Http2Session& session = *conn.http2;
+        uint32_t stream_id = session.header_stream;
+        session.header_stream = 0;
+        // Decoded even for streams that are refused, or the tables diverge
+        if (!session.decoder.decode(reinterpret_cast<const uint8_t*>(session.header_block.data()),
+                                    session.header_block.size(), session.fields, max_header_bytes,
+                                    session.fields_oversized)) {
+            failHttp2(conn, Http2CompressionError);
+            return;
+        }
+        if (Http2Stream* stream = findStream(conn, stream_id)) {
+            if (stream->remote_closed || !session.header_end_stream) {
+                queueRstStream(conn, stream_id, stream->remote_closed ? Http2StreamClosed : Http2ProtocolError);
+                closeStream(loop, conn, stream_id);
+            } else {
+                stream->remote_closed = true;
+            }
+            return;
+        }
+        if (stream_id <= session.last_stream_id) {
+            queueRstStream(conn, stream_id, Http2StreamClosed);
+            return;
+        }
+        if (session.goaway_sent) {
+            return; // above the GOAWAY's last stream; the client retries elsewhere
+        }
+        session.last_stream_id = stream_id;
+        if (session.streams.size() >= kHttp2MaxStreams) {
+            queueRstStream(conn, stream_id, Http2RefusedStream);
+            return;
+        }
+        openStream(loop, conn, stream_id);
+    }
+
+    // Validates the request's fields (RFC 9113 8.3.1, 8.2) and renders them
+    // as an HTTP/1.1 head for the parser and the handlers
+    static bool renderRequest(const std::vector<HpackField>& fields, std::string& request, uint8_t& urgency,
+                              bool& incremental) {
+        std::string_view method, scheme, authority, path;
+        bool regular_seen = false;
+        std::string lines;
+        for (const HpackField& field : fields) {
+            std::string_view name = field.name;
+            std::string_view value = field.value;
+            if (value.find_first_of(std::string_view("\r\n\0", 3)) != std::string_view::npos) {
+                return false;
+            }
+            if (!name.empty() && name[0] == ':') {
+                std::string_view* pseudo = name == ":method"      ? &method
+                                           : name == ":scheme"    ? &scheme
+                                           : name == ":authority" ? &authority
+                                           : name == ":path"      ? &path
+                                                                  : nullptr;
+                if (regular_seen || pseudo == nullptr || !pseudo->empty() || value.empty()) {
+                    return false;
+                }
+                *pseudo = value;
+                continue;
+            }
+            regular_seen = true;
+            if (name.empty() || std::any_of(name.begin(), name.end(), [](char c) { return c >= 'A' && c <= 'Z'; }) ||
+                name.find_first_of(std::string_view(":\r\n\0 ", 5)) != std::string_view::npos ||
+                isConnectionSpecificHeader(name) || (name == "te" && value != "trailers")) {
+                return false;
+            }
+            if (name == "priority") {
+                parsePriority(value, urgency, incremental);
+            }
+            if (name == "host" && !authority.empty()) {
+                continue;
+            }
+            lines += name;
+            lines += ": ";
+            lines += value;
+            lines += "\r\n";
+        }
+        if (method.empty() || scheme.empty() || path.empty()) {
+            return false; // CONNECT, the one request without them, is not served
+        }
+        request.clear();
+        request.reserve(method.size() + path.size() + authority.size() + lines.size() + 24);
+        request += method;
+        request += ' ';
+        request += path;
+        request += " HTTP/1.1\r\n";
+        if (!authority.empty()) {
+            request += "Host: ";
+            request += authority;
+            request += "\r\n";
+        }
+        request += lines;
+        request += "\r\n";
+        return true;
+    }
+
+    // A stream's responder is recycled like any connection. It carries the
+    // parent's fd and id so a worker completion finds the parent, and the
+    // stream id to find the stream there.
+    std::unique_ptr<Connection> acquireResponder(EventLoop& loop, const Connection& parent, uint32_t stream_id) {
+        std::unique_ptr<Connection> responder;
+        if (loop.spare_connections.empty()) {
+            responder = std::make_unique<Connection>(parent.fd, max_header_bytes, loop.buffer_pool);
+        } else {
+            responder = std::move(loop.spare_connections.back());
+            loop.spare_connections.pop_back();
+            responder->reset(parent.fd);
+        }
+        responder->id = parent.id;
+        responder->stream_id = stream_id;
+        responder->metrics = &loop.metrics;
+        responder->access_log = parent.access_log;
+        responder->peer_address = parent.peer_address;
+        responder->trace = parent.trace;
+        return responder;
+    }
+
+    void openStream(EventLoop& loop, Connection& conn, uint32_t stream_id) {
+        Http2Session& session = *conn.http2;
+        auto owned = std::make_unique<Http2Stream>();
+        Http2Stream& stream = *owned;
+        stream.id = stream_id;
+        stream.send_window = session.initial_window;
+        stream.remote_closed = session.header_end_stream;
+        bool oversized = session.fields_oversized;
+        if (!oversized && !renderRequest(session.fields, stream.request, stream.urgency, stream.incremental)) {
+            queueRstStream(conn, stream_id, Http2ProtocolError); // malformed (8.1.1)
+            return;
+        }
+        stream.responder = acquireResponder(loop, conn, stream_id);
+        session.streams.emplace(stream_id, std::move(owned));
+        bump(loop.metrics.http2_streams);
+        conn.requests_served++;
+        conn.head_deadline = 0;
+
+        Connection& responder = *stream.responder;
+        responder.request_received_at = conn.received_at;
+        auto parse_started = std::chrono::steady_clock::now();
+        auto status = oversized ? RequestParser::Status::Error
+                                : responder.parser.parse(stream.request.data(), stream.request.size());
+        auto parsed_at = std::chrono::steady_clock::now();
+        if (status != RequestParser::Status::Complete) {
+            int code = oversized ? 431 : responder.parser.errorStatus();
+            sendError(responder, code == 431 ? 431 : 400, code == 431 ? "Request Header Fields Too Large" : "Bad Request");
+        } else {
+            loop.metrics.parse.record(parsed_at - parse_started);
+            if (loop.trace) {
+                loop.trace->record(TraceParse, conn.id, TraceBuffer::nanos(parse_started), TraceBuffer::nanos(parsed_at));
+            }
+            responder.handle_started_at = parsed_at;
+            if (responder.access_log != nullptr) {
+                responder.beginLog(responder.parser);
+            }
+            routeRequest(loop, responder, responder.parser);
+            if (!responder.awaiting_worker) {
+                loop.metrics.handle.record(std::chrono::steady_clock::now() - parsed_at);
+            }
+        }
+        advanceStream(loop, conn, stream);
+        if (max_keepalive_requests > 0 && conn.requests_served >= max_keepalive_requests && !session.goaway_sent) {
+            queueGoAway(conn, Http2NoError);
+        }
+    }
+
+    // After a handler ran for the stream, or a continuation of one: a head
+    // already queued goes out even while a worker still produces the rest
+    // (a streamed route response), and more of a body ready stream is
+    // scheduled. A route that failed part way resets the stream.
+    void advanceStream(EventLoop& loop, Connection& conn, Http2Stream& stream) {
+        Connection& responder = *stream.responder;
+        if (responder.route.aborted) {
+            queueRstStream(conn, stream.id, Http2InternalError);
+            closeStream(loop, conn, stream.id);
+        } else if (stream.response_ready) {
+            scheduleStream(*conn.http2, stream);
+        } else if (!responder.awaiting_worker || responder.route.head_sent) {
+            http2ResponseReady(conn, stream);
+        }
+    }
+
+    // Takes the head off the response the handler queued on the stream's
+    // responder and schedules the stream; what is left there is the body
+    static void http2ResponseReady(Connection& conn, Http2Stream& stream) {
+        Connection& responder = *stream.responder;
+        std::string& head = stream.response_head;
+        head.clear();
+        while (!responder.output.empty() && !responder.output.front().isFile()) {
+            OutputSegment& segment = responder.output.front();
+            size_t before = head.size();
+            head.append(segment.bytes() + segment.data_offset, segment.size() - segment.data_offset);
+            size_t end = head.find("\r\n\r\n", before < 3 ? 0 : before - 3);
+            if (end != std::string::npos) {
+                segment.data_offset += end + 4 - before;
+                responder.bytes_written += end + 4;
+                head.resize(end + 2);
+                if (segment.data_offset == segment.size()) {
+                    responder.popOutput();
+                }
+                break;
+            }
+            responder.popOutput();
+        }
+        stream.response_ready = true;
+        scheduleStream(*conn.http2, stream);
+    }
+
+    static void scheduleStream(Http2Session& session, Http2Stream& stream) {
+        if (stream.response_ready && !stream.scheduled) {
+            stream.scheduled = true;
+            session.ready[stream.urgency].push_back(stream.id);
+        }
+    }
+
+    void closeStream(EventLoop& loop, Connection& conn, uint32_t stream_id) {
+        auto& streams = conn.http2->streams;
+        auto it = streams.find(stream_id);
+        if (it == streams.end()) {
+            return;
+        }
+        // A worker still loading for it finds the stream gone
+        releaseConnection(loop, std::move(it->second->responder));
+        streams.erase(it);
+    }
+
+    // Queues frames of the ready streams, most urgent first, until about a
+    // socket buffer's worth is outstanding or flow control stops them.
+    // Returns whether anything was queued.
+    bool fillHttp2(EventLoop& loop, Connection& conn) {
+        constexpr uint64_t kWriteBudget = 256 * 1024;
+        Http2Session& session = *conn.http2;
+        bool queued = false;
+        int urgency = 0;
+        while (!session.failed && urgency < 8 && conn.bytes_queued - conn.bytes_written < kWriteBudget) {
+            std::deque<uint32_t>& ready = session.ready[urgency];
+            if (ready.empty()) {
+                urgency++;
+                continue;
+            }
+            Http2Stream* stream = findStream(conn, ready.front());
+            if (stream == nullptr || !stream->scheduled || stream->urgency != urgency) {
+                ready.pop_front();
+                continue;
+            }
+            Connection& responder = *stream->responder;
+            if (stream->headers_sent && responder.output.empty() && responder.response_open) {
+                // A streamed body caught up with its route; the next write
+                // or the end schedules the stream again
+                stream->scheduled = false;
+                ready.pop_front();
+                continue;
+            }
+            if (!stream->headers_sent) {
+                responder.handOverFirstByte(conn);
+                queueResponseHeaders(conn, *stream, responder.output.empty() && !responder.response_open);
+                stream->headers_sent = true;
+                queued = true;
+            } else {
+                int64_t window = std::min(session.send_window, stream->send_window);
+                if (window <= 0 && !responder.output.empty()) {
+                    if (session.send_window <= 0) {
+                        break; // everything waits for a WINDOW_UPDATE of the connection
+                    }
+                    stream->scheduled = false; // until its own WINDOW_UPDATE
+                    ready.pop_front();
+                    continue;
+                }
+                size_t sent = queueDataFrame(conn, responder, std::min<int64_t>(window, kHttp2MaxFrameBytes));
+                session.send_window -= sent;
+                stream->send_window -= sent;
+                queued = true;
+                notifyDrained(loop, responder);
+            }
+            if (responder.output.empty() && !responder.response_open) {
+                // END_STREAM is out; a client still sending learns it can stop
+                ready.pop_front();
+                if (!stream->remote_closed) {
+                    queueRstStream(conn, stream->id, Http2NoError);
+                }
+                closeStream(loop, conn, stream->id);
+            } else if (stream->incremental && stream->headers_sent) {
+                ready.pop_front();
+                ready.push_back(stream->id);
+            }
+        }
+        return queued;
+    }
+
+    // Lowercased, connection-specific headers dropped, through HPACK into
+    // HEADERS and as many CONTINUATION frames as it takes
+    static void queueResponseHeaders(Connection& conn, Http2Stream& stream, bool end_stream) {
+        Http2Session& session = *conn.http2;
+        std::string& block = session.scratch;
+        std::string& name = session.name;
+        block.clear();
+        session.encoder.beginBlock(block);
+        std::string_view head = stream.response_head;
+        size_t line_end = head.find("\r\n");
+        std::string_view status_line = head.substr(0, line_end);
+        session.encoder.encode(block, ":status", status_line.substr(9, 3), false);
+        head.remove_prefix(line_end == std::string_view::npos ? head.size() : line_end + 2);
+        while (!head.empty()) {
+            line_end = head.find("\r\n");
+            std::string_view line = head.substr(0, line_end);
+            head.remove_prefix(line_end == std::string_view::npos ? head.size() : line_end + 2);
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos) {
+                continue;
+            }
+            name.assign(line.substr(0, colon));
+            std::transform(name.begin(), name.end(), name.begin(),
+                           [](char c) { return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c; });
+            std::string_view value = line.substr(colon + 1);
+            while (!value.empty() && value.front() == ' ') {
+                value.remove_prefix(1);
+            }
+            if (isConnectionSpecificHeader(name)) {
+                continue;
+            }
+            // Fields that repeat across responses go in the dynamic table;
+            // per-response ones would only push those out
+            bool indexing = name == "content-type" || name == "server" || name == "cache-control" ||
+                            name == "vary" || name == "accept-ranges" || name == "content-encoding" || name == "date";
+            session.encoder.encode(block, name, value, indexing);
+        }
+
+        size_t offset = 0;
+        do {
+            size_t length = std::min(block.size() - offset, kHttp2MaxFrameBytes);
+            uint8_t flags = offset + length == block.size() ? Http2EndHeaders : 0;
+            if (offset == 0 && end_stream) {
+                flags |= Http2EndStream;
+            }
+            queueHttp2Frame(conn, offset == 0 ? Http2Headers : Http2Continuation, flags, stream.id,
+                            std::string_view(block).substr(offset, length));
+            offset += length;
+        } while (offset < block.size());
+    }
+
+    // Moves up to max_bytes of the responder's body into one DATA frame:
+    // arena bytes are copied, cached bytes and file ranges are referenced
+    static size_t queueDataFrame(Connection& conn, Connection& responder, size_t max_bytes) {
+        size_t length = 0;
+        for (size_t i = 0; i < responder.output.size() && length < max_bytes; i++) {
+            const OutputSegment& segment = responder.output[i];
+            size_t remaining = segment.isFile() ? segment.file_remaining : segment.size() - segment.data_offset;
+            length += std::min(remaining, max_bytes - length);
+        }
+        uint64_t body_left = 0;
+        for (size_t i = 0; i < responder.output.size() && body_left <= length; i++) {
+            const OutputSegment& segment = responder.output[i];
+            body_left += segment.isFile() ? segment.file_remaining : segment.size() - segment.data_offset;
+        }
+        bool end = body_left == length && !responder.response_open;
+        queueHttp2FrameHeader(conn, Http2Data, end ? Http2EndStream : 0, responder.stream_id, length);
+        responder.bytes_written += length;
+
+        size_t left = length;
+        while (left > 0) {
+            OutputSegment& segment = responder.output.front();
+            if (segment.isFile()) {
+                size_t take = std::min(segment.file_remaining, left);
+                if (!segment.file_owner) {
+                    segment.file_owner = std::make_shared<const SharedFile>(segment.file_fd);
+                }
+                conn.queueSharedFile(segment.file_owner, segment.file_offset, take);
+                segment.file_offset += take;
+                segment.file_remaining -= take;
+                left -= take;
+                if (segment.file_remaining == 0) {
+                    responder.popOutput();
+                }
+                continue;
+            }
+            size_t take = std::min(segment.size() - segment.data_offset, left);
+            if (segment.shared) {
+                conn.queueShared(segment.shared, segment.bytes() + segment.data_offset, take);
+            } else {
+                conn.queueData(std::string_view(segment.bytes() + segment.data_offset, take));
+            }
+            segment.data_offset += take;
+            left -= take;
+            if (segment.data_offset == segment.size()) {
+                responder.popOutput();
+            }
+        }
+        return length;
+    }
+
+    // GOAWAY once the loop drains, and the close once every stream it
+    // still answers is done. Returns true when it moved the connection on.
+    bool settleHttp2(EventLoop& loop, Connection& conn) {
+        Http2Session& session = *conn.http2;
+        if (conn.peer_closed || session.failed) {
+            return false;
+        }
+        if (loop.draining && !session.goaway_sent) {
+            queueGoAway(conn, Http2NoError);
+            conn.state = ConnectionState::Writing;
+            return true;
+        }
+        if (session.goaway_sent && session.streams.empty()) {
+            closeGently(conn);
+            return true;
+        }
+        return false;
+    }
+
+    void closeConnection(EventLoop& loop, Connection& conn) {
+        int fd = conn.fd;
+        finishTls(conn);
+#ifdef HTTP_HAVE_TLS
+        SSL_free(conn.tls);
+        conn.tls = nullptr;
+#endif
+        if (conn.http2) {
+            for (auto& entry : conn.http2->streams) {
+                releaseConnection(loop, std::move(entry.second->responder));
+            }
+            conn.http2.reset();
+        }
+        conn.input.discard(loop.buffer_pool);
+        bump(loop.metrics.connections_closed);
+        loop.timers.cancel(conn.timer);
+        if (io_backend == IoBackend::Uring) {
+            // Operations still in flight reference conn; it stays retired
+            // until their completions have arrived
+            conn.uring.closed = true;
+            if (conn.uring.recv_armed) {
+                cancelUringOp(loop, &conn, UringRecv);
+            }
+            if (conn.uring.send_inflight) {
+                cancelUringOp(loop, &conn, UringSend);
+            }
+            if (conn.uring.poll_inflight) {
+                cancelUringOp(loop, &conn, UringPoll);
+            }
+        } else {
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+            if (!conn.zerocopy_holds.empty()) {
+                reapZeroCopy(conn);
+                auto now = std::chrono::steady_clock::now();
+                for (auto& hold : conn.zerocopy_holds) {
+                    loop.zerocopy_orphans.emplace_back(now, std::move(hold.bytes));
+                }
+                conn.zerocopy_holds.clear();
+            }
+        }
+        close(fd);
+        conn.fd = -1;
+        auto it = loop.connections.find(fd);
+        loop.retired.push_back(std::move(it->second));
+        loop.connections.erase(it);
+        if (loop.accept_paused) {
+            resumeAccepting(loop);
+        }
+    }
+
+    void handleRequest(EventLoop& loop, Connection& conn, const RequestParser& request) {
+        std::string_view protocol = request.version();
+        std::string_view connection_header = request.header("Connection");
+
+        // HTTP/1.1 defaults to keep-alive, HTTP/1.0 has to ask for it
+        bool keep_alive = protocol == "HTTP/1.1" ? !RequestParser::equalsIgnoreCase(connection_header, "close")
+                                                 : RequestParser::equalsIgnoreCase(connection_header, "keep-alive");
+        conn.requests_served++;
+        if (!keep_alive || keepalive_timeout <= 0 || draining.load(std::memory_order_relaxed) ||
+            (max_keepalive_requests > 0 && conn.requests_served >= max_keepalive_requests)) {
+            conn.close_after_write = true;
+        }
+        routeRequest(loop, conn, request);
+    }
+
+    // Shared by HTTP/1.1 connections and HTTP/2 streams
+    void routeRequest(EventLoop& loop, Connection& conn, const RequestParser& request) {
+        TraceSpan span(loop.trace.get(), TraceHandle, conn.id);
+        if (router && dispatchRoute(loop, conn, request)) {
+            return;
+        }
+        if (request.method() == "GET") {
+            handleGetRequest(loop, conn, request);
+        } else {
+            // Method not supported
+            conn.startResponse(405);
+            conn.queueData("HTTP/1.1 405 Method Not Allowed\r\n"
+                           "Content-Type: text/plain\r\n"
+                           "Content-Length: 21\r\n");
+            conn.queueData(connectionHeader(conn));
+            conn.queueData("\r\n");
+            conn.headQueued();
+            conn.queueData("Method Not Supported\n");
+        }
+    }
+
+    std::string_view connectionHeader(const Connection& conn) const {
+        if (conn.close_after_write) {
+            return "Connection: close\r\n";
+        }
+        return keepalive_header;
+    }
+
+    // Answers from the application's routes: the static table, then the
+    // tree. Returns false when no route has the path, leaving the request
+    // to the metrics endpoint and the files.
+    bool dispatchRoute(EventLoop& loop, Connection& conn, const RequestParser& parsed) {
+        TraceSpan span(loop.trace.get(), TraceRoute, conn.id);
+        Request request(parsed);
+        Connection::RouteState& route = conn.route;
+        route.id = ++conn.route_sequence;
+        route.status = 200;
+        route.headers.clear();
+        route.pending = 0;
+        route.drained = nullptr;
+        route.head_sent = false;
+        route.chunkable = parsed.version() == "HTTP/1.1";
+        route.chunked = false;
+        route.aborted = false;
+        conn.response_open = true;
+        ResponseWriter writer(this, loop.index, conn.fd, conn.id, conn.stream_id, route.id);
+        return runRoute(conn, [&] {
+            if (router->dispatchStatic(request, writer)) {
+                return true;
+            }
+            const RouteHandler* handler = nullptr;
+            std::string allowed;
+            switch (router->find(request, handler, allowed)) {
+            case Router::Lookup::Found:
+                (*handler)(request, writer);
+                return true;
+            case Router::Lookup::WrongMethod:
+                writer.status(405).header("Allow", allowed).header("Content-Type", "text/plain");
+                writer.end("Method Not Supported\n");
+                return true;
+            case Router::Lookup::None:
+                break;
+            }
+            return false;
+        });
+    }
+
+    // Runs a handler or continuation, which returns whether it took the
+    // request. A response it leaves open with nothing deferred is ended;
+    // one with continuations pending holds the connection as a worker does.
+    template <typename Body>
+    bool runRoute(Connection& conn, Body&& body) {
+        bool handled = true;
+        try {
+            handled = body();
+        } catch (const std::exception& e) {
+            std::cerr << "Route handler failed: " << e.what() << std::endl;
+            failRoute(conn, 500);
+        } catch (...) {
+            std::cerr << "Route handler failed" << std::endl;
+            failRoute(conn, 500);
+        }
+        if (!handled) {
+            conn.response_open = false;
+            return false;
+        }
+        if (conn.response_open && conn.route.pending == 0) {
+            endRoute(conn, {});
+        }
+        conn.awaiting_worker = conn.response_open;
+        return true;
+    }
+
+    // The connection, or HTTP/2 stream's responder, whose open response
+    // writer names; parent is the socket's connection
+    Connection* routeTarget(const ResponseWriter& writer, Connection** parent = nullptr) {
+        EventLoop& loop = *loops[writer.loop];
+        auto it = loop.connections.find(writer.fd);
+        if (it == loop.connections.end() || it->second->id != writer.id) {
+            return nullptr;
+        }
+        Connection* conn = it->second.get();
+        if (parent != nullptr) {
+            *parent = conn;
+        }
+        if (writer.stream_id != 0) {
+            Http2Stream* stream = findStream(*conn, writer.stream_id);
+            if (stream == nullptr) {
+                return nullptr;
+            }
+            conn = stream->responder.get();
+        }
+        return conn->response_open && conn->route.id == writer.route ? conn : nullptr;
+    }
+
+    void queueRouteHead(Connection& conn, bool streamed, size_t length) {
+        Connection::RouteState& route = conn.route;
+        route.head_sent = true;
+        if (streamed && conn.stream_id == 0) {
+            if (route.chunkable) {
+                route.chunked = true;
+            } else {
+                conn.close_after_write = true; // HTTP/1.0: the close ends the body
+            }
+        }
+        char code_buffer[16];
+        std::string_view code(code_buffer, std::to_chars(code_buffer, code_buffer + sizeof(code_buffer),
+                                                         route.status).ptr - code_buffer);
+        conn.startResponse(route.status);
+        conn.queueData("HTTP/1.1 ");
+        conn.queueData(code);
+        conn.queueData(" ");
+        conn.queueData(reasonPhrase(route.status));
+        conn.queueData("\r\n");
+        conn.queueData(route.headers);
+        if (route.chunked) {
+            conn.queueData("Transfer-Encoding: chunked\r\n");
+        } else if (!streamed && route.status != 204 && route.status != 304) {
+            conn.queueData("Content-Length: ");
+            queueNumber(conn, length);
+            conn.queueData("\r\n");
+        }
+        conn.queueData("Server: CPP-HTTP-Server/1.0\r\n");
+        queueTrailer(conn);
+    }
+
+    void writeRoute(Connection& conn, std::string_view bytes) {
+        if (bytes.empty()) {
+            return; // an empty chunk would end the body
+        }
+        if (!conn.route.head_sent) {
+            queueRouteHead(conn, true, 0);
+        }
+        if (conn.route.chunked) {
+            char size_buffer[24];
+            size_t size_length = std::to_chars(size_buffer, size_buffer + sizeof(size_buffer) - 2, bytes.size(),
+                                               16).ptr - size_buffer;
+            size_buffer[size_length++] = '\r';
+            size_buffer[size_length++] = '\n';
+            conn.queueData(std::string_view(size_buffer, size_length));
+            conn.queueData(bytes);
+            conn.queueData("\r\n");
+        } else {
+            conn.queueData(bytes);
+        }
+    }
+
+    void endRoute(Connection& conn, std::string_view bytes) {
+        if (!conn.route.head_sent) {
+            queueRouteHead(conn, false, bytes.size());
+            conn.queueData(bytes);
+        } else {
+            writeRoute(conn, bytes);
+            if (conn.route.chunked) {
+                conn.queueData("0\r\n\r\n");
+            }
+        }
+        conn.response_open = false;
+    }
+
+    // Before the head is sent the response becomes an error page; after,
+    // the client has to learn the body is incomplete: the connection or
+    // stream is closed without ending it
+    void failRoute(Connection& conn, int status) {
+        if (!conn.response_open) {
+            return;
+        }
+        if (!conn.route.head_sent) {
+            conn.route.head_sent = true;
+            sendError(conn, status, reasonPhrase(status));
+        } else if (conn.stream_id != 0) {
+            conn.route.aborted = true;
+        } else {
+            conn.close_after_write = true;
+        }
+        conn.response_open = false;
+    }
+
+    void deferRoute(const ResponseWriter& writer, std::function<void()> work,
+                    std::function<void(ResponseWriter&)> resume) {
+        Connection* conn = routeTarget(writer);
+        if (conn == nullptr) {
+            return;
+        }
+        EventLoop* owner = loops[writer.loop].get();
+        auto finish = [this, owner, writer, resume = std::move(resume)] { resumeRoute(*owner, writer, resume); };
+        if (!worker_pool) {
+            postCompletion(*owner, [work = std::move(work), finish = std::move(finish)] {
+                work();
+                finish();
+            });
+        } else if (!worker_pool->trySubmit([this, owner, work = std::move(work), finish]() mutable {
+                       work();
+                       postCompletion(*owner, std::move(finish));
+                   })) {
+            failRoute(*conn, 503);
+            return;
+        }
+        conn->route.pending++;
+    }
+
+    static size_t routeQueued(const Connection& conn) { return conn.bytes_queued - conn.bytes_written; }
+
+    void drainRoute(const ResponseWriter& writer, std::function<void(ResponseWriter&)> resume) {
+        Connection* conn = routeTarget(writer);
+        if (conn == nullptr) {
+            return;
+        }
+        if (!conn->route.drained) {
+            conn->route.pending++;
+        }
+        EventLoop* owner = loops[writer.loop].get();
+        conn->route.drained = [this, owner, writer, resume = std::move(resume)] {
+            resumeRoute(*owner, writer, resume);
+        };
+        notifyDrained(*owner, *conn);
+    }
+
+    // Posts the onDrain() continuation of conn's open response once its
+    // queue has run low
+    void notifyDrained(EventLoop& loop, Connection& conn) {
+        if (conn.route.drained && conn.response_open && routeQueued(conn) <= ResponseWriter::kLowWater) {
+            std::function<void()> drained = std::move(conn.route.drained);
+            conn.route.drained = nullptr;
+            postCompletion(loop, std::move(drained));
+        }
+    }
+
+    // A defer() or onDrain() continuation, on the loop. Those of responses
+    // whose client has gone are dropped.
+    void resumeRoute(EventLoop& loop, ResponseWriter writer, const std::function<void(ResponseWriter&)>& resume) {
+        Connection* parent = nullptr;
+        Connection* conn = routeTarget(writer, &parent);
+        if (conn == nullptr) {
+            return;
+        }
+        conn->route.pending--;
+        TraceSpan span(loop.trace.get(), TraceRoute, writer.id);
+        runRoute(*conn, [&] {
+            resume(writer);
+            return true;
+        });
+        span.finish();
+        if (!conn->response_open) {
+            loop.metrics.handle.record(std::chrono::steady_clock::now() - conn->handle_started_at);
+        }
+        if (writer.stream_id != 0) {
+            advanceStream(loop, *parent, *findStream(*parent, writer.stream_id));
+            if (parent->state == ConnectionState::Reading) {
+                parent->state = ConnectionState::Writing;
+            }
+        } else {
+            parent->state = ConnectionState::Writing;
+        }
+        driveConnection(loop, *parent);
+    }
+
+    static std::string_view reasonPhrase(int status) {
+        switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 410: return "Gone";
+        case 413: return "Content Too Large";
+        case 415: return "Unsupported Media Type";
+        case 422: return "Unprocessable Content";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default: return status < 400 ? "OK" : status < 500 ? "Client Error" : "Server Error";
+        }
+    }
+
+    void handleGetRequest(EventLoop& loop, Connection& conn, const RequestParser& request) {
+        if (!metrics_path.empty()) {
+            std::string_view target = request.target();
+            if (target.substr(0, target.find('?')) == metrics_path) {
+                sendMetrics(conn);
+                return;
+            }
+        }
+
+        TraceSpan resolving(loop.trace.get(), TraceResolve, conn.id);
+        std::string_view accept_encoding = request.header("Accept-Encoding");
+        RequestConditions conditions{request.header("If-None-Match"), request.header("If-Modified-Since"),
+                                     request.header("Range"), request.header("If-Range")};
+
+        // Resolve the target lexically; the loop's scratch strings keep
+        // their capacity, so this does not allocate once warmed up
+        std::string& path = loop.request_path;
+        int status = normalizeRequestPath(request.target(), path);
+        if (status != 0) {
+            sendError(conn, status, "Bad Request");
+            return;
+        }
+        bool directory_target = path.back() == '/';
+        if (directory_target) {
+            path += "index.html";
+        }
+        const std::string& resolved = path;
+
+        const TreeSnapshot* tree = metadata_snapshot ? snapshot.refresh(loop.snapshot) : nullptr;
+        const TreeSnapshot::Node* node = nullptr;
+        TreeSnapshot::Lookup presence = tree ? tree->resolve(resolved, node) : TreeSnapshot::Lookup::Unknown;
+        bool known_file = presence == TreeSnapshot::Lookup::Found && node->kind == TreeSnapshot::File;
+
+        // Responses for compressible types differ by the accepted codings,
+        // so each accepted set is its own cache entry
+        unsigned encodings = 0;
+        if (compression && !accept_encoding.empty() &&
+            isCompressibleType(known_file ? tree->mimeType(*node) : getMimeType(resolved))) {
+            encodings = acceptedEncodings(accept_encoding);
+        }
+
+        // Paths the bundle holds are answered from it; the rest fall through
+        // to the caches and the disk
+        if (!bundle_path.empty()) {
+            const AssetBundle* mounted = refreshBundle(loop);
+            if (const AssetBundle::Asset* asset = mounted ? mounted->find(path) : nullptr) {
+                bump(loop.metrics.bundle_hits);
+                queueBundleAsset(conn, *mounted, loop.bundle_owner, *asset, encodings, conditions);
+                return;
+            }
+        }
+
+        // What the snapshot knows is answered on the loop, without a worker
+        if (presence == TreeSnapshot::Lookup::Missing) {
+            if (directory_target && autoindex) {
+                // "/a/index.html" -> "/a", "/index.html" -> "" (the root)
+                std::string_view listed = std::string_view(resolved).substr(0, resolved.size() - 11);
+                const TreeSnapshot::Node* directory = tree->find(listed);
+                if (directory != nullptr && directory->kind == TreeSnapshot::Directory) {
+                    sendListing(conn, *tree, *directory);
+                    return;
+                }
+            }
+            bump(loop.metrics.snapshot_not_found);
+            sendError(conn, 404, "Not Found");
+            return;
+        }
+        if (presence == TreeSnapshot::Lookup::Found && node->kind == TreeSnapshot::Directory) {
+            sendDirectoryRedirect(conn, path, request.target());
+            return;
+        }
+
+        resolving.finish();
+        TraceSpan lookup(loop.trace.get(), TraceLookup, conn.id);
+        std::string& key = loop.cache_key;
+        key.assign(path);
+        if (encodings != 0) {
+            key += '\0';
+            key += static_cast<char>('0' + encodings);
+        }
+
+        // Entries were opened beneath the root when they were loaded
+        if (loop.file_cache) {
+            auto entry = tree ? loop.file_cache->lookup(key, [&](const FileCache::Entry& cached) {
+                return freshnessIn(*tree, cached);
+            }) : loop.file_cache->lookup(key);
+            if (entry) {
+                bump(loop.metrics.cache_hits);
+                queueCachedFile(conn, *entry, conditions);
+                return;
+            }
+            bump(loop.metrics.cache_misses);
+        }
+        if (open_files) {
+            if (auto open_file = open_files->lookup(key)) {
+                int file_fd = dup(open_file->fd);
+                if (file_fd >= 0) {
+                    bump(loop.metrics.open_file_hits);
+                    queueRepresentation(conn, open_file->headers, open_file->size, conditions, nullptr, nullptr,
+                                        file_fd);
+                    return;
+                }
+            }
+        }
+
+        lookup.finish();
+        if (!worker_pool) {
+            TraceSpan loading(loop.trace.get(), TraceLoad, conn.id);
+            FileLookup result = loadFile(key, resolved, encodings);
+            loading.finish();
+            cacheLoaded(loop, key, result);
+            queueFileResponse(conn, result, conditions);
+            return;
+        }
+
+        // Cold files are resolved and read on a worker so a slow disk never
+        // stalls the loop; the connection is looked up again on completion
+        // because it may have been closed in the meantime
+        auto result = std::make_shared<FileLookup>();
+        EventLoop* owner = &loop;
+        int fd = conn.fd;
+        uint64_t id = conn.id;
+        uint32_t stream_id = conn.stream_id;
+        OwnedConditions owned{std::string(conditions.if_none_match), std::string(conditions.if_modified_since),
+                              std::string(conditions.range), std::string(conditions.if_range)};
+        bool traced = loop.trace != nullptr;
+        bool queued = worker_pool->trySubmit([this, owner, fd, id, stream_id, key, resolved = std::string(resolved),
+                                              encodings, owned, result, traced] {
+            int64_t load_started = traced ? TraceBuffer::now() : 0;
+            *result = loadFile(key, resolved, encodings);
+            int64_t load_ended = traced ? TraceBuffer::now() : 0;
+            int32_t worker = traced ? static_cast<int32_t>(syscall(SYS_gettid)) : 0;
+            postCompletion(*owner, [this, owner, fd, id, stream_id, key, owned, result, load_started, load_ended,
+                                    worker] {
+                if (owner->trace && worker != 0) {
+                    owner->trace->record(TraceLoad, id, load_started, load_ended, 0, worker);
+                }
+                // Cached even if the connection is gone: a client was asking
+                cacheLoaded(*owner, key, *result);
+                auto it = owner->connections.find(fd);
+                Connection* conn = it == owner->connections.end() || it->second->id != id ? nullptr : it->second.get();
+                // An HTTP/2 response goes to the stream's responder, if the
+                // stream is still open
+                Http2Stream* stream = conn != nullptr && stream_id != 0 ? findStream(*conn, stream_id) : nullptr;
+                Connection* target = stream_id == 0 ? conn : stream != nullptr ? stream->responder.get() : nullptr;
+                if (target == nullptr) {
+                    if (result->file_fd >= 0) {
+                        close(result->file_fd);
+                    }
+                    return;
+                }
+                target->awaiting_worker = false;
+                queueFileResponse(*target, *result, owned.view());
+                owner->metrics.handle.record(std::chrono::steady_clock::now() - target->handle_started_at);
+                if (stream != nullptr) {
+                    http2ResponseReady(*conn, *stream);
+                    if (conn->state == ConnectionState::Reading) {
+                        conn->state = ConnectionState::Writing;
+                    }
+                } else {
+                    conn->state = ConnectionState::Writing;
+                }
+                driveConnection(*owner, *conn);
+            });
+        });
+
+        if (!queued) {
+            sendError(conn, 503, "Service Unavailable");
+            return;
+        }
+        conn.awaiting_worker = true;
+    }
+
+    // Blocking part of a GET: open beneath the root, stat and, for small
+    // files, the read into a cache entry, plus content negotiation when
+    // encodings is non-zero. request_path is normalized ("/a/b"). Runs on
+    // worker threads; the loop files the entry in its shard.
+    FileLookup loadFile(const std::string& key, const std::string& request_path, unsigned encodings) {
+        FileLookup result;
+
+        int file_fd = openBeneath(root_fd, root_path, request_path.c_str() + 1);
+        if (file_fd < 0) {
+            result.status = openFailureStatus(errno);
+            return result;
+        }
+
+        // Get file size
+        struct stat st;
+        if (fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(file_fd);
+            result.status = 404;
+            return result;
+        }
+        size_t file_size = st.st_size;
+
+        // Precompressed siblings win over compressing on the fly
+        for (const EncodingInfo& encoding : kEncodings) {
+            if ((encodings & encoding.bit) && loadSibling(key, request_path, encoding, result)) {
+                close(file_fd);
+                return result;
+            }
+        }
+
+        // Prepare headers
+        RepresentationHeaders headers = renderFileHeaders(request_path, file_size, {}, st);
+
+        // Small files are read once into the cache and served from memory;
+        // a body another shard or key already read is taken from the store
+        if (body_store && file_size <= cache_max_file_bytes) {
+            auto entry = FileCache::makeEntry(root_path + request_path, st);
+            const EncodingInfo* compressing = compressionFor(encodings & kCompressibleEncodings, file_size);
+            BodySource source = BodySource::of(st, compressing ? compressing->bit : 0);
+            unsigned coding = 0;
+            std::shared_ptr<const std::string> stored = body_store->find(source, coding);
+            if (!stored) {
+                std::string body;
+                bool complete = readWholeFile(file_fd, file_size, body);
+                if (!complete) {
+                    close(file_fd);
+                    result.status = 500;
+                    return result;
+                }
+                std::string compressed;
+                if (compressing && compressBody(compressing->bit, body, compressed) &&
+                    compressed.size() < body.size()) {
+                    body = std::move(compressed);
+                    coding = compressing->bit;
+                }
+                stored = body_store->intern(source, std::move(body), coding);
+            }
+            close(file_fd);
+            entry->headers = coding != 0 ? renderFileHeaders(request_path, stored->size(), compressing->token, st)
+                                         : std::move(headers);
+            entry->body = std::move(stored);
+            result.entry = std::move(entry);
+            return result;
+        }
+
+        result.file_fd = file_fd;
+        result.file_size = file_size;
+        result.headers = std::move(headers);
+        rememberOpenFile(key, request_path, std::string_view(request_path).substr(1), st, result);
+        return result;
+    }
+
+    // Serves the request path plus the coding's suffix if that file exists
+    // beneath the root
+    bool loadSibling(const std::string& key, const std::string& request_path, const EncodingInfo& encoding,
+                     FileLookup& result) {
+        std::string sibling_path = request_path;
+        sibling_path += encoding.suffix;
+        int sibling_fd = openBeneath(root_fd, root_path, sibling_path.c_str() + 1);
+        if (sibling_fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(sibling_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(sibling_fd);
+            return false;
+        }
+        size_t sibling_size = st.st_size;
+        RepresentationHeaders headers = renderFileHeaders(request_path, sibling_size, encoding.token, st);
+
+        if (body_store && sibling_size <= cache_max_file_bytes) {
+            auto entry = FileCache::makeEntry(root_path + sibling_path, st);
+            entry->headers = std::move(headers);
+            BodySource source = BodySource::of(st, 0);
+            unsigned coding = 0;
+            std::shared_ptr<const std::string> stored = body_store->find(source, coding);
+            if (!stored) {
+                std::string body;
+                bool complete = readWholeFile(sibling_fd, sibling_size, body);
+                if (!complete) {
+                    close(sibling_fd);
+                    return false;
+                }
+                stored = body_store->intern(source, std::move(body), coding);
+            }
+            close(sibling_fd);
+            entry->body = std::move(stored);
+            result.entry = std::move(entry);
+            return true;
+        }
+
+        result.file_fd = sibling_fd;
+        result.file_size = sibling_size;
+        result.headers = std::move(headers);
+        rememberOpenFile(key, request_path, std::string_view(sibling_path).substr(1), st, result);
+        return true;
+    }
+
+    // Keeps a descriptor of a file served with sendfile() for the next
+    // request for the same key
+    void rememberOpenFile(const std::string& key, const std::string& request_path, std::string_view source,
+                          const struct stat& st, const FileLookup& result) {
+        if (!open_files) {
+            return;
+        }
+        auto entry = std::make_shared<OpenFileCache::Entry>();
+        entry->fd = fcntl(result.file_fd, F_DUPFD_CLOEXEC, 0);
+        if (entry->fd < 0) {
+            return;
+        }
+        entry->size = result.file_size;
+        entry->headers = result.headers;
+        entry->path = request_path.substr(1);
+        open_files->insert(key, source, st, std::move(entry));
+    }
+
+    static int openFailureStatus(int error) {
+        switch (error) {
+        case EXDEV:
+        case ELOOP:
+        case EACCES:
+        case EPERM:
+            return 403;
+        case EMFILE:
+        case ENFILE:
+            return 503; // out of descriptors, not a missing file
+        default:
+            return 404;
+        }
+    }
+
+    // The coding a body of size bytes is compressed to for a key accepting
+    // producible, or nullptr: the first the build prefers, for bodies large
+    // enough to gain from it
+    static const EncodingInfo* compressionFor(unsigned producible, size_t size) {
+        if (producible == 0 || size < 256) {
+            return nullptr;
+        }
+        for (const EncodingInfo& encoding : kEncodings) {
+            if (producible & encoding.bit) {
+                return &encoding;
+            }
+        }
+        return nullptr;
+    }
+
+    void queueFileResponse(Connection& conn, FileLookup& result, const RequestConditions& conditions) {
+        switch (result.status) {
+        case 200:
+            break;
+        case 403:
+            sendError(conn, 403, "Forbidden");
+            return;
+        case 404:
+            sendError(conn, 404, "Not Found");
+            return;
+        case 503:
+            sendError(conn, 503, "Service Unavailable");
+            return;
+        default:
+            sendError(conn, 500, "Internal Server Error");
+            return;
+        }
+
+        if (result.entry) {
+            queueCachedFile(conn, result.entry, conditions);
+            return;
+        }
+
+        // Queued behind any earlier pipelined responses; the file range goes
+        // out with sendfile()
+        int file_fd = result.file_fd;
+        result.file_fd = -1;
+        queueRepresentation(conn, result.headers, result.file_size, conditions, nullptr, nullptr, file_fd);
+    }
+
+    void queueCachedFile(Connection& conn, const std::shared_ptr<const FileCache::Entry>& entry,
+                         const RequestConditions& conditions) {
+        // The entry, not the body, keeps the bytes alive while they are
+        // sent: its count is only ever touched by this loop
+        queueRepresentation(conn, entry->headers, entry->body->size(), conditions, entry, entry->body->data(), -1);
+    }
+
+    void cacheLoaded(EventLoop& loop, const std::string& key, const FileLookup& result) {
+        if (loop.file_cache && result.entry) {
+            loop.file_cache->insert(key, result.entry);
+        }
+    }
+
+    // Judges a cache entry by the snapshot instead of stat()ing its source
+    FileCache::Freshness freshnessIn(const TreeSnapshot& tree, const FileCache::Entry& entry) const {
+        std::string_view source = std::string_view(entry.source_path).substr(root_path.size());
+        const TreeSnapshot::Node* node = nullptr;
+        switch (tree.resolve(source, node)) {
+        case TreeSnapshot::Lookup::Missing:
+            return FileCache::Freshness::Stale;
+        case TreeSnapshot::Lookup::Unknown:
+            return FileCache::Freshness::Unknown;
+        case TreeSnapshot::Lookup::Found:
+            break;
+        }
+        int64_t mtime_ns = static_cast<int64_t>(entry.mtime.tv_sec) * 1000000000 + entry.mtime.tv_nsec;
+        bool current = node->kind == TreeSnapshot::File && node->size == static_cast<uint64_t>(entry.size) &&
+                       node->inode == static_cast<uint64_t>(entry.inode) && node->mtime_ns == mtime_ns;
+        return current ? FileCache::Freshness::Current : FileCache::Freshness::Stale;
+    }
+
+    // 301 to the path with a slash appended, for a directory requested
+    // without one. The Location is built from the normalized path, so it
+    // starts with a single '/' and cannot name another host
+    // ("//evil.example/..")
+    void sendDirectoryRedirect(Connection& conn, const std::string& path, std::string_view target) {
+        std::string location;
+        appendPercentEncoded(location, path, "/");
+        location += '/';
+        size_t query = target.find_first_of("?#");
+        if (query != std::string_view::npos && target[query] == '?') {
+            std::string_view rest = target.substr(query);
+            rest = rest.substr(0, rest.find('#'));
+            location += rest;
+        }
+        conn.startResponse(301);
+        conn.queueData("HTTP/1.1 301 Moved Permanently\r\nLocation: ");
+        conn.queueData(location);
+        conn.queueData("\r\nContent-Length: 0\r\nServer: CPP-HTTP-Server/1.0\r\n");
+        queueTrailer(conn);
+    }
+
+    // HTML listing of a directory that has no index.html: subdirectories,
+    // then files, each in name order. Dot files are left out.
+    void sendListing(Connection& conn, const TreeSnapshot& tree, const TreeSnapshot::Node& directory) {
+        std::string body;
+        body.reserve(2048);
+        auto appendHtml = [&body](std::string_view text) {
+            for (char c : text) {
+                switch (c) {
+                case '&': body += "&amp;"; break;
+                case '<': body += "&lt;"; break;
+                case '>': body += "&gt;"; break;
+                case '"': body += "&quot;"; break;
+                case '\'': body += "&#39;"; break;
+                default: body += c;
+                }
+            }
+        };
+
+        std::string_view path = tree.pathOf(directory);
+        body += "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ";
+        appendHtml(path);
+        body += "/</title></head>\n<body><h1>Index of ";
+        appendHtml(path);
+        body += "/</h1>\n<table>\n";
+        if (!path.empty()) {
+            body += "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n";
+        }
+        for (bool directories : {true, false}) {
+            for (uint32_t i = directory.first_child; i != TreeSnapshot::kNone; i = tree.at(i).next_sibling) {
+                const TreeSnapshot::Node& child = tree.at(i);
+                std::string_view name = tree.nameOf(child);
+                if ((child.kind == TreeSnapshot::Directory) != directories || name[0] == '.') {
+                    continue;
+                }
+                std::string_view slash = directories ? "/" : "";
+                // "./" keeps a name such as "javascript:x" a relative path
+                body += "<tr><td><a href=\"./";
+                appendPercentEncoded(body, name);
+                body += slash;
+                body += "\">";
+                appendHtml(name);
+                body += slash;
+                body += "</a></td><td>";
+                time_t seconds = child.mtime_ns / 1000000000;
+                struct tm tm;
+                char date[32];
+                gmtime_r(&seconds, &tm);
+                body.append(date, strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm));
+                body += "</td><td>";
+                if (child.kind == TreeSnapshot::File) {
+                    body += std::to_string(child.size);
+                } else {
+                    body += '-';
+                }
+                body += "</td></tr>\n";
+            }
+        }
+        body += "</table>\n</body></html>\n";
+
+        conn.startResponse(200);
+        conn.queueData("HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nCache-Control: no-cache\r\n"
+                       "Content-Length: ");
+        queueNumber(conn, body.size());
+        conn.queueData("\r\nServer: CPP-HTTP-Server/1.0\r\n");
+        queueTrailer(conn);
+        conn.queueData(body);
+    }
+
+    // Sends the most preferred accepted variant the bundle has, straight
+    // from the mapping, which owner keeps mapped
+    void queueBundleAsset(Connection& conn, const AssetBundle& mounted, const std::shared_ptr<const void>& owner,
+                          const AssetBundle::Asset& asset, unsigned encodings, const RequestConditions& conditions) {
+        unsigned variant = BundleIdentity;
+        for (unsigned i = 0; i + 1 < kBundleVariants; i++) {
+            if ((encodings & kEncodings[i].bit) && asset.entry->variants[i + 1].offset != 0) {
+                variant = i + 1;
+                break;
+            }
+        }
+        const BundleExtent& extent = asset.entry->variants[variant];
+        queueRepresentation(conn, asset.variants[variant], extent.length, conditions, owner, mounted.bytes(extent), -1);
+    }
+
+    // Maps bundle_path and renders the headers of every variant it holds.
+    // Throws std::runtime_error.
+    std::shared_ptr<const AssetBundle> mountBundle() {
+        static_assert(kEncodings[BundleBrotli - 1].bit == EncodingBrotli &&
+                          kEncodings[BundleZstd - 1].bit == EncodingZstd &&
+                          kEncodings[BundleGzip - 1].bit == EncodingGzip,
+                      "bundle variants follow kEncodings");
+        auto mounted = std::make_shared<AssetBundle>(bundle_path, bundle_populate, bundle_lock);
+        for (AssetBundle::Asset& asset : mounted->assets) {
+            for (unsigned variant = BundleIdentity; variant < kBundleVariants; variant++) {
+                const BundleExtent& extent = asset.entry->variants[variant];
+                if (extent.offset == 0) {
+                    continue;
+                }
+                std::string_view coding = variant == BundleIdentity ? std::string_view() : kEncodings[variant - 1].token;
+                asset.variants[variant] = renderFileHeaders(asset.path, extent.length, coding,
+                                                            makeBundleETag(asset.entry->content_hash, coding),
+                                                            asset.entry->mtime);
+            }
+        }
+        std::cout << "Mounted bundle " << bundle_path << ": " << mounted->assets.size() << " files, "
+                  << mounted->size() << " bytes" << (mounted->isLocked() ? ", locked" : "") << std::endl;
+        return mounted;
+    }
+
+    // Picks up a newly published bundle, and gives the loop its own owner
+    // reference to it
+    const AssetBundle* refreshBundle(EventLoop& loop) {
+        const AssetBundle* current = bundle.refresh(loop.bundle);
+        if (loop.bundle_owner.get() != current) {
+            auto held = std::make_shared<const std::shared_ptr<const AssetBundle>>(loop.bundle.current);
+            loop.bundle_owner = std::shared_ptr<const void>(held, current);
+        }
+        return current;
+    }
+
+    // Makes mounted the bundle new requests are served from. Responses still
+    // sending from the old one keep it mapped until they are done.
+    void publishBundle(std::shared_ptr<const AssetBundle> mounted) {
+        bundle.publish(std::move(mounted));
+        // So idle loops let go of the old bundle too
+        wakeLoops();
+    }
+
+    // Chooses 304, 416, 206 or 200 for one representation. The body is
+    // memory kept alive by owner, which then holds the headers too (a cache
+    // entry or a bundle, sliced without copying), or file_fd, whose
+    // ownership passes to the connection.
+    void queueRepresentation(Connection& conn, const RepresentationHeaders& headers, uint64_t size,
+                             const RequestConditions& conditions, const std::shared_ptr<const void>& owner,
+                             const char* body, int file_fd) {
+        auto queueHeaders = [&](const std::string& block) {
+            if (owner) {
+                conn.queueShared(owner, block.data(), block.size());
+            } else {
+                conn.queueData(block);
+            }
+        };
+
+        if (notModified(conditions.if_none_match, conditions.if_modified_since, headers.etag, headers.last_modified)) {
+            conn.startResponse(304);
+            queueHeaders(headers.not_modified);
+            queueTrailer(conn);
+            if (file_fd >= 0) {
+                close(file_fd);
+            }
+            return;
+        }
+
+        ByteRange ranges[kMaxRanges];
+        int range_count = 0;
+        if (!conditions.range.empty() && ifRangeMatches(conditions.if_range, headers.etag, headers.last_modified)) {
+            range_count = parseRange(conditions.range, size, ranges, kMaxRanges);
+        }
+
+        if (range_count < 0) {
+            char length_buffer[24];
+            std::string_view length(length_buffer, std::to_chars(length_buffer, length_buffer + sizeof(length_buffer), size).ptr - length_buffer);
+            conn.startResponse(416);
+            conn.queueData("HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */");
+            conn.queueData(length);
+            conn.queueData("\r\nContent-Length: 0\r\n");
+            conn.queueData(headers.validators);
+            queueTrailer(conn);
+            if (file_fd >= 0) {
+                close(file_fd);
+            }
+            return;
+        }
+
+        if (range_count == 0) {
+            conn.startResponse(200);
+            queueHeaders(headers.ok);
+            queueTrailer(conn);
+            queueBody(conn, owner, body, file_fd, 0, size, true);
+            return;
+        }
+
+        if (range_count == 1) {
+            conn.startResponse(206);
+            conn.queueData("HTTP/1.1 206 Partial Content\r\n");
+            conn.queueData(headers.representation);
+            queueContentRange(conn, ranges[0], size);
+            conn.queueData("\r\nContent-Length: ");
+            queueNumber(conn, ranges[0].length());
+            conn.queueData("\r\n");
+            conn.queueData(headers.validators);
+            queueTrailer(conn);
+            queueBody(conn, owner, body, file_fd, ranges[0].first, ranges[0].length(), true);
+            return;
+        }
+
+        // multipart/byteranges: each part carries its own Content-Type and
+        // Content-Range; the total length is known up front
+        char boundary_buffer[32];
+        int boundary_length = snprintf(boundary_buffer, sizeof(boundary_buffer), "%016llx%08x",
+                                       static_cast<unsigned long long>(conn.id), conn.requests_served);
+        std::string_view boundary(boundary_buffer, boundary_length);
+        char size_buffer[24];
+        size_t size_digits = std::to_chars(size_buffer, size_buffer + sizeof(size_buffer), size).ptr - size_buffer;
+
+        uint64_t content_length = 0;
+        for (int i = 0; i < range_count; i++) {
+            // "\r\n--B\r\nContent-Type: T\r\nContent-Range: bytes F-L/S\r\n\r\n"
+            content_length += 4 + boundary.size() + 2 + 14 + headers.mime_type.size() + 2 + 21 +
+                              decimalDigits(ranges[i].first) + 1 + decimalDigits(ranges[i].last) + 1 + size_digits + 4 +
+                              ranges[i].length();
+        }
+        content_length += 4 + boundary.size() + 4; // "\r\n--B--\r\n"
+
+        conn.startResponse(206);
+        conn.queueData("HTTP/1.1 206 Partial Content\r\nContent-Type: multipart/byteranges; boundary=");
+        conn.queueData(boundary);
+        conn.queueData("\r\nContent-Length: ");
+        queueNumber(conn, content_length);
+        conn.queueData("\r\n");
+        if (!headers.content_encoding.empty()) {
+            // The coding applies to the whole multipart body
+            conn.queueData("Content-Encoding: ");
+            conn.queueData(headers.content_encoding);
+            conn.queueData("\r\n");
+        }
+        conn.queueData(headers.validators);
+        queueTrailer(conn);
+        for (int i = 0; i < range_count; i++) {
+            conn.queueData("\r\n--");
+            conn.queueData(boundary);
+            conn.queueData("\r\nContent-Type: ");
+            conn.queueData(headers.mime_type);
+            conn.queueData("\r\n");
+            queueContentRange(conn, ranges[i], size);
+            conn.queueData("\r\n\r\n");
+            queueBody(conn, owner, body, file_fd, ranges[i].first, ranges[i].length(), i == range_count - 1);
+        }
+        conn.queueData("\r\n--");
+        conn.queueData(boundary);
+        conn.queueData("--\r\n");
+    }
+
+    // Queues [offset, offset + length) of the body. For files the last use
+    // hands over file_fd itself; earlier ones queue a dup().
+    static void queueBody(Connection& conn, const std::shared_ptr<const void>& owner, const char* body, int file_fd,
+                          uint64_t offset, uint64_t length, bool last_use) {
+        if (owner) {
+            if (length > 0) {
+                conn.queueShared(owner, body + offset, length);
+            }
+            return;
+        }
+        int segment_fd = last_use ? file_fd : dup(file_fd);
+        if (segment_fd < 0) {
+            // The promised length cannot be delivered
+            conn.close_after_write = true;
+            return;
+        }
+        if (length > 0) {
+            conn.queueFile(segment_fd, offset, length);
+        } else {
+            close(segment_fd);
+        }
+    }
 
-class HTTPServer {
-private:
-    int server_fd;
-    int port;
-    std::string web_root;
-    bool running;
-    std::vector<std::thread> client_threads;
-    std::map<std::string, std::string> mime_types;
-
-    void setupMimeTypes() {
-        mime_types = {
-            {".html", "text/html"},
-            {".css", "text/css"},
-            {".js", "application/javascript"},
-            {".json", "application/json"},
-            {".png", "image/png"},
-            {".jpg", "image/jpeg"},
-            {".jpeg", "image/jpeg"},
-            {".gif", "image/gif"},
-            {".txt", "text/plain"}
-        };
+    static void queueContentRange(Connection& conn, const ByteRange& range, uint64_t size) {
+        conn.queueData("Content-Range: bytes ");
+        queueNumber(conn, range.first);
+        conn.queueData("-");
+        queueNumber(conn, range.last);
+        conn.queueData("/");
+        queueNumber(conn, size);
+    }
+
+    static void queueNumber(Connection& conn, uint64_t value) {
+        char buffer[24];
+        conn.queueData(std::string_view(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer));
+    }
+
+    static size_t decimalDigits(uint64_t value) {
+        size_t digits = 1;
+        while (value >= 10) {
+            value /= 10;
+            digits++;
+        }
+        return digits;
     }
 
-    std::string getMimeType(const std::string& path) {
-        size_t dot_pos = path.find_last_of('.');
-        if (dot_pos != std::string::npos) {
-            std::string ext = path.substr(dot_pos);
-            auto it = mime_types.find(ext);
-            if (it != mime_types.end()) {
-                return it->second;
+    // content_encoding is empty for the identity coding. Every response
+    // for a negotiable type carries Vary so shared caches keep them apart.
+    RepresentationHeaders renderFileHeaders(std::string_view request_path, size_t file_size,
+                                            std::string_view content_encoding, const struct stat& st) {
+        return renderFileHeaders(request_path, file_size, content_encoding, makeETag(st, content_encoding),
+                                 st.st_mtim.tv_sec);
+    }
+
+    RepresentationHeaders renderFileHeaders(std::string_view request_path, size_t file_size,
+                                            std::string_view content_encoding, std::string etag,
+                                            time_t last_modified) {
+        std::string_view mime_type = getMimeType(request_path);
+        RepresentationHeaders rendered;
+        rendered.mime_type = mime_type;
+        rendered.content_encoding = content_encoding;
+        rendered.etag = std::move(etag);
+        rendered.last_modified = last_modified;
+
+        rendered.representation = "Content-Type: ";
+        rendered.representation += mime_type;
+        rendered.representation += "\r\n";
+        if (!content_encoding.empty()) {
+            rendered.representation += "Content-Encoding: ";
+            rendered.representation += content_encoding;
+            rendered.representation += "\r\n";
+        }
+
+        std::string& validators = rendered.validators;
+        validators += "ETag: ";
+        validators += rendered.etag;
+        validators += "\r\nLast-Modified: ";
+        validators += formatHttpDate(rendered.last_modified);
+        validators += "\r\n";
+        std::string_view cache_control = cacheControlFor(request_path, mime_type);
+        if (!cache_control.empty()) {
+            validators += "Cache-Control: ";
+            validators += cache_control;
+            validators += "\r\n";
+        }
+        if (compression && isCompressibleType(mime_type)) {
+            validators += "Vary: Accept-Encoding\r\n";
+        }
+        validators += "Server: CPP-HTTP-Server/1.0\r\n";
+
+        std::string& headers = rendered.ok;
+        headers.reserve(256);
+        headers += "HTTP/1.1 200 OK\r\n";
+        headers += rendered.representation;
+        headers += "Content-Length: ";
+        headers += std::to_string(file_size);
+        headers += "\r\nAccept-Ranges: bytes\r\n";
+        headers += validators;
+
+        rendered.not_modified = "HTTP/1.1 304 Not Modified\r\n";
+        rendered.not_modified += validators;
+        return rendered;
+    }
+
+    std::string_view cacheControlFor(std::string_view request_path, std::string_view mime_type) const {
+        const std::string* best = nullptr;
+        size_t best_length = 0;
+        for (const auto& rule : cache_control_rules) {
+            const std::string& key = rule.first;
+            if (!key.empty() && key[0] == '/' && key.size() > best_length &&
+                request_path.substr(0, key.size()) == key) {
+                best = &rule.second;
+                best_length = key.size();
+            }
+        }
+        if (best) {
+            return *best;
+        }
+
+        std::string_view major = mime_type.substr(0, mime_type.find('/') + 1);
+        for (const auto& rule : cache_control_rules) {
+            if (rule.first == mime_type) {
+                return rule.second;
+            }
+        }
+        for (const auto& rule : cache_control_rules) {
+            std::string_view key = rule.first;
+            if (key.size() == major.size() + 1 && key.substr(0, major.size()) == major && key.back() == '*') {
+                return rule.second;
             }
         }
-        return "application/octet-stream";
+        return {};
     }
 
-    std::string getTimeString() {
-        time_t now = time(0);
-        struct tm tm = *gmtime(&now);
-        char buf[100];
-        strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
-        return std::string(buf);
+    // Per-response headers that cannot be pre-rendered, plus the blank line
+    void queueTrailer(Connection& conn) {
+        conn.queueData(date_cache.line());
+        conn.queueData(connectionHeader(conn));
+        conn.queueData("\r\n");
+        conn.headQueued();
     }
 
-    void handleClient(int client_socket) {
-        char buffer[4096] = {0};
-        ssize_t bytes_read = read(client_socket, buffer, 4096);
-        
-        if (bytes_read > 0) {
-            std::string request(buffer);
-            std::istringstream request_stream(request);
-            std::string request_line;
-            std::getline(request_stream, request_line);
+    static bool readWholeFile(int file_fd, size_t file_size, std::string& body) {
+        body.resize(file_size);
+        size_t offset = 0;
+        while (offset < file_size) {
+            ssize_t bytes_read = pread(file_fd, &body[offset], file_size - offset, offset);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                return false;
+            }
+            offset += bytes_read;
+        }
+        return true;
+    }
 
-            // Parse request line
-            std::istringstream request_line_stream(request_line);
-            std::string method, path, protocol;
-            request_line_stream >> method >> path >> protocol;
+    // Rendered piecewise straight into the connection's arena
+    void sendError(Connection& conn, int error_code, std::string_view error_message) {
+        static constexpr std::string_view body_open = "<html><body><h1>";
+        static constexpr std::string_view body_close = "</h1></body></html>";
+        char code_buffer[16];
+        std::string_view code(code_buffer, std::to_chars(code_buffer, code_buffer + sizeof(code_buffer), error_code).ptr - code_buffer);
+        size_t body_length = body_open.size() + code.size() + 1 + error_message.size() + body_close.size();
+        char length_buffer[24];
+        std::string_view length(length_buffer, std::to_chars(length_buffer, length_buffer + sizeof(length_buffer), body_length).ptr - length_buffer);
 
-            if (method == "GET") {
-                handleGetRequest(client_socket, path);
-            } else {
-                // Method not supported
-                std::string response = "HTTP/1.1 405 Method Not Allowed\r\n"
-                                     "Content-Type: text/plain\r\n"
-                                     "Content-Length: 21\r\n\r\n"
-                                     "Method Not Supported\n";
-                send(client_socket, response.c_str(), response.length(), 0);
+        conn.startResponse(error_code);
+        conn.queueData("HTTP/1.1 ");
+        conn.queueData(code);
+        conn.queueData(" ");
+        conn.queueData(error_message);
+        conn.queueData("\r\nContent-Type: text/html\r\nContent-Length: ");
+        conn.queueData(length);
+        conn.queueData("\r\n");
+        conn.queueData(date_cache.line());
+        conn.queueData("Server: CPP-HTTP-Server/1.0\r\n");
+        conn.queueData(connectionHeader(conn));
+        conn.queueData("\r\n");
+        conn.headQueued();
+        conn.queueData(body_open);
+        conn.queueData(code);
+        conn.queueData(" ");
+        conn.queueData(error_message);
+        conn.queueData(body_close);
+    }
+
+    void wakeLoops() {
+        for (auto& loop : loops) {
+            uint64_t one = 1;
+            ssize_t ignored = write(loop->wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+
+    // Runs on the thread that called start() until every loop has returned:
+    // turns signals into a drain (or, the second time, a stop) or a bundle
+    // remount, and hands the listeners to a successor that connects to the
+    // reload socket
+    void supervise() {
+        uint64_t finished = 0;
+        while (finished < loops.size()) {
+            // poll() skips the reload entry while reload_fd is -1
+            struct pollfd fds[3] = {{loops_done_fd, POLLIN, 0}, {control_pipe[0], POLLIN, 0}, {reload_fd, POLLIN, 0}};
+            if (poll(fds, 3, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Supervisor poll failed" << std::endl;
+                stop();
+                return;
+            }
+            if (fds[0].revents & POLLIN) {
+                uint64_t value;
+                if (read(loops_done_fd, &value, sizeof(value)) == sizeof(value)) {
+                    finished += value;
+                }
+            }
+            if (fds[1].revents & POLLIN) {
+                unsigned char signals[64];
+                ssize_t count = read(control_pipe[0], signals, sizeof(signals));
+                for (ssize_t i = 0; i < count; i++) {
+                    if (signals[i] == 0 || !running) {
+                        continue; // stop() already woke the loops
+                    }
+                    if (signals[i] == SIGHUP) {
+                        if (!bundle_path.empty()) {
+                            remountBundle();
+                        }
+                        if (access_log) {
+                            access_log->reopen();
+                        }
+                        continue;
+                    }
+                    if (signals[i] == SIGUSR1) {
+                        if (!trace_path.empty()) {
+                            writeTrace();
+                        }
+                        continue;
+                    }
+                    if (!draining) {
+                        std::cout << "\nDraining connections (up to " << drain_timeout << "s)..." << std::endl;
+                        drain();
+                    } else {
+                        std::cout << "\nShutting down server..." << std::endl;
+                        stop();
+                    }
+                }
+            }
+            if (fds[2].revents & POLLIN) {
+                handOverListeners();
             }
         }
+    }
 
-        close(client_socket);
+    uint64_t accessLogDrops() const {
+        uint64_t total = 0;
+        for (const auto& loop : loops) {
+            total += loop->access_log->droppedCount();
+        }
+        return total;
     }
 
-    void handleGetRequest(int client_socket, const std::string& path) {
-        // Convert URL path to file system path
-        std::string file_path = web_root + (path == "/" ? "/index.html" : path);
-        
-        // Security check: Prevent directory traversal
-        std::filesystem::path canonical_path = std::filesystem::canonical(std::filesystem::path(web_root));
-        std::filesystem::path requested_path = std::filesystem::canonical(std::filesystem::path(file_path));
-        
-        if (requested_path.string().find(canonical_path.string()) != 0) {
-            sendError(client_socket, 403, "Forbidden");
+    // SIGUSR1: every loop copies its recorder on its own thread, and what
+    // arrives within a second goes to trace_path (through a temporary file
+    // renamed over it, so a reader never sees half a trace)
+    void writeTrace() {
+        struct Collection {
+            std::mutex mutex;
+            std::condition_variable done;
+            size_t remaining = 0;
+            std::vector<std::pair<int32_t, std::vector<TraceEvent>>> threads;
+        };
+        auto collection = std::make_shared<Collection>();
+        collection->remaining = loops.size();
+        for (auto& loop : loops) {
+            EventLoop* owner = loop.get();
+            postCompletion(*owner, [owner, collection] {
+                std::vector<TraceEvent> events;
+                owner->trace->copyTo(events);
+                std::lock_guard<std::mutex> lock(collection->mutex);
+                collection->threads.emplace_back(owner->trace->thread(), std::move(events));
+                if (--collection->remaining == 0) {
+                    collection->done.notify_one();
+                }
+            });
+        }
+        std::vector<std::pair<int32_t, std::vector<TraceEvent>>> threads;
+        {
+            std::unique_lock<std::mutex> lock(collection->mutex);
+            collection->done.wait_for(lock, std::chrono::seconds(1), [&] { return collection->remaining == 0; });
+            threads.swap(collection->threads);
+        }
+        size_t count = 0;
+        for (const auto& thread : threads) {
+            count += thread.second.size();
+        }
+        std::string json = formatChromeTrace(threads);
+        std::string temporary = trace_path + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        size_t offset = 0;
+        while (fd >= 0 && offset < json.size()) {
+            ssize_t written = write(fd, json.data() + offset, json.size() - offset);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                break;
+            }
+            offset += written;
+        }
+        if (fd < 0 || offset < json.size() || close(fd) < 0 || rename(temporary.c_str(), trace_path.c_str()) < 0) {
+            std::cerr << "Failed to write trace " << trace_path << ": " << strerror(errno) << std::endl;
+            if (fd >= 0) {
+                unlink(temporary.c_str());
+            }
             return;
         }
+        std::cout << "Wrote " << count << " trace events of " << threads.size() << " loops to " << trace_path
+                  << std::endl;
+    }
 
-        // Check if file exists and is readable
-        std::ifstream file(file_path, std::ios::binary);
-        if (!file) {
-            sendError(client_socket, 404, "Not Found");
+    // SIGHUP: a deploy has replaced the bundle file. A bundle that fails to
+    // map or validate leaves the current one in service.
+    void remountBundle() {
+        try {
+            publishBundle(mountBundle());
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "; still serving the previous bundle" << std::endl;
+        }
+    }
+
+    // Handoff message: magic and listener count, with the listeners
+    // attached as SCM_RIGHTS
+    struct ListenerHandoff {
+        char magic[8];
+        uint32_t count;
+    };
+    static constexpr char kHandoffMagic[8] = {'H', 'T', 'T', 'P', 'L', 'S', 'N', '1'};
+    // SCM_MAX_FD; a successor creates any listeners beyond these
+    static constexpr size_t kMaxHandoffListeners = 253;
+
+    sockaddr_un reloadAddress() const {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, reload_socket.data(), reload_socket.size());
+        return address;
+    }
+
+    // Asks the process serving on reload_socket for its listeners. Returns
+    // none when nothing answers there; takeover_fd is kept open for the
+    // acknowledgement once this process is accepting.
+    std::vector<int> takeOverListeners() {
+        std::vector<int> fds;
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to create reload socket");
+        }
+        sockaddr_un address = reloadAddress();
+        if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            close(fd);
+            return fds;
+        }
+        struct timeval timeout{10, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        ListenerHandoff header{};
+        struct iovec iov{&header, sizeof(header)};
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxHandoffListeners)];
+        struct msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t received = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (received == 0) {
+            close(fd); // a draining process has no listeners to give
+            return fds;
+        }
+        if (received > 0) {
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    size_t first = fds.size();
+                    fds.resize(first + count);
+                    std::memcpy(fds.data() + first, CMSG_DATA(cmsg), count * sizeof(int));
+                }
+            }
+        }
+
+        std::string error;
+        struct sockaddr_in bound{};
+        socklen_t length = sizeof(bound);
+        if (received != sizeof(header) || std::memcmp(header.magic, kHandoffMagic, sizeof(kHandoffMagic)) != 0 ||
+            header.count != fds.size() || fds.empty() || (msg.msg_flags & MSG_CTRUNC)) {
+            error = "Malformed listener handoff on " + reload_socket;
+        } else if (getsockname(fds[0], reinterpret_cast<sockaddr*>(&bound), &length) < 0 ||
+                   bound.sin_family != AF_INET || ntohs(bound.sin_port) != port) {
+            error = "Listeners handed over on " + reload_socket + " are not bound to port " + std::to_string(port);
+        }
+        if (!error.empty()) {
+            for (int listener : fds) {
+                close(listener);
+            }
+            close(fd);
+            throw std::runtime_error(error);
+        }
+        takeover_fd = fd;
+        std::cout << "Took over " << fds.size() << " listener(s) from " << reload_socket << std::endl;
+        return fds;
+    }
+
+    // Replaces a predecessor's (or a stale) socket file; failures only cost
+    // the next upgrade, so they are reported rather than fatal
+    void listenForReload() {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_un address = reloadAddress();
+        unlink(reload_socket.c_str());
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            chmod(reload_socket.c_str(), 0600) < 0 || listen(fd, 4) < 0) {
+            std::cerr << "Failed to listen on reload socket " << reload_socket << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
             return;
         }
+        reload_fd = fd;
+    }
 
-        // Get file size
-        file.seekg(0, std::ios::end);
-        size_t file_size = file.tellg();
-        file.seekg(0, std::ios::beg);
-
-        // Prepare and send headers
-        std::ostringstream headers;
-        headers << "HTTP/1.1 200 OK\r\n"
-                << "Content-Type: " << getMimeType(file_path) << "\r\n"
-                << "Content-Length: " << file_size << "\r\n"
-                << "Date: " << getTimeString() << "\r\n"
-                << "Server: CPP-HTTP-Server/1.0\r\n"
-                << "Connection: close\r\n\r\n";
-
-        std::string header_str = headers.str();
-        send(client_socket, header_str.c_str(), header_str.length(), 0);
-
-        // Send file content
-        char buffer[4096];
-        while (file.read(buffer, sizeof(buffer)).gcount() > 0) {
-            send(client_socket, buffer, file.gcount(), 0);
+    // A successor connected to the reload socket: send it every listener
+    // and drain once it reports that its loops are accepting on them. Until
+    // then both processes accept from the same queues, so none is dropped.
+    void handOverListeners() {
+        int client = accept4(reload_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            return;
+        }
+        if (draining) {
+            // The loops are closing the listeners; the successor binds anew
+            close(client);
+            return;
+        }
+        struct ucred peer{};
+        socklen_t length = sizeof(peer);
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0 ||
+            (peer.uid != geteuid() && peer.uid != 0)) {
+            std::cerr << "Refused listener handoff to uid " << peer.uid << std::endl;
+            close(client);
+            return;
+        }
+
+        std::vector<int> fds;
+        if (reuse_port) {
+            for (auto& loop : loops) {
+                fds.push_back(loop->listen_fd);
+            }
+        } else {
+            fds.push_back(server_fd);
+        }
+        fds.resize(std::min(fds.size(), kMaxHandoffListeners));
+
+        ListenerHandoff header{};
+        std::memcpy(header.magic, kHandoffMagic, sizeof(kHandoffMagic));
+        header.count = fds.size();
+        struct iovec iov{&header, sizeof(header)};
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxHandoffListeners)] = {};
+        struct msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+        // The successor acknowledges within seconds or has failed
+        struct pollfd ready_poll{client, POLLIN, 0};
+        char ready = 0;
+        if (sendmsg(client, &msg, MSG_NOSIGNAL) == sizeof(header) && poll(&ready_poll, 1, 10000) == 1 &&
+            read(client, &ready, 1) == 1 && ready == 'R') {
+            std::cout << "Listeners handed over; draining connections (up to " << drain_timeout << "s)..."
+                      << std::endl;
+            close(reload_fd);
+            reload_fd = -1;
+            drain();
+        } else {
+            std::cerr << "Listener handoff aborted; still serving" << std::endl;
+        }
+        close(client);
+    }
+
+    uint64_t sumCounter(std::atomic<uint64_t> LoopMetrics::*counter) const {
+        uint64_t total = 0;
+        for (const auto& loop : loops) {
+            total += (loop->metrics.*counter).load(std::memory_order_relaxed);
         }
+        return total;
     }
 
-    void sendError(int client_socket, int error_code, const std::string& error_message) {
-        std::string body = "<html><body><h1>" + std::to_string(error_code) + " " + error_message + "</h1></body></html>";
-        
-        std::ostringstream response;
-        response << "HTTP/1.1 " << error_code << " " << error_message << "\r\n"
-                << "Content-Type: text/html\r\n"
-                << "Content-Length: " << body.length() << "\r\n"
-                << "Date: " << getTimeString() << "\r\n"
-                << "Server: CPP-HTTP-Server/1.0\r\n"
-                << "Connection: close\r\n\r\n"
-                << body;
+    // Prometheus text exposition of every loop's metrics, summed. Histogram
+    // buckets are re-binned onto fixed bounds; a bound that falls inside an
+    // internal bucket counts it in the next one.
+    void sendMetrics(Connection& conn) {
+        std::string body;
+        body.reserve(8192);
+        auto appendNumber = [&body](uint64_t value) {
+            char buffer[24];
+            body.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer);
+        };
+        auto header = [&body](const char* name, const char* type, const char* help) {
+            body += "# HELP ";
+            body += name;
+            body += ' ';
+            body += help;
+            body += "\n# TYPE ";
+            body += name;
+            body += ' ';
+            body += type;
+            body += '\n';
+        };
+        auto sample = [&](const char* name, const char* type, const char* help, uint64_t value) {
+            header(name, type, help);
+            body += name;
+            body += ' ';
+            appendNumber(value);
+            body += '\n';
+        };
+
+        header("http_responses_total", "counter", "Responses started, by status code.");
+        for (size_t slot = 0; slot < LoopMetrics::kStatusSlots; slot++) {
+            uint64_t total = 0;
+            for (const auto& loop : loops) {
+                total += loop->metrics.responses[slot].load(std::memory_order_relaxed);
+            }
+            body += "http_responses_total{code=\"";
+            if (slot < std::size(LoopMetrics::kStatusCodes)) {
+                appendNumber(LoopMetrics::kStatusCodes[slot]);
+            } else {
+                body += "other";
+            }
+            body += "\"} ";
+            appendNumber(total);
+            body += '\n';
+        }
+        sample("http_sent_bytes_total", "counter", "Bytes written to client sockets.",
+               sumCounter(&LoopMetrics::bytes_sent));
+
+        // Closed is read first, so a connection accepted meanwhile can only
+        // make the gauge high, never wrap it
+        uint64_t active = 0;
+        for (const auto& loop : loops) {
+            uint64_t closed = loop->metrics.connections_closed.load(std::memory_order_relaxed);
+            uint64_t opened = loop->metrics.connections_opened.load(std::memory_order_relaxed);
+            active += opened > closed ? opened - closed : 0;
+        }
+        sample("http_connections_active", "gauge", "Open client connections.", active);
+        sample("http_connections_accepted_total", "counter", "Client connections accepted.",
+               sumCounter(&LoopMetrics::connections_opened));
+        sample("http_accept_errors_total", "counter", "accept() failures other than EAGAIN.",
+               sumCounter(&LoopMetrics::accept_errors));
+        sample("http_accept_pauses_total", "counter",
+               "Times a loop stopped accepting at its connection limit or out of descriptors.",
+               sumCounter(&LoopMetrics::accept_pauses));
+        sample("http_timeouts_total", "counter",
+               "Connections closed (or answered with 408) at a head, body, write, idle or linger deadline.",
+               sumCounter(&LoopMetrics::timeouts));
+        if (access_log) {
+            sample("http_access_log_records_total", "counter", "Access log records written.",
+                   access_log->writtenCount());
+            sample("http_access_log_dropped_total", "counter", "Access log records dropped on a full ring.",
+                   accessLogDrops());
+        }
+        sample("http_file_cache_hits_total", "counter", "Requests answered from the in-memory file cache.",
+               sumCounter(&LoopMetrics::cache_hits));
+        sample("http_file_cache_misses_total", "counter", "In-memory file cache lookups that missed.",
+               sumCounter(&LoopMetrics::cache_misses));
+        sample("http_open_file_cache_hits_total", "counter", "Requests answered from a cached file descriptor.",
+               sumCounter(&LoopMetrics::open_file_hits));
+        if (body_store) {
+            // value(loop) reads one of the loop's counters
+            auto perShard = [&](const char* name, const char* type, const char* help, auto value) {
+                header(name, type, help);
+                for (const auto& loop : loops) {
+                    body += name;
+                    body += "{shard=\"";
+                    appendNumber(loop->index);
+                    body += "\"} ";
+                    appendNumber(value(*loop).load(std::memory_order_relaxed));
+                    body += '\n';
+                }
+            };
+            perShard("http_file_cache_shard_hits_total", "counter", "File cache hits by loop shard.",
+                     [](const EventLoop& loop) -> auto& { return loop.metrics.cache_hits; });
+            perShard("http_file_cache_shard_misses_total", "counter", "File cache misses by loop shard.",
+                     [](const EventLoop& loop) -> auto& { return loop.metrics.cache_misses; });
+            perShard("http_file_cache_entries", "gauge", "Entries in each loop's file cache shard.",
+                     [](const EventLoop& loop) -> auto& { return loop.file_cache->stats().entries; });
+            perShard("http_file_cache_bytes", "gauge", "Bytes charged to each shard, bodies counted in full.",
+                     [](const EventLoop& loop) -> auto& { return loop.file_cache->stats().bytes; });
+            perShard("http_file_cache_evictions_total", "counter", "Entries evicted from each shard.",
+                     [](const EventLoop& loop) -> auto& { return loop.file_cache->stats().evictions; });
+            sample("http_file_cache_bodies", "gauge", "Distinct bodies held by the shards.",
+                   body_store->bodyCount());
+            sample("http_file_cache_body_bytes", "gauge", "Bytes of the distinct bodies held by the shards.",
+                   body_store->byteCount());
+            sample("http_file_cache_deduplicated_total", "counter",
+                   "Cache loads whose body was already held, by another shard or key.",
+                   body_store->deduplicatedCount());
+        }
+        if (!bundle_path.empty()) {
+            sample("http_bundle_hits_total", "counter", "Requests answered from the mapped asset bundle.",
+                   sumCounter(&LoopMetrics::bundle_hits));
+        }
+        if (tree_watcher) {
+            sample("http_snapshot_entries", "gauge", "Files and directories in the metadata snapshot.",
+                   tree_watcher->entryCount());
+            sample("http_snapshot_not_found_total", "counter", "404s answered from the metadata snapshot.",
+                   sumCounter(&LoopMetrics::snapshot_not_found));
+        }
+        if (!tls_certificate.empty()) {
+            sample("http_tls_handshakes_total", "counter", "TLS handshakes completed.",
+                   sumCounter(&LoopMetrics::tls_handshakes));
+            sample("http_tls_resumed_total", "counter", "TLS handshakes that resumed a session from a ticket.",
+                   sumCounter(&LoopMetrics::tls_resumed));
+            sample("http_tls_handshake_errors_total", "counter", "TLS handshakes that failed.",
+                   sumCounter(&LoopMetrics::tls_handshake_errors));
+            sample("http_ktls_connections_total", "counter", "TLS connections whose sends the kernel encrypts.",
+                   sumCounter(&LoopMetrics::ktls_connections));
+        }
+        if (http2) {
+            sample("http_http2_connections_total", "counter", "Connections that spoke HTTP/2.",
+                   sumCounter(&LoopMetrics::http2_connections));
+            sample("http_http2_streams_total", "counter", "HTTP/2 streams opened by clients.",
+                   sumCounter(&LoopMetrics::http2_streams));
+        }
+        if (open_files) {
+            sample("http_open_file_cache_invalidations_total", "counter",
+                   "Cached file descriptors dropped on inotify events.", open_files->invalidationCount());
+        }
+        if (worker_pool) {
+            sample("http_worker_queue_depth", "gauge", "Tasks waiting for a worker thread.", worker_pool->queueDepth());
+            sample("http_worker_tasks_completed_total", "counter", "Tasks run by worker threads.",
+                   worker_pool->completedCount());
+            sample("http_worker_tasks_rejected_total", "counter", "Tasks refused with 503 on a full queue.",
+                   worker_pool->rejectedCount());
+        }
+
+        struct Bound {
+            uint64_t nanos;
+            const char* label;
+        };
+        static constexpr Bound bounds[] = {
+            {1000, "1e-06"}, {2500, "2.5e-06"}, {5000, "5e-06"}, {10000, "1e-05"}, {25000, "2.5e-05"},
+            {50000, "5e-05"}, {100000, "0.0001"}, {250000, "0.00025"}, {500000, "0.0005"}, {1000000, "0.001"},
+            {2500000, "0.0025"}, {5000000, "0.005"}, {10000000, "0.01"}, {25000000, "0.025"},
+            {50000000, "0.05"}, {100000000, "0.1"}, {250000000, "0.25"}, {500000000, "0.5"},
+            {1000000000, "1"}, {2500000000, "2.5"}, {5000000000, "5"}, {10000000000, "10"},
+        };
+        auto histogram = [&](const char* name, const char* help, LatencyHistogram LoopMetrics::*field) {
+            header(name, "histogram", help);
+            uint64_t buckets[LatencyHistogram::kBuckets] = {};
+            uint64_t count = 0;
+            uint64_t sum = 0;
+            for (const auto& loop : loops) {
+                const LatencyHistogram& h = loop->metrics.*field;
+                for (size_t i = 0; i < LatencyHistogram::kBuckets; i++) {
+                    buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+                }
+                count += h.count.load(std::memory_order_relaxed);
+                sum += h.sum.load(std::memory_order_relaxed);
+            }
+            size_t next = 0;
+            uint64_t cumulative = 0;
+            for (const Bound& bound : bounds) {
+                while (next < LatencyHistogram::kBuckets && LatencyHistogram::upperBound(next) <= bound.nanos + 1) {
+                    cumulative += buckets[next++];
+                }
+                body += name;
+                body += "_bucket{le=\"";
+                body += bound.label;
+                body += "\"} ";
+                appendNumber(cumulative);
+                body += '\n';
+            }
+            // Buckets and count are read separately; keep +Inf consistent
+            while (next < LatencyHistogram::kBuckets) {
+                cumulative += buckets[next++];
+            }
+            body += name;
+            body += "_bucket{le=\"+Inf\"} ";
+            appendNumber(std::max(count, cumulative));
+            body += '\n';
+            char seconds[32];
+            int length = snprintf(seconds, sizeof(seconds), "%.9f", sum / 1e9);
+            body += name;
+            body += "_sum ";
+            body.append(seconds, length);
+            body += '\n';
+            body += name;
+            body += "_count ";
+            appendNumber(std::max(count, cumulative));
+            body += '\n';
+        };
+        histogram("http_request_parse_seconds", "Time to parse a complete request head.", &LoopMetrics::parse);
+        histogram("http_request_handle_seconds", "Time from a parsed head to its queued response, worker hop included.",
+                  &LoopMetrics::handle);
+        histogram("http_time_to_first_byte_seconds", "Time from reading a request to writing its response's first byte.",
+                  &LoopMetrics::first_byte);
 
-        std::string response_str = response.str();
-        send(client_socket, response_str.c_str(), response_str.length(), 0);
+        conn.startResponse(200);
+        conn.queueData("HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                       "Cache-Control: no-store\r\nContent-Length: ");
+        queueNumber(conn, body.size());
+        conn.queueData("\r\nServer: CPP-HTTP-Server/1.0\r\n");
+        queueTrailer(conn);
+        conn.queueData(body);
     }
 
 public:
     HTTPServer(int port = 8080, const std::string& web_root = "./www")
-        : port(port), web_root(web_root), running(false) {
-        setupMimeTypes();
+        : HTTPServer(ServerConfig{port, web_root}) {}
+
+    explicit HTTPServer(const ServerConfig& config)
+        : server_fd(-1), port(config.port), web_root(config.web_root), root_fd(-1),
+          loop_threads(std::max(1, config.loop_threads)), reuse_port(config.reuse_port),
+          pin_threads(config.pin_threads || !config.loop_cpus.empty()), loop_cpus(config.loop_cpus),
+          incoming_cpu(config.incoming_cpu), keepalive_timeout(config.keepalive_timeout),
+          max_keepalive_requests(config.max_keepalive_requests), max_connections(config.max_connections),
+          listen_backlog(std::max(1, config.listen_backlog)), defer_accept(config.defer_accept),
+          header_timeout(std::max(1, config.header_timeout)), body_timeout(std::max(1, config.body_timeout)),
+          write_timeout(std::max(1, config.write_timeout)),
+          max_header_bytes(std::max<size_t>(config.max_header_bytes, 1024)),
+          cache_max_file_bytes(config.cache_max_file_bytes),
+          cache_max_bytes(config.cache_max_bytes), open_file_cache_entries(config.open_file_cache_entries),
+          bundle_path(config.bundle_path),
+          bundle_populate(config.bundle_populate), bundle_lock(config.bundle_lock),
+          metadata_snapshot(config.metadata_snapshot || config.autoindex), autoindex(config.autoindex),
+          worker_threads(config.worker_threads),
+          worker_queue_limit(config.worker_queue_limit), io_backend(config.io_backend),
+          zerocopy(config.zerocopy), compression(config.compression), cache_control_rules(config.cache_control),
+          metrics_path(config.metrics_path), access_log_path(config.access_log_path),
+          access_log_format(config.access_log_format),
+          access_log_sample(std::clamp(config.access_log_sample, 0.0, 1.0)), trace_path(config.trace_path),
+          trace_events(config.trace_events), drain_timeout(std::max(0, config.drain_timeout)),
+          reload_socket(config.reload_socket), tls_certificate(config.tls_certificate),
+          tls_key(config.tls_key.empty() ? config.tls_certificate : config.tls_key),
+          tls_ticket_key_file(config.tls_ticket_key_file), http2(config.http2),
+          router(config.router && !config.router->empty() ? config.router : nullptr), running(false) {
+        if (pipe2(control_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            throw std::runtime_error("Failed to create control pipe");
+        }
+        loops_done_fd = eventfd(0, EFD_CLOEXEC);
+        if (loops_done_fd < 0) {
+            throw std::runtime_error("Failed to create control eventfd");
+        }
+        if (!tls_certificate.empty()) {
+#ifndef HTTP_HAVE_TLS
+            throw std::runtime_error("TLS requested but this build has no OpenSSL");
+#endif
+            // Handshakes and records need the readiness-driven read and write
+            // paths; io_uring receives straight into provided buffers
+            if (io_backend == IoBackend::Uring) {
+                throw std::runtime_error("TLS needs the epoll backend (--io=epoll)");
+            }
+        }
+        if (reload_socket.size() >= sizeof(sockaddr_un::sun_path)) {
+            throw std::runtime_error("Reload socket path is too long: " + reload_socket);
+        }
+        if (!config.mime_types_file.empty()) {
+            mime_types.loadFile(config.mime_types_file);
+        }
+        keepalive_header = "Connection: keep-alive\r\nKeep-Alive: timeout=" + std::to_string(keepalive_timeout) + "\r\n";
+        if (cache_max_bytes > 0) {
+            body_store = std::make_unique<BodyStore>();
+        }
+        if (!access_log_path.empty()) {
+            access_log = std::make_unique<AccessLog>(access_log_path, access_log_format);
+        }
     }
 
     ~HTTPServer() {
         stop();
+        open_files.reset();
+        tree_watcher.reset();
+        if (root_fd >= 0) {
+            close(root_fd);
+        }
+        for (int fd : {control_pipe[0], control_pipe[1], loops_done_fd, reload_fd, takeover_fd}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
     }
 
     void start() {
-        // Create socket
-        server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_fd < 0) {
-            throw std::runtime_error("Failed to create socket");
+        // The only canonicalization the server does; request paths are
+        // resolved lexically and opened beneath root_fd
+        std::error_code ec;
+        root_path = std::filesystem::canonical(std::filesystem::path(web_root), ec).string();
+        if (ec) {
+            throw std::runtime_error("Web root " + web_root + " is not accessible: " + ec.message());
+        }
+        root_fd = open(root_path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (root_fd < 0) {
+            throw std::runtime_error("Failed to open web root " + root_path);
+        }
+        if (open_file_cache_entries > 0) {
+            open_files = std::make_unique<OpenFileCache>(root_fd, root_path, open_file_cache_entries);
+        }
+        if (!bundle_path.empty()) {
+            publishBundle(mountBundle());
+        }
+        if (metadata_snapshot) {
+            auto scan_started = std::chrono::steady_clock::now();
+            unsigned scan_threads = std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+            tree_watcher = std::make_unique<TreeWatcher>(root_fd, root_path, mime_types, snapshot, scan_threads);
+            std::cout << "Metadata snapshot: " << tree_watcher->entryCount() << " entries in "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                                                               scan_started).count()
+                      << " ms" << std::endl;
         }
 
-        // Set socket options
-        int opt = 1;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-            throw std::runtime_error("Failed to set socket options");
+        // Each connection may hold a file open too, so by default half the
+        // descriptor limit goes to connections
+        size_t connection_limit = max_connections;
+        if (connection_limit == 0) {
+            struct rlimit limit;
+            connection_limit = 65536;
+            if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+                connection_limit = std::max<size_t>(1, limit.rlim_cur / 2);
+            }
         }
+        loop_max_connections = std::max<size_t>(1, (connection_limit + loop_threads - 1) / loop_threads);
 
-        // Bind socket
-        struct sockaddr_in address;
-        address.sin_family = AF_INET;
-        address.sin_addr.s_addr = INADDR_ANY;
-        address.sin_port = htons(port);
+        // Listeners handed over by a running process keep their mode: with
+        // SO_REUSEPORT set they are the per-loop group, otherwise the shared
+        // one. Surplus ones are closed; missing ones are created.
+        std::vector<int> inherited;
+        if (!reload_socket.empty()) {
+            inherited = takeOverListeners();
+        }
+        if (!inherited.empty()) {
+            int value = 0;
+            socklen_t length = sizeof(value);
+            reuse_port = getsockopt(inherited[0], SOL_SOCKET, SO_REUSEPORT, &value, &length) == 0 && value != 0;
+            size_t keep = reuse_port ? static_cast<size_t>(loop_threads) : 1;
+            for (size_t i = keep; i < inherited.size(); i++) {
+                close(inherited[i]);
+            }
+            inherited.resize(std::min(keep, inherited.size()));
+        }
 
-        if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-            throw std::runtime_error("Failed to bind socket");
+        // Shared mode: one listener polled by every loop. SO_REUSEPORT mode:
+        // one listener per loop and the kernel balances connections.
+        if (!reuse_port) {
+            server_fd = inherited.empty() ? createListener() : inherited[0];
+            shared_listener_users = loop_threads;
         }
 
-        // Listen for connections
-        if (listen(server_fd, 10) < 0) {
-            throw std::runtime_error("Failed to listen");
+        // Pinned loops take the listed CPUs, or those this process may run
+        // on, in turn
+        std::vector<int> cpus = loop_cpus;
+        if (pin_threads && cpus.empty()) {
+            cpu_set_t allowed;
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                    if (CPU_ISSET(cpu, &allowed)) {
+                        cpus.push_back(cpu);
+                    }
+                }
+            }
+            if (cpus.empty()) {
+                throw std::runtime_error("Failed to read the CPU affinity");
+            }
+        }
+        if (incoming_cpu) {
+            if (!reuse_port || cpus.empty()) {
+                throw std::runtime_error("--incoming-cpu needs --reuseport and pinned loops");
+            }
+            std::vector<int> distinct(cpus.begin(), cpus.begin() + std::min<size_t>(cpus.size(), loop_threads));
+            std::sort(distinct.begin(), distinct.end());
+            if (cpus.size() < static_cast<size_t>(loop_threads) ||
+                std::adjacent_find(distinct.begin(), distinct.end()) != distinct.end()) {
+                throw std::runtime_error("--incoming-cpu needs every loop on a CPU of its own");
+            }
+        }
+
+        // Create one epoll instance per loop thread; io_uring loops set up
+        // their ring on their own thread
+        std::vector<int> nodes;
+        for (int i = 0; i < loop_threads; i++) {
+            auto loop = std::make_unique<EventLoop>();
+            loop->index = i;
+            if (body_store) {
+                loop->file_cache = std::make_unique<FileCache>(std::max<size_t>(1, cache_max_bytes / loop_threads));
+            }
+            if (access_log) {
+                loop->access_log = std::make_unique<AccessLogRing>(access_log_sample);
+            }
+            if (!cpus.empty()) {
+                loop->cpu = cpus[i % cpus.size()];
+                loop->node = cpuNode(loop->cpu);
+                if (std::find(nodes.begin(), nodes.end(), loop->node) == nodes.end()) {
+                    nodes.push_back(loop->node);
+                }
+            }
+            if (!reuse_port) {
+                loop->listen_fd = server_fd;
+            } else if (static_cast<size_t>(i) < inherited.size()) {
+                loop->listen_fd = inherited[i];
+            } else {
+                loop->listen_fd = createListener();
+            }
+            loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (loop->wake_fd < 0) {
+                throw std::runtime_error("Failed to create event loop");
+            }
+            if (io_backend == IoBackend::Uring) {
+                loops.push_back(std::move(loop));
+                continue;
+            }
+
+            loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            if (loop->epoll_fd < 0) {
+                throw std::runtime_error("Failed to create event loop");
+            }
+
+            epoll_event ev{};
+            ev.events = reuse_port ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = nullptr;
+            if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0) {
+                throw std::runtime_error("Failed to register listener");
+            }
+            ev.events = EPOLLIN;
+            ev.data.ptr = loop.get();
+            if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+                throw std::runtime_error("Failed to register wakeup fd");
+            }
+            loops.push_back(std::move(loop));
+        }
+        numa_nodes = static_cast<int>(nodes.size());
+        if (access_log) {
+            std::vector<AccessLogRing*> rings;
+            for (auto& loop : loops) {
+                rings.push_back(loop->access_log.get());
+            }
+            access_log->start(std::move(rings));
+        }
+        if (incoming_cpu) {
+            steerIncomingCpu();
+        }
+
+#ifdef HTTP_HAVE_TLS
+        if (!tls_certificate.empty()) {
+            std::string ticket_keys = loadTicketKeys();
+            for (auto& loop : loops) {
+                loop->tls_ctx = createTlsContext(ticket_keys);
+            }
+        }
+#endif
+        if (worker_threads > 0) {
+            worker_pool = std::make_unique<ThreadPool>(worker_threads, worker_queue_limit);
         }
 
         running = true;
         std::cout << "Server started on port " << port << std::endl;
         std::cout << "Serving files from " << web_root << std::endl;
-
-        while (running) {
-            struct sockaddr_in client_address;
-            socklen_t client_len = sizeof(client_address);
-            
-            int client_socket = accept(server_fd, (struct sockaddr*)&client_address, &client_len);
-            if (client_socket < 0) {
-                if (running) {
-                    std::cerr << "Failed to accept connection" << std::endl;
+        std::cout << "Event loop threads: " << loop_threads
+                  << (io_backend == IoBackend::Uring ? " using io_uring" : " using epoll")
+                  << (reuse_port ? " (SO_REUSEPORT listener per thread)" : "") << std::endl;
+        if (!cpus.empty()) {
+            std::cout << "Loops pinned to CPUs";
+            for (auto& loop : loops) {
+                std::cout << (loop->index ? "," : " ") << loop->cpu;
+            }
+            if (numa_nodes > 1) {
+                std::cout << " on NUMA nodes";
+                for (auto& loop : loops) {
+                    std::cout << (loop->index ? "," : " ") << loop->node;
                 }
-                continue;
             }
+            std::cout << (incoming_cpu ? ", connections steered by receiving CPU" : "") << std::endl;
+        }
+        std::cout << "Connection limit: " << loop_max_connections * loop_threads << std::endl;
+        if (!tls_certificate.empty()) {
+            std::cout << "TLS with certificate " << tls_certificate << std::endl;
+        }
+        if (!trace_path.empty()) {
+            std::cout << "Tracing the last " << trace_events << " stages per loop; SIGUSR1 writes them to "
+                      << trace_path << std::endl;
+        }
+
+        for (auto& loop : loops) {
+            loop->thread = std::thread(&HTTPServer::runLoop, this, std::ref(*loop));
+        }
+
+        if (!reload_socket.empty()) {
+            if (takeover_fd >= 0) {
+                // The loops are accepting; the old process can drain now
+                char ready = 'R';
+                ssize_t ignored = write(takeover_fd, &ready, 1);
+                (void)ignored;
+                close(takeover_fd);
+                takeover_fd = -1;
+            }
+            listenForReload();
+        }
 
-            // Handle client in a new thread
-            client_threads.emplace_back(&HTTPServer::handleClient, this, client_socket);
+        supervise();
+        if (reload_fd >= 0) {
+            // Still ours: no successor has replaced it
+            close(reload_fd);
+            reload_fd = -1;
+            unlink(reload_socket.c_str());
+        }
+        for (auto& loop : loops) {
+            if (loop->thread.joinable()) {
+                loop->thread.join();
+            }
         }
 
-        // Wait for all client threads to finish
-        for (auto& thread : client_threads) {
-            if (thread.joinable()) {
-                thread.join();
+        // Workers may still post completions; run them so any opened files
+        // are released (their connections are already gone)
+        if (worker_pool) {
+            worker_pool->shutdown();
+            std::cout << "Worker pool: " << worker_pool->completedCount() << " tasks completed, "
+                      << worker_pool->rejectedCount() << " rejected" << std::endl;
+        }
+        for (auto& loop : loops) {
+            runCompletions(*loop);
+            if (loop->epoll_fd >= 0) {
+                close(loop->epoll_fd);
             }
+            close(loop->wake_fd);
+#ifdef HTTP_HAVE_TLS
+            SSL_CTX_free(loop->tls_ctx);
+#endif
+            if (reuse_port && loop->listen_fd >= 0) {
+                close(loop->listen_fd);
+            }
+        }
+        if (body_store) {
+            std::cout << "File cache: " << sumCounter(&LoopMetrics::cache_hits) << " hits, "
+                      << sumCounter(&LoopMetrics::cache_misses) << " misses, " << body_store->byteCount()
+                      << " bytes in " << body_store->bodyCount() << " bodies" << std::endl;
+        }
+        if (!bundle_path.empty()) {
+            std::cout << "Bundle: " << sumCounter(&LoopMetrics::bundle_hits) << " hits" << std::endl;
+        }
+        if (open_files) {
+            std::cout << "Open file cache: " << sumCounter(&LoopMetrics::open_file_hits) << " hits, "
+                      << open_files->invalidationCount() << " invalidations" << std::endl;
+        }
+        // The writer drains the loops' rings, so it stops first
+        if (access_log) {
+            access_log->stop();
+            std::cout << "Access log: " << access_log->writtenCount() << " records written, "
+                      << accessLogDrops() << " dropped" << std::endl;
+        }
+        loops.clear();
+
+        if (server_fd >= 0) {
+            close(server_fd);
+            server_fd = -1;
         }
     }
 
+    // Closes every connection at once
     void stop() {
         running = false;
-        close(server_fd);
+        // Wake every loop so it observes running == false
+        wakeLoops();
+        notify(0);
+    }
+
+    // Stops accepting and lets in-flight requests finish, for at most
+    // drain_timeout seconds
+    void drain() {
+        if (draining.load(std::memory_order_relaxed)) {
+            return;
+        }
+        drain_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(drain_timeout);
+        draining.store(true, std::memory_order_release);
+        wakeLoops();
+    }
+
+    // Async-signal-safe: hands the signal to the supervising thread
+    void notify(int signum) {
+        unsigned char byte = static_cast<unsigned char>(signum);
+        ssize_t ignored = write(control_pipe[1], &byte, 1);
+        (void)ignored;
     }
 };
 
-// Signal handler for graceful shutdown
+ResponseWriter& ResponseWriter::status(int code) {
+    if (Connection* conn = server->routeTarget(*this)) {
+        if (conn->route.head_sent) {
+            throw std::logic_error("Response status set after the head was sent");
+        }
+        if (code < 100 || code > 999) {
+            throw std::invalid_argument("Invalid response status " + std::to_string(code));
+        }
+        conn->route.status = code;
+    }
+    return *this;
+}
+
+ResponseWriter& ResponseWriter::header(std::string_view name, std::string_view value) {
+    if (Connection* conn = server->routeTarget(*this)) {
+        if (conn->route.head_sent) {
+            throw std::logic_error("Response header set after the head was sent");
+        }
+        if (name.empty() || name.find_first_of(":\r\n") != std::string_view::npos ||
+            value.find_first_of("\r\n") != std::string_view::npos) {
+            throw std::invalid_argument("Invalid response header " + std::string(name));
+        }
+        // Framing is the server's
+        if (RequestParser::equalsIgnoreCase(name, "Content-Length") ||
+            RequestParser::equalsIgnoreCase(name, "Transfer-Encoding") ||
+            RequestParser::equalsIgnoreCase(name, "Connection")) {
+            throw std::invalid_argument("Response header " + std::string(name) + " is set by the server");
+        }
+        std::string& headers = conn->route.headers;
+        headers.append(name).append(": ").append(value).append("\r\n");
+    }
+    return *this;
+}
+
+bool ResponseWriter::write(std::string_view bytes) {
+    Connection* conn = server->routeTarget(*this);
+    if (conn == nullptr) {
+        return false;
+    }
+    server->writeRoute(*conn, bytes);
+    return HTTPServer::routeQueued(*conn) <= kHighWater;
+}
+
+bool ResponseWriter::end(std::string_view bytes) {
+    Connection* conn = server->routeTarget(*this);
+    if (conn == nullptr) {
+        return false;
+    }
+    server->endRoute(*conn, bytes);
+    return true;
+}
+
+bool ResponseWriter::alive() const {
+    return server->routeTarget(*this) != nullptr;
+}
+
+size_t ResponseWriter::queued() const {
+    Connection* conn = server->routeTarget(*this);
+    return conn != nullptr ? HTTPServer::routeQueued(*conn) : 0;
+}
+
+void ResponseWriter::onDrain(std::function<void(ResponseWriter&)> resume) {
+    server->drainRoute(*this, std::move(resume));
+}
+
+void ResponseWriter::submit(std::function<void()> work, std::function<void(ResponseWriter&)> resume) {
+    server->deferRoute(*this, std::move(work), std::move(resume));
+}
+
+// SIGINT/SIGTERM drain the server; a second one stops it at once. SIGHUP
+// maps the bundle again and reopens the access log; SIGUSR1 writes the trace.
 HTTPServer* global_server = nullptr;
 void signal_handler(int signum) {
     if (global_server) {
-        std::cout << "\nShutting down server..." << std::endl;
-        global_server->stop();
+        global_server->notify(signum);
     }
 }
 
+// Programs that embed the server (with their own routes) define
+// HTTP_NO_MAIN and build it as part of themselves
+#ifndef HTTP_NO_MAIN
 int main(int argc, char* argv[]) {
     try {
-        int port = (argc > 1) ? std::stoi(argv[1]) : 8080;
-        std::string web_root = (argc > 2) ? argv[2] : "./www";
+        ServerConfig config;
+        std::vector<std::string> positional;
+        // --cpus sets the loop count unless --threads does
+        bool threads_given = false;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.rfind("--threads=", 0) == 0) {
+                config.loop_threads = std::stoi(arg.substr(10));
+                threads_given = true;
+            } else if (arg == "--reuseport") {
+                config.reuse_port = true;
+            } else if (arg == "--pin-threads") {
+                config.pin_threads = true;
+            } else if (arg.rfind("--cpus=", 0) == 0) {
+                config.loop_cpus = parseCpuList(std::string_view(arg).substr(7));
+                if (config.loop_cpus.empty()) {
+                    throw std::runtime_error("--cpus needs at least one CPU");
+                }
+                if (!threads_given) {
+                    config.loop_threads = static_cast<int>(config.loop_cpus.size());
+                }
+            } else if (arg == "--incoming-cpu") {
+                config.incoming_cpu = true;
+            } else if (arg.rfind("--access-log=", 0) == 0) {
+                config.access_log_path = arg.substr(13);
+            } else if (arg.rfind("--access-log-format=", 0) == 0) {
+                std::string format = arg.substr(20);
+                if (format == "combined") {
+                    config.access_log_format = AccessLogFormat::Combined;
+                } else if (format == "json") {
+                    config.access_log_format = AccessLogFormat::Json;
+                } else {
+                    throw std::runtime_error("--access-log-format expects combined or json");
+                }
+            } else if (arg.rfind("--access-log-sample=", 0) == 0) {
+                config.access_log_sample = std::stod(arg.substr(20));
+            } else if (arg.rfind("--trace=", 0) == 0) {
+                config.trace_path = arg.substr(8);
+            } else if (arg.rfind("--trace-events=", 0) == 0) {
+                config.trace_events = std::stoull(arg.substr(15));
+            } else if (arg.rfind("--keepalive-timeout=", 0) == 0) {
+                config.keepalive_timeout = std::stoi(arg.substr(20));
+            } else if (arg.rfind("--max-requests=", 0) == 0) {
+                config.max_keepalive_requests = std::stoi(arg.substr(15));
+            } else if (arg.rfind("--max-header-size=", 0) == 0) {
+                config.max_header_bytes = std::stoull(arg.substr(18));
+            } else if (arg.rfind("--workers=", 0) == 0) {
+                config.worker_threads = std::stoi(arg.substr(10));
+            } else if (arg.rfind("--worker-queue=", 0) == 0) {
+                config.worker_queue_limit = std::stoull(arg.substr(15));
+            } else if (arg.rfind("--cache-control=", 0) == 0) {
+                // --cache-control=/static/=public, max-age=31536000
+                std::string rule = arg.substr(16);
+                size_t equals = rule.find('=');
+                if (equals == std::string::npos || equals == 0) {
+                    throw std::runtime_error("--cache-control expects PREFIX=VALUE or TYPE=VALUE");
+                }
+                config.cache_control.emplace_back(rule.substr(0, equals), rule.substr(equals + 1));
+            } else if (arg == "--zerocopy") {
+                config.zerocopy = true;
+            } else if (arg == "--no-compression") {
+                config.compression = false;
+            } else if (arg == "--no-http2") {
+                config.http2 = false;
+            } else if (arg == "--io=epoll") {
+                config.io_backend = IoBackend::Epoll;
+            } else if (arg == "--io=uring") {
+                config.io_backend = IoBackend::Uring;
+            } else if (arg.rfind("--cache-size=", 0) == 0) {
+                config.cache_max_bytes = std::stoull(arg.substr(13));
+            } else if (arg.rfind("--cache-max-file=", 0) == 0) {
+                config.cache_max_file_bytes = std::stoull(arg.substr(17));
+            } else if (arg.rfind("--mime-types=", 0) == 0) {
+                config.mime_types_file = arg.substr(13);
+            } else if (arg.rfind("--max-connections=", 0) == 0) {
+                config.max_connections = std::stoull(arg.substr(18));
+            } else if (arg.rfind("--backlog=", 0) == 0) {
+                config.listen_backlog = std::stoi(arg.substr(10));
+            } else if (arg == "--no-defer-accept") {
+                config.defer_accept = false;
+            } else if (arg.rfind("--header-timeout=", 0) == 0) {
+                config.header_timeout = std::stoi(arg.substr(17));
+            } else if (arg.rfind("--body-timeout=", 0) == 0) {
+                config.body_timeout = std::stoi(arg.substr(15));
+            } else if (arg.rfind("--write-timeout=", 0) == 0) {
+                config.write_timeout = std::stoi(arg.substr(16));
+            } else if (arg.rfind("--drain-timeout=", 0) == 0) {
+                config.drain_timeout = std::stoi(arg.substr(16));
+            } else if (arg.rfind("--reload-socket=", 0) == 0) {
+                config.reload_socket = arg.substr(16);
+            } else if (arg == "--metrics") {
+                config.metrics_path = "/metrics";
+            } else if (arg.rfind("--metrics=", 0) == 0) {
+                config.metrics_path = arg.substr(10);
+            } else if (arg.rfind("--tls-cert=", 0) == 0) {
+                config.tls_certificate = arg.substr(11);
+            } else if (arg.rfind("--tls-key=", 0) == 0) {
+                config.tls_key = arg.substr(10);
+            } else if (arg.rfind("--tls-ticket-key=", 0) == 0) {
+                config.tls_ticket_key_file = arg.substr(17);
+            } else if (arg.rfind("--open-files=", 0) == 0) {
+                config.open_file_cache_entries = std::stoull(arg.substr(13));
+            } else if (arg.rfind("--bundle=", 0) == 0) {
+                config.bundle_path = arg.substr(9);
+            } else if (arg == "--bundle-populate") {
+                config.bundle_populate = true;
+            } else if (arg == "--bundle-lock") {
+                config.bundle_lock = true;
+            } else if (arg == "--snapshot") {
+                config.metadata_snapshot = true;
+            } else if (arg == "--autoindex") {
+                config.autoindex = true;
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (positional.size() > 0) config.port = std::stoi(positional[0]);
+        if (positional.size() > 1) config.web_root = positional[1];
+        std::string web_root = config.web_root;
 
         // Set up signal handling
-        global_server = new HTTPServer(port, web_root);
+        global_server = new HTTPServer(config);
         signal(SIGINT, signal_handler);
         signal(SIGTERM, signal_handler);
+        if (!config.bundle_path.empty() || !config.access_log_path.empty()) {
+            signal(SIGHUP, signal_handler);
+        }
+        if (!config.trace_path.empty()) {
+            signal(SIGUSR1, signal_handler);
+        }
+        // sendfile() has no MSG_NOSIGNAL; a peer reset must surface as EPIPE
+        signal(SIGPIPE, SIG_IGN);
 
         // Create web root directory if it doesn't exist
         std::filesystem::create_directories(web_root);
@@ -260,4 +10475,5 @@ int main(int argc, char* argv[]) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
-}
\ No newline at end of file
+}
+#endif
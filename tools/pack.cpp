@@ -0,0 +1,377 @@
+// Packs a web root into an asset bundle for `http --bundle=FILE`.
+//
+// Every regular file beneath the root becomes an entry keyed by its request
+// path, with its body and, for files that shrink, brotli, zstd and gzip
+// variants compressed at the encoders' highest settings (or taken from
+// precompressed siblings such as app.js.br). Compression happens once here
+// instead of on the server's workers. The bundle is written next to the
+// output path and renamed over it, so a server reloading it on SIGHUP never
+// sees a partial file. See bundle.h for the layout.
+#include "../bundle.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if !defined(HTTP_NO_ZLIB) && __has_include(<zlib.h>)
+#include <zlib.h>
+#define HTTP_HAVE_ZLIB 1
+#endif
+#if !defined(HTTP_NO_BROTLI) && __has_include(<brotli/encode.h>)
+#include <brotli/encode.h>
+#define HTTP_HAVE_BROTLI 1
+#endif
+#if !defined(HTTP_NO_ZSTD) && __has_include(<zstd.h>)
+#include <zstd.h>
+#define HTTP_HAVE_ZSTD 1
+#endif
+
+namespace {
+
+struct PackOptions {
+    // Bodies smaller than this are stored as they are
+    size_t min_compress_bytes = 256;
+    // Bodies larger than this are copied through without being read whole
+    size_t max_compress_bytes = 16 * 1024 * 1024;
+    bool compress = true;
+};
+
+struct SourceFile {
+    std::string request_path;
+    std::string source_path;
+    uint64_t path_hash;
+    uint64_t size;
+    int64_t mtime;
+};
+
+const char* const kSiblingSuffixes[kBundleVariants] = {"", ".br", ".zst", ".gz"};
+
+bool compressVariant(BundleVariant variant, const std::string& data, std::string& out) {
+    switch (variant) {
+#ifdef HTTP_HAVE_BROTLI
+    case BundleBrotli: {
+        size_t size = BrotliEncoderMaxCompressedSize(data.size());
+        out.resize(size);
+        if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, data.size(),
+                                   reinterpret_cast<const uint8_t*>(data.data()), &size,
+                                   reinterpret_cast<uint8_t*>(&out[0]))) {
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+#endif
+#ifdef HTTP_HAVE_ZSTD
+    case BundleZstd: {
+        out.resize(ZSTD_compressBound(data.size()));
+        size_t size = ZSTD_compress(&out[0], out.size(), data.data(), data.size(), ZSTD_maxCLevel());
+        if (ZSTD_isError(size)) {
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+#endif
+#ifdef HTTP_HAVE_ZLIB
+    case BundleGzip: {
+        z_stream stream{};
+        // 16 + MAX_WBITS selects the gzip wrapper
+        if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        out.resize(deflateBound(&stream, data.size()));
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        stream.avail_in = data.size();
+        stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        stream.avail_out = out.size();
+        int result = deflate(&stream, Z_FINISH);
+        size_t size = stream.total_out;
+        deflateEnd(&stream);
+        if (result != Z_STREAM_END) {
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+#endif
+    default:
+        (void)data;
+        (void)out;
+        return false;
+    }
+}
+
+std::string readFile(const std::string& path, uint64_t size) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+    }
+    std::string data(size, '\0');
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = read(fd, &data[done], size - done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            close(fd);
+            throw std::runtime_error("Cannot read " + path);
+        }
+        done += count;
+    }
+    close(fd);
+    return data;
+}
+
+// Appends to the bundle at increasing offsets; bodies are aligned on the
+// way in
+class BundleWriter {
+public:
+    BundleWriter(int fd, uint64_t offset) : fd(fd), offset(offset) {}
+
+    uint64_t position() const { return offset; }
+
+    uint64_t append(std::string_view bytes) {
+        uint64_t start = align(bytes.size());
+        writeAt(bytes.data(), bytes.size(), start);
+        offset = start + bytes.size();
+        return start;
+    }
+
+    // Streams a file too large to compress, hashing it on the way
+    uint64_t appendFile(const std::string& path, uint64_t size, uint64_t& hash) {
+        int source = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (source < 0) {
+            throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+        }
+        uint64_t start = align(size);
+        std::vector<char> buffer(1 << 20);
+        uint64_t done = 0;
+        while (done < size) {
+            ssize_t count = read(source, buffer.data(), std::min<uint64_t>(buffer.size(), size - done));
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                close(source);
+                throw std::runtime_error("Cannot read " + path);
+            }
+            hash = bundleHash(std::string_view(buffer.data(), count), hash);
+            writeAt(buffer.data(), count, start + done);
+            done += count;
+        }
+        close(source);
+        offset = start + size;
+        return start;
+    }
+
+    void writeAt(const void* data, size_t length, uint64_t at) {
+        const char* bytes = static_cast<const char*>(data);
+        while (length > 0) {
+            ssize_t count = pwrite(fd, bytes, length, at);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count < 0) {
+                throw std::runtime_error(std::string("Cannot write the bundle: ") + strerror(errno));
+            }
+            bytes += count;
+            length -= count;
+            at += count;
+        }
+    }
+
+private:
+    // A body of a page or more starts on a page of its own
+    uint64_t align(uint64_t length) const {
+        uint64_t alignment = length >= kBundlePageBytes ? kBundlePageBytes : 8;
+        return (offset + alignment - 1) & ~(alignment - 1);
+    }
+
+    int fd;
+    uint64_t offset;
+};
+
+// Regular files beneath root in index order. Symbolic links are left to
+// the server's disk path, which checks that they stay beneath the root.
+std::vector<SourceFile> collectFiles(const std::filesystem::path& root) {
+    std::vector<SourceFile> files;
+    std::error_code ec;
+    std::filesystem::recursive_directory_iterator it(root, ec), end;
+    if (ec) {
+        throw std::runtime_error("Cannot read " + root.string() + ": " + ec.message());
+    }
+    for (; it != end; it.increment(ec)) {
+        if (ec) {
+            throw std::runtime_error("Cannot read " + root.string() + ": " + ec.message());
+        }
+        struct stat st;
+        std::string source_path = it->path().string();
+        if (lstat(source_path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        SourceFile file;
+        file.request_path = "/" + it->path().lexically_relative(root).generic_string();
+        file.source_path = std::move(source_path);
+        file.path_hash = bundleHash(file.request_path);
+        file.size = st.st_size;
+        file.mtime = st.st_mtim.tv_sec;
+        files.push_back(std::move(file));
+    }
+    std::sort(files.begin(), files.end(), [](const SourceFile& a, const SourceFile& b) {
+        return a.path_hash != b.path_hash ? a.path_hash < b.path_hash : a.request_path < b.request_path;
+    });
+    return files;
+}
+
+const SourceFile* findFile(const std::vector<SourceFile>& files, const std::string& request_path) {
+    uint64_t hash = bundleHash(request_path);
+    auto it = std::lower_bound(files.begin(), files.end(), hash,
+                               [](const SourceFile& file, uint64_t value) { return file.path_hash < value; });
+    for (; it != files.end() && it->path_hash == hash; ++it) {
+        if (it->request_path == request_path) {
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+void pack(const std::filesystem::path& root, const std::string& output, const PackOptions& options) {
+    std::vector<SourceFile> files = collectFiles(root);
+    if (files.size() > UINT32_MAX) {
+        throw std::runtime_error("Too many files for one bundle");
+    }
+
+    BundleHeader header{};
+    std::memcpy(header.magic, kBundleMagic, sizeof(header.magic));
+    header.version = kBundleVersion;
+    header.entry_count = files.size();
+    header.index_offset = sizeof(BundleHeader);
+    header.paths_offset = header.index_offset + files.size() * sizeof(BundleEntry);
+
+    std::vector<BundleEntry> entries(files.size());
+    std::string paths;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (paths.size() + files[i].request_path.size() > UINT32_MAX) {
+            throw std::runtime_error("Paths too long for one bundle");
+        }
+        entries[i].path_hash = files[i].path_hash;
+        entries[i].mtime = files[i].mtime;
+        entries[i].path_offset = paths.size();
+        entries[i].path_length = files[i].request_path.size();
+        paths += files[i].request_path;
+    }
+    header.paths_bytes = paths.size();
+    uint64_t data_offset = (header.paths_offset + paths.size() + kBundlePageBytes - 1) & ~(kBundlePageBytes - 1);
+
+    std::string temporary = output + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot create " + temporary + ": " + strerror(errno));
+    }
+    try {
+        BundleWriter writer(fd, data_offset);
+        uint64_t compressed = 0;
+        for (size_t i = 0; i < files.size(); i++) {
+            const SourceFile& file = files[i];
+            BundleEntry& entry = entries[i];
+            if (file.size > options.max_compress_bytes) {
+                entry.content_hash = kBundleHashSeed;
+                entry.variants[BundleIdentity] = {writer.appendFile(file.source_path, file.size, entry.content_hash),
+                                                  file.size};
+                continue;
+            }
+
+            std::string body = readFile(file.source_path, file.size);
+            entry.content_hash = bundleHash(body);
+            entry.variants[BundleIdentity] = {writer.append(body), body.size()};
+            if (!options.compress || body.size() < options.min_compress_bytes) {
+                continue;
+            }
+            for (unsigned variant = BundleIdentity + 1; variant < kBundleVariants; variant++) {
+                // A precompressed sibling is what the server would have sent
+                std::string encoded;
+                const SourceFile* sibling = findFile(files, file.request_path + kSiblingSuffixes[variant]);
+                if (sibling != nullptr) {
+                    encoded = readFile(sibling->source_path, sibling->size);
+                } else if (!compressVariant(static_cast<BundleVariant>(variant), body, encoded)) {
+                    continue;
+                }
+                if (encoded.size() < body.size()) {
+                    entry.variants[variant] = {writer.append(encoded), encoded.size()};
+                    compressed++;
+                }
+            }
+        }
+
+        header.file_bytes = writer.position();
+        writer.writeAt(&header, sizeof(header), 0);
+        writer.writeAt(entries.data(), entries.size() * sizeof(BundleEntry), header.index_offset);
+        writer.writeAt(paths.data(), paths.size(), header.paths_offset);
+        if (ftruncate(fd, header.file_bytes) < 0 || fsync(fd) < 0) {
+            throw std::runtime_error(std::string("Cannot write the bundle: ") + strerror(errno));
+        }
+        std::cout << "Packed " << files.size() << " files and " << compressed << " compressed variants into "
+                  << output << " (" << header.file_bytes << " bytes)" << std::endl;
+    } catch (...) {
+        close(fd);
+        unlink(temporary.c_str());
+        throw;
+    }
+    close(fd);
+    if (rename(temporary.c_str(), output.c_str()) < 0) {
+        unlink(temporary.c_str());
+        throw std::runtime_error("Cannot rename " + temporary + " to " + output + ": " + strerror(errno));
+    }
+}
+
+void usage() {
+    std::cerr << "Usage: pack [--no-compress] [--min-compress=BYTES] [--max-compress=BYTES] WEB_ROOT BUNDLE"
+              << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    PackOptions options;
+    std::vector<std::string> positional;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--no-compress") {
+                options.compress = false;
+            } else if (arg.rfind("--min-compress=", 0) == 0) {
+                options.min_compress_bytes = std::stoull(arg.substr(15));
+            } else if (arg.rfind("--max-compress=", 0) == 0) {
+                options.max_compress_bytes = std::stoull(arg.substr(15));
+            } else if (arg.rfind("--", 0) == 0) {
+                usage();
+                return 1;
+            } else {
+                positional.push_back(arg);
+            }
+        }
+    } catch (const std::exception&) {
+        usage();
+        return 1;
+    }
+    if (positional.size() != 2) {
+        usage();
+        return 1;
+    }
+
+    try {
+        pack(positional[0], positional[1], options);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}